@@ -1,94 +1,276 @@
 #include "Base64.h"
+#include "WebSocketPlatform.h"
+
+#if ( defined(__x86_64__) || defined(__i386__) ) && defined(__GNUC__)
+#include <immintrin.h>
+#include <cpuid.h>
+#define BASE64_SSSE3 1
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#define BASE64_NEON 1
+#endif
 
 const char b64_alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
 		"abcdefghijklmnopqrstuvwxyz"
 		"0123456789+/";
 
-/* 'Private' declarations */
-inline void a3_to_a4(unsigned char * a4, unsigned char * a3);
-inline void a4_to_a3(unsigned char * a3, unsigned char * a4);
-inline unsigned char b64_lookup(char c);
-
-int base64_encode(char *output, char *input, int inputLen) {
-	int i = 0, j = 0;
-	int encLen = 0;
-	unsigned char a3[3];
-	unsigned char a4[4];
+/* Digit value of every character, 0xFF for characters outside the
+ * alphabet ('=' included). */
+static const uint8_t b64_values[256] PROGMEM = {
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,   62, 0xFF, 0xFF, 0xFF,   63,
+	  52,   53,   54,   55,   56,   57,   58,   59,   60,   61, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF,    0,    1,    2,    3,    4,    5,    6,    7,    8,    9,   10,   11,   12,   13,   14,
+	  15,   16,   17,   18,   19,   20,   21,   22,   23,   24,   25, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF,   26,   27,   28,   29,   30,   31,   32,   33,   34,   35,   36,   37,   38,   39,   40,
+	  41,   42,   43,   44,   45,   46,   47,   48,   49,   50,   51, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF
+};
 
-	while(inputLen--) {
-		a3[i++] = *(input++);
-		if(i == 3) {
-			a3_to_a4(a4, a3);
+static inline uint8_t b64_value(char c) {
+	return pgm_read_byte(&b64_values[(uint8_t)c]);
+}
 
-			for(i = 0; i < 4; i++) {
-				output[encLen++] = b64_alphabet[a4[i]];
-			}
+#if defined(BASE64_SSSE3)
 
-			i = 0;
-		}
+static bool haveSsse3() {
+	static int supported = -1;
+	if(supported < 0) {
+		unsigned int a, b, c, d;
+		supported = __get_cpuid(1, &a, &b, &c, &d) && (c & bit_SSSE3) ? 1 : 0;
 	}
+	return supported;
+}
 
-	if(i) {
-		for(j = i; j < 3; j++) {
-			a3[j] = '\0';
-		}
+/* 12 bytes to 16 digits per round. Reads 16 bytes, so stops with at least
+ * 4 bytes of input to spare; returns the count of bytes consumed. */
+__attribute__((target("ssse3")))
+static int encodeBlocks(char *output, const uint8_t *input, int inputLen) {
+	if(!haveSsse3())
+		return 0;
 
-		a3_to_a4(a4, a3);
+	const __m128i spread = _mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1);
+	const __m128i offsets = _mm_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+		'0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0);
 
-		for(j = 0; j < i + 1; j++) {
-			output[encLen++] = b64_alphabet[a4[j]];
-		}
+	int done = 0;
+	for(; inputLen - done >= 16; done += 12, output += 16) {
+		__m128i in = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(input + done)), spread);
 
-		while((i++ < 3)) {
-			output[encLen++] = '=';
-		}
+		// Cut each 24 bit group into four 6 bit indices, one per byte:
+		__m128i hi = _mm_mulhi_epu16(_mm_and_si128(in, _mm_set1_epi32(0x0fc0fc00)), _mm_set1_epi32(0x04000040));
+		__m128i lo = _mm_mullo_epi16(_mm_and_si128(in, _mm_set1_epi32(0x003f03f0)), _mm_set1_epi32(0x01000010));
+		__m128i indices = _mm_or_si128(hi, lo);
+
+		// Offset of each index's range: 52+ map to 1..12, 0..25 to 13, 26..51 to 0.
+		__m128i range = _mm_subs_epu8(indices, _mm_set1_epi8(51));
+		range = _mm_or_si128(range, _mm_and_si128(_mm_cmpgt_epi8(_mm_set1_epi8(26), indices), _mm_set1_epi8(13)));
+
+		_mm_storeu_si128((__m128i *)output, _mm_add_epi8(indices, _mm_shuffle_epi8(offsets, range)));
 	}
-	output[encLen] = '\0';
-	return encLen;
+	return done;
 }
 
-int base64_decode(char * output, char * input, int inputLen) {
-	int i = 0, j = 0;
-	int decLen = 0;
-	unsigned char a3[3];
-	unsigned char a4[4];
+/* 16 digits to 12 bytes per round, stopping at the first round that holds
+ * anything but alphabet characters. Returns the count of digits consumed. */
+__attribute__((target("ssse3")))
+static int decodeBlocks(uint8_t *output, const char *input, int inputLen) {
+	if(!haveSsse3())
+		return 0;
+
+	// Nibble tables flagging invalid characters, and per-range offsets (Muła).
+	const __m128i lowBits = _mm_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+		0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a);
+	const __m128i highBits = _mm_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+		0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+	const __m128i offsets = _mm_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+	const __m128i slash = _mm_set1_epi8(0x2f);
+	const __m128i pack = _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
 
+	int done = 0;
+	for(; inputLen - done >= 16; done += 16, output += 12) {
+		__m128i in = _mm_loadu_si128((const __m128i *)(input + done));
+		__m128i hiNibbles = _mm_and_si128(_mm_srli_epi32(in, 4), slash);
+		__m128i loNibbles = _mm_and_si128(in, slash);
 
-	while (inputLen--) {
-		if(*input == '=') {
+		__m128i invalid = _mm_and_si128(_mm_shuffle_epi8(lowBits, loNibbles), _mm_shuffle_epi8(highBits, hiNibbles));
+		if(_mm_movemask_epi8(_mm_cmpeq_epi8(invalid, _mm_setzero_si128())) != 0xffff)
 			break;
+
+		__m128i roll = _mm_shuffle_epi8(offsets, _mm_add_epi8(_mm_cmpeq_epi8(in, slash), hiNibbles));
+		__m128i values = _mm_add_epi8(in, roll);
+
+		// Merge four 6 bit values into each 24 bit group, then drop the gaps.
+		__m128i merged = _mm_madd_epi16(_mm_maddubs_epi16(values, _mm_set1_epi32(0x01400140)), _mm_set1_epi32(0x00011000));
+		merged = _mm_shuffle_epi8(merged, pack);
+
+		// Only 12 of the 16 bytes are ours to write.
+		_mm_storel_epi64((__m128i *)output, merged);
+		uint32_t tail = _mm_cvtsi128_si32(_mm_srli_si128(merged, 8));
+		memcpy(output + 8, &tail, 4);
+	}
+	return done;
+}
+
+#elif defined(BASE64_NEON)
+
+/* 48 bytes to 64 digits per round; returns the count of bytes consumed. */
+static int encodeBlocks(char *output, const uint8_t *input, int inputLen) {
+	const uint8x16x4_t alphabet = vld1q_u8_x4((const uint8_t *)b64_alphabet);
+	const uint8x16_t sixBits = vdupq_n_u8(0x3f);
+
+	int done = 0;
+	for(; inputLen - done >= 48; done += 48, output += 64) {
+		uint8x16x3_t in = vld3q_u8(input + done);
+		uint8x16x4_t out;
+		out.val[0] = vshrq_n_u8(in.val[0], 2);
+		out.val[1] = vandq_u8(vorrq_u8(vshlq_n_u8(in.val[0], 4), vshrq_n_u8(in.val[1], 4)), sixBits);
+		out.val[2] = vandq_u8(vorrq_u8(vshlq_n_u8(in.val[1], 2), vshrq_n_u8(in.val[2], 6)), sixBits);
+		out.val[3] = vandq_u8(in.val[2], sixBits);
+		for(int i = 0; i < 4; i++)
+			out.val[i] = vqtbl4q_u8(alphabet, out.val[i]);
+		vst4q_u8((uint8_t *)output, out);
+	}
+	return done;
+}
+
+/* 64 digits to 48 bytes per round, stopping at the first round that holds
+ * anything but alphabet characters. Returns the count of digits consumed. */
+static int decodeBlocks(uint8_t *output, const char *input, int inputLen) {
+	// The first half of b64_values; everything from 0x80 up is invalid anyway.
+	const uint8x16x4_t low = vld1q_u8_x4(b64_values);
+	const uint8x16x4_t high = vld1q_u8_x4(b64_values + 64);
+	const uint8x16_t sixtyFour = vdupq_n_u8(64);
+
+	int done = 0;
+	for(; inputLen - done >= 64; done += 64, output += 48) {
+		uint8x16x4_t in = vld4q_u8((const uint8_t *)input + done);
+		uint8x16_t errors = vdupq_n_u8(0);
+		for(int i = 0; i < 4; i++) {
+			uint8x16_t c = in.val[i];
+			uint8x16_t v = vqtbx4q_u8(vqtbl4q_u8(low, c), high, vsubq_u8(c, sixtyFour));
+			// Invalid digits and non-ASCII characters both have the top bit set.
+			errors = vorrq_u8(errors, vorrq_u8(v, c));
+			in.val[i] = v;
 		}
+		if(vmaxvq_u8(errors) & 0x80)
+			break;
+
+		uint8x16x3_t out;
+		out.val[0] = vorrq_u8(vshlq_n_u8(in.val[0], 2), vshrq_n_u8(in.val[1], 4));
+		out.val[1] = vorrq_u8(vshlq_n_u8(in.val[1], 4), vshrq_n_u8(in.val[2], 2));
+		out.val[2] = vorrq_u8(vshlq_n_u8(in.val[2], 6), in.val[3]);
+		vst3q_u8(output, out);
+	}
+	return done;
+}
 
-		a4[i++] = *(input++);
-		if (i == 4) {
-			for (i = 0; i <4; i++) {
-				a4[i] = b64_lookup(a4[i]);
-			}
+#else
 
-			a4_to_a3(a3,a4);
+static inline int encodeBlocks(char *, const uint8_t *, int) { return 0; }
+static inline int decodeBlocks(uint8_t *, const char *, int) { return 0; }
 
-			for (i = 0; i < 3; i++) {
-				output[decLen++] = a3[i];
-			}
+#endif
+
+int base64_encode(char *output, char *input, int inputLen) {
+	const uint8_t *in = (const uint8_t *)input;
+	int done = encodeBlocks(output, in, inputLen);
+	int encLen = done / 3 * 4;
+
+	for(; inputLen - done >= 3; done += 3) {
+		uint32_t group = ((uint32_t)in[done] << 16) | ((uint32_t)in[done + 1] << 8) | in[done + 2];
+		output[encLen++] = b64_alphabet[(group >> 18) & 0x3f];
+		output[encLen++] = b64_alphabet[(group >> 12) & 0x3f];
+		output[encLen++] = b64_alphabet[(group >> 6) & 0x3f];
+		output[encLen++] = b64_alphabet[group & 0x3f];
+	}
+
+	if(inputLen > done) {
+		uint32_t group = (uint32_t)in[done] << 16;
+		if(inputLen - done > 1)
+			group |= (uint32_t)in[done + 1] << 8;
+		output[encLen++] = b64_alphabet[(group >> 18) & 0x3f];
+		output[encLen++] = b64_alphabet[(group >> 12) & 0x3f];
+		output[encLen++] = inputLen - done > 1 ? b64_alphabet[(group >> 6) & 0x3f] : '=';
+		output[encLen++] = '=';
+	}
+	output[encLen] = '\0';
+	return encLen;
+}
+
+int base64_decode(char * output, char * input, int inputLen) {
+	uint8_t *out = (uint8_t *)output;
+	int done = decodeBlocks(out, input, inputLen);
+	int decLen = done / 4 * 3;
+
+	// Up to the first '=', four digits at a time. Characters outside the
+	// alphabet decode as all ones, as they always have.
+	uint8_t a4[4];
+	int i = 0;
+	for(; done < inputLen && input[done] != '='; done++) {
+		a4[i++] = b64_value(input[done]);
+		if(i == 4) {
+			out[decLen++] = (a4[0] << 2) + ((a4[1] & 0x30) >> 4);
+			out[decLen++] = ((a4[1] & 0xf) << 4) + ((a4[2] & 0x3c) >> 2);
+			out[decLen++] = ((a4[2] & 0x3) << 6) + a4[3];
 			i = 0;
 		}
 	}
 
-	if (i) {
-		for (j = i; j < 4; j++) {
-			a4[j] = '\0';
-		}
+	if(i > 1)
+		out[decLen++] = (a4[0] << 2) + ((a4[1] & 0x30) >> 4);
+	if(i > 2)
+		out[decLen++] = ((a4[1] & 0xf) << 4) + ((a4[2] & 0x3c) >> 2);
 
-		for (j = 0; j <4; j++) {
-			a4[j] = b64_lookup(a4[j]);
-		}
+	output[decLen] = '\0';
+	return decLen;
+}
+
+int base64_decode_strict(char *output, const char *input, int inputLen) {
+	if(inputLen < 0 || inputLen % 4)
+		return -1;
+
+	// Leave the final group, which may be padded, to the scalar code.
+	uint8_t *out = (uint8_t *)output;
+	int done = decodeBlocks(out, input, inputLen - 4);
+	int decLen = done / 4 * 3;
 
-		a4_to_a3(a3,a4);
+	for(; done < inputLen; done += 4) {
+		uint8_t a = b64_value(input[done]);
+		uint8_t b = b64_value(input[done + 1]);
+		uint8_t c = b64_value(input[done + 2]);
+		uint8_t d = b64_value(input[done + 3]);
+		if((a | b | c | d) != 0xFF) {
+			out[decLen++] = (a << 2) | (b >> 4);
+			out[decLen++] = (b << 4) | (c >> 2);
+			out[decLen++] = (c << 6) | d;
+			continue;
+		}
 
-		for (j = 0; j < i - 1; j++) {
-			output[decLen++] = a3[j];
+		// Padding: only in the last group, and only where the bits it
+		// stands in for are zero.
+		if(done + 4 != inputLen || (a | b) == 0xFF || input[done + 3] != '=')
+			return -1;
+		if(input[done + 2] == '=') {
+			if(b & 0x0f)
+				return -1;
+			out[decLen++] = (a << 2) | (b >> 4);
+		} else {
+			if(c == 0xFF || (c & 0x03))
+				return -1;
+			out[decLen++] = (a << 2) | (b >> 4);
+			out[decLen++] = (b << 4) | (c >> 2);
 		}
 	}
+
 	output[decLen] = '\0';
 	return decLen;
 }
@@ -101,33 +283,9 @@ int base64_enc_len(int plainLen) {
 int base64_dec_len(char * input, int inputLen) {
 	int i = 0;
 	int numEq = 0;
-	for(i = inputLen - 1; input[i] == '='; i--) {
+	for(i = inputLen - 1; i >= 0 && input[i] == '='; i--) {
 		numEq++;
 	}
 
 	return ((6 * inputLen) / 8) - numEq;
 }
-
-inline void a3_to_a4(unsigned char * a4, unsigned char * a3) {
-	a4[0] = (a3[0] & 0xfc) >> 2;
-	a4[1] = ((a3[0] & 0x03) << 4) + ((a3[1] & 0xf0) >> 4);
-	a4[2] = ((a3[1] & 0x0f) << 2) + ((a3[2] & 0xc0) >> 6);
-	a4[3] = (a3[2] & 0x3f);
-}
-
-inline void a4_to_a3(unsigned char * a3, unsigned char * a4) {
-	a3[0] = (a4[0] << 2) + ((a4[1] & 0x30) >> 4);
-	a3[1] = ((a4[1] & 0xf) << 4) + ((a4[2] & 0x3c) >> 2);
-	a3[2] = ((a4[2] & 0x3) << 6) + a4[3];
-}
-
-inline unsigned char b64_lookup(char c) {
-	int i;
-	for(i = 0; i < 64; i++) {
-		if(b64_alphabet[i] == c) {
-			return i;
-		}
-	}
-
-	return -1;
-}
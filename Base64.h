@@ -42,6 +42,27 @@ int base64_encode(char *output, char *input, int inputLen);
  */
 int base64_decode(char *output, char *input, int inputLen);
 
+/* base64_decode_strict:
+ * 		Description:
+ * 			Decode a base64 encoded string into bytes, rejecting anything
+ * 			that isn't canonical base64: lengths that aren't a multiple
+ * 			of four, characters outside the alphabet, misplaced padding
+ * 			and padded groups with non-zero leftover bits
+ * 		Parameters:
+ * 			output: the output buffer for the decoding,
+ * 					stores the decoded binary and a terminating zero
+ * 			input: the input buffer for the decoding,
+ * 				   stores the base64 string to be decoded
+ * 			inputLen: the length of the input buffer, in bytes
+ * 		Return value:
+ * 			Returns the length of the decoded string, or -1 if the
+ * 			input is not valid base64
+ * 		Requirements:
+ * 			1. output must hold base64_dec_len(input, inputLen) + 1 bytes
+ * 			2. input must not be null
+ */
+int base64_decode_strict(char *output, const char *input, int inputLen);
+
 /* base64_enc_len:
  * 		Description:
  * 			Returns the length of a base64 encoded string whose decoded
@@ -1,57 +1,141 @@
 #include "WebSocket.h"
 #include "WebSocketServer.h"
 
+#include "WebSocketMask.h"
 #include "Base64.h"
 #include "sha1.h"
 
 //#define DEBUG 1
 
-Frame frame;
-word frameCapacity = 0;
-bool initialised = false;
+#if WEBSOCKET_DEFLATE
+// A message on its way out through WebSocketDeflate::compress().
+typedef struct {
+    WebSocket *socket;
+    byte opcode;
+    bool first;
+} DeflatedMessage;
+#endif
 
-// Utility:
-void WebSocket::initialise( word maxFrameSize )
+#if WEBSOCKET_DEFAULT_TRANSPORT
+WebSocket::WebSocket( word maxFrameSize ) :
+    onConnect(NULL),
+    onDisconnect(NULL),
+    onData(NULL),
+    onDataChunk(NULL),
+    m_socket(new DefaultTransport()),
+    m_ownsSocket(true),
+    m_state(DISCONNECTED),
+    m_keepaliveInterval(10000),
+    m_timeout(30000),
+    m_lastPacketTime(0),
+    m_lastPingTime(0),
+    m_pool(new WebSocketBufferPool(WEBSOCKET_SLAB_SIZE(maxFrameSize), 2)), // Receive buffer and printf().
+    m_ownsPool(true),
+    m_rxBuffer(NULL),
+    m_parseState(FRAME_HEADER),
+    m_payloadOffset(0),
+    m_writeFailures(0),
+    m_totalWriteFailures(0),
+    m_messageOpcode(0),
+    m_inMessage(false),
+    m_messageLength(0)
 {
-    // This buffer is shared between WebSocket/WebSocketServer contexts:
-    if( maxFrameSize > frameCapacity )
-    {
-        if( initialised )
-            delete frame.data;
-        frameCapacity = maxFrameSize;
-        frame.data = new char[maxFrameSize];
-    }
-
+    m_rxCapacity = m_pool->slabSize();
+    m_rxStart = m_rxEnd = 0;
+    m_client = false;
+    m_maskState = m_keySeed = 0;
+    m_streamOffset = 0;
+#if WEBSOCKET_COROUTINES
+    m_receiver = NULL;
+#endif
+#if WEBSOCKET_DEFLATE
+    m_deflateOptions = NULL;
+    m_deflate = NULL;
+    m_messageCompressed = false;
+#endif
 #ifdef DEBUG
-    Serial.print(F("Frame capacity: "));
-    Serial.println(frameCapacity);
+    Serial.println(F("WebSocket::WebSocket()"));
 #endif
-
-    initialised = true;
 }
+#endif
 
-void WebSocket::deinitialise()
+WebSocket::WebSocket( WebSocketTransport *transport, word maxFrameSize ) :
+    onConnect(NULL),
+    onDisconnect(NULL),
+    onData(NULL),
+    onDataChunk(NULL),
+    m_socket(transport),
+    m_ownsSocket(false),
+    m_state(DISCONNECTED),
+    m_keepaliveInterval(10000),
+    m_timeout(30000),
+    m_lastPacketTime(0),
+    m_lastPingTime(0),
+    m_pool(new WebSocketBufferPool(WEBSOCKET_SLAB_SIZE(maxFrameSize), 2)), // Receive buffer and printf().
+    m_ownsPool(true),
+    m_rxBuffer(NULL),
+    m_parseState(FRAME_HEADER),
+    m_payloadOffset(0),
+    m_writeFailures(0),
+    m_totalWriteFailures(0),
+    m_messageOpcode(0),
+    m_inMessage(false),
+    m_messageLength(0)
 {
-    if( initialised ) return;
-
-    frameCapacity = 0;
-    delete frame.data;
-    initialised = false;
+    m_rxCapacity = m_pool->slabSize();
+    m_rxStart = m_rxEnd = 0;
+    m_client = false;
+    m_maskState = m_keySeed = 0;
+    m_streamOffset = 0;
+#if WEBSOCKET_COROUTINES
+    m_receiver = NULL;
+#endif
+#if WEBSOCKET_DEFLATE
+    m_deflateOptions = NULL;
+    m_deflate = NULL;
+    m_messageCompressed = false;
+#endif
+#ifdef DEBUG
+    Serial.println(F("WebSocket::WebSocket()"));
+#endif
 }
 
-WebSocket::WebSocket( word maxFrameSize ) :
+WebSocket::WebSocket( WebSocketTransport *transport, WebSocketBufferPool *pool ) :
     onConnect(NULL),
     onDisconnect(NULL),
     onData(NULL),
-    m_socket(NULL),
+    onDataChunk(NULL),
+    m_socket(transport),
+    m_ownsSocket(false),
     m_state(DISCONNECTED),
     m_keepaliveInterval(10000),
     m_timeout(30000),
     m_lastPacketTime(0),
-    m_lastPingTime(0)
+    m_lastPingTime(0),
+    m_pool(pool),
+    m_ownsPool(false),
+    m_rxBuffer(NULL),
+    m_parseState(FRAME_HEADER),
+    m_payloadOffset(0),
+    m_writeFailures(0),
+    m_totalWriteFailures(0),
+    m_messageOpcode(0),
+    m_inMessage(false),
+    m_messageLength(0)
 {
-    // In case it hasn't been done:
-    WebSocket::initialise(maxFrameSize);
+    m_rxCapacity = m_pool->slabSize();
+    m_rxStart = m_rxEnd = 0;
+    m_client = false;
+    m_maskState = m_keySeed = 0;
+    m_streamOffset = 0;
+#if WEBSOCKET_COROUTINES
+    m_receiver = NULL;
+#endif
+#if WEBSOCKET_DEFLATE
+    m_deflateOptions = NULL;
+    m_deflate = NULL;
+    m_messageCompressed = false;
+#endif
 #ifdef DEBUG
     Serial.println(F("WebSocket::WebSocket()"));
 #endif
@@ -61,16 +145,35 @@ WebSocket::~WebSocket()
 {
     if( connected() )
         close();
+
+#if WEBSOCKET_COROUTINES
+    if( m_receiver )
+    {
+        m_receiver->close();
+        delete m_receiver;
+    }
+#endif
+
+    releaseBuffer( true );
+    if( m_ownsPool )
+        delete m_pool;
+
+#if WEBSOCKET_DEFLATE
+    delete m_deflate;
+#endif
+
+    if( m_ownsSocket )
+        delete m_socket;
 }
 
 bool WebSocket::connect( const char *url )
 {
     char host[32];
-    word port;
+    unsigned int port;
     char resource[64];
     resource[0] = '/'; // Resources expect a leading slash.
     resource[1] = '\0';
-    if( EOF == sscanf( url, "ws://%31[^:]:%99d/%63[^\n]", host, &port, &resource[1] ) )
+    if( sscanf( url, "ws://%31[^:]:%5u/%62[^\n]", host, &port, &resource[1] ) < 2 || !port || port > 0xffff )
     {
 #ifdef DEBUG
         Serial.println(F("Malformed URL, expected 'ws://<host>:<port>[/resource]' format."));
@@ -78,7 +181,13 @@ bool WebSocket::connect( const char *url )
         return false;
     }
 
-    if( !m_socket.connect( host, port ) )
+    releaseBuffer( true ); // Nothing from a previous connection carries over.
+#if WEBSOCKET_DEFLATE
+    delete m_deflate;
+    m_deflate = NULL;
+#endif
+
+    if( !m_socket->connect( host, port ) )
     {
 #ifdef DEBUG
         Serial.println(F("Connection to remote server failed."));
@@ -86,6 +195,16 @@ bool WebSocket::connect( const char *url )
         return false;
     }
 
+#if WEBSOCKET_COROUTINES
+    if( m_receiver )
+        m_receiver->reopen();
+#endif
+
+    // Clients mask what they send, each connection with its own keys.
+    m_client = true;
+    m_maskState = websocket_mask_seed();
+
+    m_lastPacketTime = m_lastPingTime = millis();
     if( !sendOutboundHandshakeRequest( resource, host, port ) )
     {
         close();
@@ -103,87 +222,143 @@ void WebSocket::close() {
     if( onDisconnect )
         onDisconnect(*this, m_disconnectOpaque);
 
-    m_socket.flush();
-    delayMicroseconds(10000);
-    m_socket.stop();
+    m_socket->flush();
+    m_socket->stop();
+
+#if WEBSOCKET_COROUTINES
+    if( m_receiver )
+        m_receiver->close();
+#endif
 }
 
 void WebSocket::listen()
 {
-    if( !m_socket.available() )
+    if( !m_socket->connected() )
+    {
+        if( m_state != DISCONNECTED )
+            close();
+        releaseBuffer( true );
         return;
+    }
 
-    if( !m_socket.connected() )
-        close();
-    else if( m_state == CONNECTED && !getFrame() )
+    if( m_state == CONNECTED && !getFrame() )
         // Got unhandled frame, disconnect
         close();
-    else if( m_state == HANDSHAKE && !outboundHandshake() )
+    else if( m_state == HANDSHAKE && m_socket->available() && !outboundHandshake() )
         close();
+    else
+        checkTimeout();
 }
 
-char *WebSocket::checksum( char *key )
+#if WEBSOCKET_COROUTINES
+WebSocketReceiver *WebSocket::receiver()
 {
+    if( !m_receiver )
+    {
+        m_receiver = new WebSocketReceiver();
+        registerDataCallback( &WebSocketReceiver::deliver, m_receiver );
+    }
+    return m_receiver;
+}
+
+WebSocketReceiver::Awaiter WebSocket::receive()
+{
+    // Nothing will come, don't wait for it.
+    if( !m_receiver && m_state == DISCONNECTED )
+        return WebSocketReceiver::Awaiter( NULL );
+    return WebSocketReceiver::Awaiter( receiver() );
+}
+#endif
+
+void WebSocket::checksum( char *result, const char *key )
+{
+    // Well-formed keys take the fixed-length path:
+    if( key && strlen(key) == WEBSOCKET_KEY_LENGTH )
+    {
+        websocket_accept( result, key );
+        return;
+    }
+
     Sha1.init();
     if( key )
         Sha1.print(key);
     Sha1.print( F("258EAFA5-E914-47DA-95CA-C5AB0DC85B11") ); // Add the omni-valid GUID
-    uint8_t *hash = Sha1.result();
-
-    char *buf = new char[ 29 ];
-    base64_encode( buf, (char*)hash, 20 );
-    return buf;
+    base64_encode( result, (char*)Sha1.result(), 20 );
 }
 
 bool WebSocket::sendOutboundHandshakeRequest(const char *resource, const char *host, word port)
 {
-    char *csum = checksum();
-    word written = snprintf_P( frame.data, frameCapacity, PSTR("GET %s HTTP/1.1\r\nHost: %s:%d\r\nUpgrade: websocket\r\nConnection: Upgrade\r\nSec-WebSocket-Key: %s\r\nSec-WebSocket-Version: 13\r\n\r\n"), resource, host, port, csum);
-    delete csum;
+    char request[WEBSOCKET_HANDSHAKE_BUFFER];
+
+    // A fresh Sec-WebSocket-Key. Only its seed is kept for checking the
+    // response, not the key or the accept value.
+    m_keySeed = websocket_mask_seed();
+    char key[WEBSOCKET_KEY_LENGTH + 1];
+    handshakeKey( key, m_keySeed );
+
+    const char *extensions = "";
+#if WEBSOCKET_DEFLATE
+    char offer[WEBSOCKET_DEFLATE_HEADER];
+    if( m_deflateOptions )
+    {
+        WebSocketDeflate::offer( offer, sizeof(offer), *m_deflateOptions );
+        extensions = offer;
+    }
+#endif
+
+    int written = snprintf_P( request, sizeof(request), PSTR("GET %s HTTP/1.1\r\nHost: %s:%d\r\nUpgrade: websocket\r\nConnection: Upgrade\r\nSec-WebSocket-Key: %s\r\nSec-WebSocket-Version: 13\r\n%s%s%s\r\n"), resource, host, port, key,
+        *extensions ? "Sec-WebSocket-Extensions: " : "", extensions, *extensions ? CRLF : "" );
+
+    if( written < 0 || written >= (int)sizeof(request) )
+        return false; // Resource and host too long to fit.
 
 #ifdef DEBUG
     Serial.println(written);
-    Serial.write((const uint8_t *)frame.data, written);
+    Serial.write((const uint8_t *)request, written);
 #endif
-    m_socket.write( (const uint8_t *)frame.data, written );
+    WEBSOCKET_COUNT( bytesOut, written );
+    if( m_socket->write( (const uint8_t *)request, written ) != (size_t)written )
+        return false;
 
+    m_handshake.reset( WebSocketHandshake::RESPONSE );
     setStatus( HANDSHAKE );
+    return true;
 }
 
-bool WebSocket::outboundHandshake()
+void WebSocket::handshakeKey( char *key, uint32_t seed )
 {
-    bool hasUpgrade = false;
-    bool hasConnection = false;
-    bool hasAccept = false;
-
-    byte counter = 0;
-    char bite;
-
-    // Receive result:
-    while( counter < frameCapacity && (bite = m_socket.read()) != -1 )
+    // 16 bytes in Base64, which servers insist on.
+    uint8_t nonce[16];
+    for( byte i=0; i < sizeof(nonce); i += 4 )
     {
-        frame.data[counter++] = bite;
-        frame.data[counter] = '\0';
-        if( '\n' != bite ) continue;
-
-#ifdef DEBUG
-        Serial.print("Got header: ");
-        Serial.println(frame.data);
-#endif
+        uint32_t bits = websocket_mask_next( seed );
+        memcpy( nonce + i, &bits, 4 );
+    }
+    base64_encode( key, (char *)nonce, sizeof(nonce) );
+}
 
-        if( strstr_P( frame.data, PSTR("Upgrade: ") ) )         hasUpgrade = true;
-        else if( strstr_P( frame.data, PSTR("Connection: ") ) ) hasConnection = true;
-        else if( strstr_P( frame.data, PSTR("Sec-WebSocket-Accept: ") ) )       hasAccept = true;
+bool WebSocket::acceptValid()
+{
+    char key[WEBSOCKET_KEY_LENGTH + 1];
+    char accept[WEBSOCKET_ACCEPT_LENGTH + 1];
+    handshakeKey( key, m_keySeed );
+    websocket_accept( accept, key );
+    return !strcmp( accept, m_handshake.key() );
+}
 
-        counter = 0; // Start saving new header string
-    }
+bool WebSocket::outboundHandshake()
+{
+    WebSocketHandshake::Result result = readHandshake();
+    if( result == WebSocketHandshake::INCOMPLETE )
+        return true; // The rest is still on its way.
 
-    // Assert that we have all headers that are needed. If so, go ahead and
-    // send response headers.
-    if( !hasUpgrade || !hasConnection || !hasAccept )
+    // Assert that we have all headers that are needed.
+    if( result == WebSocketHandshake::FAILED || !m_handshake.has( WebSocketHandshake::HAS_START_LINE | WebSocketHandshake::HAS_UPGRADE | WebSocketHandshake::HAS_CONNECTION | WebSocketHandshake::HAS_KEY ) ||
+        !acceptValid() || ( m_handshake.has( WebSocketHandshake::HAS_EXTENSIONS ) && !confirmExtensions() ) )
     {
 #ifdef DEBUG
-        Serial.println(F("Handshake failed!"));
+        Serial.print(F("Handshake failed! Found: "));
+        Serial.println(m_handshake.found());
 #endif
         close();
         return false;
@@ -200,106 +375,470 @@ bool WebSocket::outboundHandshake()
     return true;
 }
 
-bool WebSocket::getFrame()
+bool WebSocket::confirmExtensions()
+{
+#if WEBSOCKET_DEFLATE
+    WebSocketDeflate::Params params;
+    if( m_deflateOptions && WebSocketDeflate::confirm( m_handshake.extensions(), *m_deflateOptions, params ) )
+    {
+        startDeflate( *m_deflateOptions, params );
+        return true;
+    }
+#endif
+    return false; // We offered nothing else.
+}
+
+#if WEBSOCKET_DEFLATE
+void WebSocket::startDeflate( const WebSocketDeflateOptions &options, const WebSocketDeflate::Params &params )
 {
-    byte bite;
+    // Decompressed messages are held to the same size as plain ones.
+    delete m_deflate;
+    m_deflate = new WebSocketDeflate( options, params, WEBSOCKET_SLAB_FRAME(m_rxCapacity) );
+}
+#endif
+
+WebSocketHandshake::Result WebSocket::readHandshake()
+{
+    if( fillBuffer() < 0 )
+        return WebSocketHandshake::FAILED;
+    if( !m_rxBuffer )
+        return WebSocketHandshake::INCOMPLETE; // No slab free yet.
+
+    word used;
+    WebSocketHandshake::Result result = m_handshake.parse( m_rxBuffer + m_rxStart, m_rxEnd - m_rxStart, used );
+    m_rxStart += used;
+
+    // Partial headers are all in m_handshake, so the slab can go back.
+    releaseBuffer();
+    return result;
+}
+
+int WebSocket::fillBuffer()
+{
+    if( !m_rxBuffer )
+    {
+        // Pool exhausted: leave the input where it is and try again later.
+        m_rxBuffer = m_pool->acquire();
+        if( !m_rxBuffer )
+            return m_socket->connected() ? 0 : -1;
+        m_rxStart = m_rxEnd = m_messageLength = 0;
+    }
+
+    // Anything below m_messageLength is a message being reassembled.
+    if( m_rxStart == m_rxEnd )
+        m_rxStart = m_rxEnd = m_messageLength;
+    else if( m_rxEnd == m_rxCapacity && m_rxStart > m_messageLength )
+        compactBuffer();
 
-    // Get opcode
-    bite = m_socket.read();
+    if( m_rxEnd == m_rxCapacity )
+        return 0;
 
-    frame.opcode = bite & 0xf; // Opcode
-    frame.isFinal = bite & 0x80; // Final frame?
-    // Determine length (only accept <= 64 for now)
-    bite = m_socket.read();
-    frame.length = bite & 0x7f; // Length of payload
-    if( frame.length == 126 )
+    int got = m_socket->read( m_rxBuffer + m_rxEnd, m_rxCapacity - m_rxEnd );
+    if( got > 0 )
+    {
+        WEBSOCKET_COUNT( bytesIn, got );
+        m_rxEnd += got;
+        m_lastPacketTime = millis(); // Any traffic counts, even part of a frame.
+    }
+    return got;
+}
+
+void WebSocket::compactBuffer()
+{
+    // Move the unparsed bytes down to make room at the end.
+    memmove( m_rxBuffer + m_messageLength, m_rxBuffer + m_rxStart, m_rxEnd - m_rxStart );
+    m_rxEnd -= m_rxStart - m_messageLength;
+    m_rxStart = m_messageLength;
+}
+
+void WebSocket::releaseBuffer( bool discard )
+{
+    if( discard )
     {
-        // 16-bit length:
-        uint8_t *len8 = (uint8_t*)&frame.length;
-        len8[1] = m_socket.read();
-        len8[0] = m_socket.read();
+        m_rxStart = m_rxEnd = 0;
+        m_messageLength = 0;
+        m_inMessage = false;
+        m_parseState = FRAME_HEADER;
     }
 
-    if (frame.length > frameCapacity) {
+    if( !m_rxBuffer || m_rxStart != m_rxEnd || m_messageLength )
+        return;
+
+    m_pool->release( m_rxBuffer );
+    m_rxBuffer = NULL;
+    m_rxStart = m_rxEnd = 0;
+}
+
+bool WebSocket::getFrame()
+{
+    // One bulk read per call, then parse every complete frame in place.
+    if( fillBuffer() < 0 )
+        return false;
+
+    while( m_rxBuffer )
+    {
+        uint8_t *p = m_rxBuffer + m_rxStart;
+        word pending = m_rxEnd - m_rxStart;
+
+        if( m_parseState == FRAME_HEADER )
+        {
+            // Wait until the whole header is in:
+            if( pending < 2 )
+                break;
+
+            word headerLength = 2;
+            m_frame.opcode = p[0] & 0xf; // Opcode
+            m_frame.isFinal = p[0] & 0x80; // Final frame?
+            m_frame.rsv = p[0] & 0x70; // Reserved for extensions
+            // Client should always send mask, but check just to be sure
+            m_frame.isMasked = p[1] & 0x80;
+            m_frame.length = p[1] & 0x7f; // Length of payload
+            if( m_frame.length == 126 )
+                headerLength += 2;
+            else if( m_frame.length == 127 )
+                headerLength += 8;
+            if( m_frame.isMasked )
+                headerLength += 4;
+
+            if( pending < headerLength )
+                break;
+
+            if( m_frame.length == 126 )
+                m_frame.length = ( (word)p[2] << 8 ) | p[3]; // Network byte order
+            else if( m_frame.length == 127 )
+            {
+                // 64-bit length, network byte order. The top bit must be clear,
+                // and on AVR anything past 32 bits is more than we could count.
+                m_frame.length = 0;
+                for( byte i = 2; i < 10; i++ )
+                {
+                    if( i < 10 - sizeof(frame_length_t) && p[i] )
+                    {
+                        sendClose( 1009 );
+                        return false;
+                    }
+                    m_frame.length = ( m_frame.length << 8 ) | p[i];
+                }
+                if( p[2] & 0x80 )
+                {
+                    sendClose( 1002 );
+                    return false;
+                }
+            }
+            if( m_frame.isMasked )
+                memcpy( m_frame.mask, p + headerLength - 4, 4 );
+
+            WEBSOCKET_COUNT( framesIn, 1 );
+            if( !checkFrame() )
+                return false;
+
+            m_rxStart += headerLength;
+            m_payloadOffset = 0;
+            m_parseState = FRAME_PAYLOAD;
+            continue;
+        }
+
+        if( isDataFrame() && onDataChunk )
+        {
+            // Streaming: hand over whatever part of the payload has arrived.
+            word chunk = pending;
+            if( m_frame.length - m_payloadOffset < chunk )
+                chunk = m_frame.length - m_payloadOffset;
+
+            if( m_frame.isMasked )
+                websocket_mask( p, chunk, m_frame.mask, m_payloadOffset );
+            m_rxStart += chunk;
+            m_payloadOffset += chunk;
+
+            if( m_payloadOffset < m_frame.length )
+            {
+                if( chunk && !deliverChunk( (char *)p, chunk, false ) )
+                    return false;
+                break;
+            }
+
+            m_parseState = FRAME_HEADER;
+            if( m_frame.isFinal )
+                m_inMessage = false;
+            if( !deliverChunk( (char *)p, chunk, m_frame.isFinal ) )
+                return false;
+            m_lastPacketTime = millis();
+            continue;
+        }
+
+        // Whole payload, plus room for the terminator:
+        if( m_rxStart + m_frame.length + 1 > m_rxCapacity )
+        {
+            compactBuffer();
+            p = m_rxBuffer + m_rxStart;
+        }
+
+        if( pending < m_frame.length )
+            break;
+
+        m_rxStart += m_frame.length;
+        m_parseState = FRAME_HEADER;
+        if( !processFrame( (char *)p ) )
+            return false;
+    }
+
+    // Idle sockets don't hold on to a slab.
+    releaseBuffer();
+    return true;
+}
+
+bool WebSocket::checkFrame()
+{
+    switch( m_frame.opcode )
+    {
+        case OPCODE_CONTINUATION: case OPCODE_TEXT: case OPCODE_BINARY:
+        case OPCODE_CLOSE: case OPCODE_PING: case OPCODE_PONG:
+            break;
+
+        default:
 #ifdef DEBUG
-        Serial.print(F("Too big frame to handle. Length: "));
-        Serial.println(frame.length);
+            Serial.print(F("Unknown opcode: "));
+            Serial.println(m_frame.opcode);
 #endif
-        m_socket.write((uint8_t) 0x08);
-        m_socket.write((uint8_t) 0x02);
-        m_socket.write((uint8_t) 0x03);
-        m_socket.write((uint8_t) 0xf1);
-        return false;
+            sendClose( 1002 );
+            return false;
     }
-    // Client should always send mask, but check just to be sure
-    frame.isMasked = bite & 0x80;
-    if (frame.isMasked) {
-        frame.mask[0] = m_socket.read();
-        frame.mask[1] = m_socket.read();
-        frame.mask[2] = m_socket.read();
-        frame.mask[3] = m_socket.read();
+
+    // Servers never mask; a client must give up on one that does.
+    if( m_client && m_frame.isMasked )
+    {
+        sendClose( 1002 );
+        return false;
     }
 
-    // Clear any frame data that may have come previously
-    //memset(frame.data, 0, frameCapacity);
+    // RSV1 marks a compressed message, on its first frame only, and only
+    // once permessage-deflate has been agreed. The other bits have no use.
+    byte allowed = 0;
+#if WEBSOCKET_DEFLATE
+    if( m_deflate && ( m_frame.opcode == OPCODE_TEXT || m_frame.opcode == OPCODE_BINARY ) )
+        allowed = 0x40;
+#endif
+    if( m_frame.rsv & ~allowed )
+    {
+        sendClose( 1002 );
+        return false;
+    }
 
+    if( m_frame.opcode & 0x8 )
+    {
+        // Control frames can't be fragmented and are at most 125 bytes.
+        if( !m_frame.isFinal || m_frame.length > WEBSOCKET_MAX_CONTROL )
+        {
+            sendClose( 1002 );
+            return false;
+        }
 
-    // Get message bytes and unmask them if necessary
-    for (int i = 0; i < frame.length; i++) {
-        if (frame.isMasked) {
-            frame.data[i] = m_socket.read() ^ frame.mask[i % 4];
-        } else {
-            frame.data[i] = m_socket.read();
+        // They're parsed whole, after any message being reassembled.
+        if( m_messageLength + m_frame.length + 1 > m_rxCapacity )
+        {
+#ifdef DEBUG
+            Serial.print(F("No room for control frame. Length: "));
+            Serial.println((unsigned long)m_frame.length);
+#endif
+            sendClose( 1009 );
+            return false;
         }
+        return true;
     }
-    frame.data[frame.length] = '\0';
 
-    //
-    // Frame complete!
-    //
-    if (!frame.isFinal) {
-        // We don't handle fragments! Close and disconnect.
+    // A continuation needs a message to continue, anything else must not
+    // arrive in the middle of one.
+    if( ( m_frame.opcode == OPCODE_CONTINUATION ) != m_inMessage )
+    {
 #ifdef DEBUG
-        Serial.println(F("Non-final frame, doesn't handle that."));
+        Serial.println(F("Unexpected fragment."));
+#endif
+        sendClose( 1002 );
+        return false;
+    }
+
+    if( m_frame.opcode != OPCODE_CONTINUATION )
+    {
+        m_messageOpcode = m_frame.opcode;
+#if WEBSOCKET_DEFLATE
+        m_messageCompressed = m_frame.rsv & 0x40;
+#endif
+    }
+    m_inMessage = !m_frame.isFinal;
+
+    // Streamed messages can be any size.
+    if( isDataFrame() && onDataChunk )
+        return true;
+
+    // Reassembled ones have to fit in the buffer along with the next header.
+    if( m_messageLength + m_frame.length > (frame_length_t)WEBSOCKET_SLAB_FRAME(m_rxCapacity) )
+    {
+#ifdef DEBUG
+        Serial.print(F("Too big frame to handle. Length: "));
+        Serial.println((unsigned long)m_frame.length);
+#endif
+        sendClose( 1009 );
+        return false;
+    }
+    return true;
+}
+
+bool WebSocket::deliverChunk( char *chunk, word length, bool isLast )
+{
+#if WEBSOCKET_DEFLATE
+    if( m_messageCompressed )
+    {
+        if( m_deflate->decompress( (const uint8_t *)chunk, length, isLast, &deliverInflatedChunk, this ) == WebSocketDeflate::OK )
+            return true;
+        sendClose( 1007 );
+        return false;
+    }
 #endif
-        m_socket.print((uint8_t) 0x08);
-        m_socket.write((uint8_t) 0x02);
-        m_socket.write((uint8_t) 0x03);
-        m_socket.write((uint8_t) 0xf1);
+
+    chunkCallback( chunk, length, isLast );
+    return true;
+}
+
+void WebSocket::chunkCallback( char *chunk, word length, bool isLast )
+{
+    WEBSOCKET_TIME_CALLBACK();
+    onDataChunk(*this, chunk, length, isLast, m_dataChunkOpaque);
+    WEBSOCKET_TIMED_CALLBACK();
+}
+
+#if WEBSOCKET_DEFLATE
+bool WebSocket::deliverInflatedChunk( void *context, uint8_t *data, word length, bool final )
+{
+    WebSocket *socket = (WebSocket *)context;
+    socket->chunkCallback( (char *)data, length, final );
+    return true;
+}
+
+bool WebSocket::deliverInflatedMessage( void *context, uint8_t *data, word length, bool final )
+{
+    // Output that fills the buffer before the end is more than a frame's worth.
+    if( !final )
         return false;
+
+    WebSocket *socket = (WebSocket *)context;
+    socket->m_frame.data = (char *)data;
+    socket->m_frame.length = length;
+    return socket->dispatchFrame();
+}
+#endif
+
+void WebSocket::sendClose( word status )
+{
+    uint8_t code[2] = { (uint8_t)( status >> 8 ), (uint8_t)status };
+    if( status == 1009 )
+        WEBSOCKET_COUNT( oversizeFrames, 1 );
+    else
+        WEBSOCKET_COUNT( protocolErrors, 1 );
+    sendControl( OPCODE_CLOSE, code, sizeof(code) );
+}
+
+void WebSocket::sendControl( byte opcode, uint8_t *payload, byte length )
+{
+    // Header, mask and payload in one write.
+    uint8_t header[6];
+    uint8_t mask[4];
+    WebSocketIovec pieces[2];
+    pieces[0].data = header;
+    pieces[0].length = encodeFrameHeader( header, 0x80 | opcode, length, mask );
+    pieces[1].data = payload;
+    pieces[1].length = length;
+    if( m_client && length )
+        websocket_mask( payload, length, mask );
+
+    WEBSOCKET_COUNT( framesOut, 1 );
+    WEBSOCKET_COUNT( bytesOut, pieces[0].length + length );
+    m_socket->writev( pieces, length ? 2 : 1 );
+}
+
+bool WebSocket::processFrame( char *payload )
+{
+    if( m_frame.isMasked )
+        websocket_mask( (uint8_t *)payload, m_frame.length, m_frame.mask );
+
+    if( isDataFrame() && ( !m_frame.isFinal || m_frame.opcode == OPCODE_CONTINUATION ) )
+    {
+        // Fragment: append the payload to the message at the start of the
+        // buffer, which overwrites this fragment's own header.
+        memmove( m_rxBuffer + m_messageLength, payload, m_frame.length );
+        m_messageLength += m_frame.length;
+        if( !m_frame.isFinal )
+            return true;
+
+        m_frame.opcode = m_messageOpcode;
+        m_frame.length = m_messageLength;
+        payload = (char *)m_rxBuffer;
+        m_messageLength = 0;
     }
 
-    uint8_t cmdPair[2];
-    switch (frame.opcode) {
-        case 0x01: // Txt frame
+#if WEBSOCKET_DEFLATE
+    if( isDataFrame() && m_messageCompressed )
+    {
+        // Delivered straight from the codec's buffer, terminated already.
+        WebSocketDeflate::Result result = m_deflate->decompress( (const uint8_t *)payload, m_frame.length, true, &deliverInflatedMessage, this );
+        if( result != WebSocketDeflate::OK )
+            sendClose( result == WebSocketDeflate::ABORTED ? 1009 : 1007 );
+        return result == WebSocketDeflate::OK;
+    }
+#endif
+
+    m_frame.data = payload;
+    if( m_frame.opcode != OPCODE_TEXT )
+        return dispatchFrame();
+
+    // Terminate text for the benefit of string handlers. The byte after the
+    // payload may be the start of the next frame, so keep it.
+    char saved = payload[m_frame.length];
+    payload[m_frame.length] = '\0';
+
+    bool result = dispatchFrame();
+    payload[m_frame.length] = saved;
+    return result;
+}
+
+bool WebSocket::dispatchFrame()
+{
+    switch (m_frame.opcode) {
+        case OPCODE_TEXT:
+        case OPCODE_BINARY:
             // Call the user provided function
             if( onData )
-                onData(*this, frame.data, frame.length, m_dataOpaque);
+            {
+                WEBSOCKET_TIME_CALLBACK();
+                onData(*this, m_frame.data, (word)m_frame.length, m_dataOpaque);
+                WEBSOCKET_TIMED_CALLBACK();
+            }
             break;
 
-        case 0x08:
+        case OPCODE_CLOSE:
             // Close frame. Answer with close and terminate tcp connection
             // TODO: Receive all bytes the client might send before closing? No?
 #ifdef DEBUG
             Serial.println(F("Close frame received. Closing in answer."));
 #endif
-            m_socket.write( (uint8_t)0x88 );
-            m_socket.write( (uint8_t)0x0 );
+            sendControl( OPCODE_CLOSE, NULL, 0 );
             return false;
 
-        case 0x09: // PING
-            m_socket.write( (uint8_t)0x8A );
-            m_socket.write( (uint8_t)0x0 );
+        case OPCODE_PING:
+            WEBSOCKET_COUNT( pingsIn, 1 );
+            WEBSOCKET_COUNT( pongsOut, 1 );
+            // With the ping's application data, unmasked already.
+            sendControl( OPCODE_PONG, (uint8_t *)m_frame.data, m_frame.length );
             break;
 
-        case 0x0A: // PONG
+        case OPCODE_PONG:
+            WEBSOCKET_COUNT( pongsIn, 1 );
             break;
 
         default:
             // Unexpected. Ignore. Probably should blow up entire universe here, but who cares.
 #ifdef DEBUG
             Serial.print(F("Unhandled frame ignored: "));
-            Serial.println(frame.opcode);
+            Serial.println(m_frame.opcode);
 #endif
             return false;
     }
@@ -310,7 +849,7 @@ bool WebSocket::getFrame()
     return true;
 }
 
-byte WebSocket::send( char *data, word length )
+frame_length_t WebSocket::sendFrame( byte opcode, const WebSocketIovec *iov, byte count )
 {
     if( CONNECTED != m_state )
     {
@@ -320,23 +859,271 @@ byte WebSocket::send( char *data, word length )
         return 0;
     }
 
-    if( 1 != m_socket.write((uint8_t) 0x81) ) // Txt frame opcode
+    if( count >= WEBSOCKET_MAX_IOV )
         return 0;
-    if( length > 125 )
+
+    // Header in a stack buffer ahead of the caller's pieces, payload straight
+    // from the caller's buffers:
+    uint8_t header[WEBSOCKET_MAX_HEADER];
+    WebSocketIovec pieces[WEBSOCKET_MAX_IOV];
+    frame_length_t length = 0;
+    for( byte x=0; x < count; x++ )
     {
-        if( 1 != m_socket.write((uint8_t) 0x7E) ) // 16-bit length follows
-            return 0;
-        word lenNBO = htons(length);
-        if( 2 != m_socket.write((const uint8_t *)&lenNBO, 2) ) // Length of data in a word, endian swapped.
-            return 0;
+        pieces[x + 1] = iov[x];
+        length += iov[x].length;
     }
-    else
+
+#if WEBSOCKET_DEFLATE
+    if( m_deflate && !( opcode & 0x8 ) && m_deflate->compresses( length ) )
     {
-        if( 1 != m_socket.write((uint8_t) length) ) // Length of data in a byte
-            return 0;
+        DeflatedMessage message = { this, opcode, true };
+        return m_deflate->compress( iov, count, &sendDeflated, &message ) == WebSocketDeflate::OK ? length : 0;
     }
+#endif
+
+    uint8_t mask[4];
+    pieces[0].data = header;
+    pieces[0].length = encodeFrameHeader( header, 0x80 | opcode, length, mask ); // Final frame, opcode
+    if( m_client )
+        return sendMasked( header, pieces[0].length, mask, iov, count, length ) ? length : 0;
+
+    return sendEncoded( pieces, count + 1, length ) ? length : 0;
+}
+
+#if WEBSOCKET_DEFLATE
+bool WebSocket::sendDeflated( void *context, uint8_t *data, word length, bool final )
+{
+    DeflatedMessage *message = (DeflatedMessage *)context;
+
+    // RSV1 and the opcode go on the first frame, continuations follow.
+    bool first = message->first;
+    byte opcode = first ? 0x40 | message->opcode : OPCODE_CONTINUATION;
+    message->first = false;
+
+    WebSocket *socket = message->socket;
+    uint8_t header[WEBSOCKET_MAX_HEADER];
+    uint8_t mask[4];
+    WebSocketIovec pieces[2];
+    pieces[0].data = header;
+    pieces[0].length = socket->encodeFrameHeader( header, ( final ? 0x80 : 0 ) | opcode, length, mask );
+    pieces[1].data = data;
+    pieces[1].length = length;
+
+    // The codec's own buffer, so it can be masked where it is.
+    if( socket->m_client )
+        websocket_mask( data, length, mask );
 
-    return m_socket.write( (const uint8_t *)data, length );
+    if( socket->sendEncoded( pieces, 2, length ) )
+        return true;
+
+    // Half a message is as bad as half a frame.
+    if( !first && socket->connected() )
+        socket->close();
+    return false;
+}
+#endif
+
+bool WebSocket::sendFragment( byte opcode, const uint8_t *data, size_t length, bool final )
+{
+    if( CONNECTED != m_state )
+        return false;
+
+    uint8_t header[WEBSOCKET_MAX_HEADER];
+    uint8_t mask[4];
+    WebSocketIovec pieces[2];
+    pieces[0].data = header;
+    pieces[0].length = encodeFrameHeader( header, ( final ? 0x80 : 0 ) | opcode, length, mask );
+    pieces[1].data = data;
+    pieces[1].length = length;
+    if( m_client ? sendMasked( header, pieces[0].length, mask, pieces + 1, 1, length ) : sendEncoded( pieces, 2, length ) )
+        return true;
+
+    // Half a message is as bad as half a frame.
+    if( opcode == OPCODE_CONTINUATION && connected() )
+        close();
+    return false;
+}
+
+#ifdef WEBSOCKET_FLASH_CHUNK
+frame_length_t WebSocket::sendFrame_P( byte opcode, const uint8_t *data, frame_length_t length )
+{
+    if( CONNECTED != m_state )
+    {
+#ifdef DEBUG
+        Serial.println(F("No connection to client, no data sent."));
+#endif
+        return 0;
+    }
+
+    // Sent as is, even when compressing; RSV1 says which it is.
+    uint8_t header[WEBSOCKET_MAX_HEADER];
+    uint8_t mask[4];
+    byte headerLength = encodeFrameHeader( header, 0x80 | opcode, length, mask );
+    return sendEncoded_P( header, headerLength, data, length, m_client ? mask : NULL ) ? length : 0;
+}
+
+bool WebSocket::sendEncoded_P( const uint8_t *header, byte headerLength, const uint8_t *data, frame_length_t length, const uint8_t *mask )
+{
+    uint8_t chunk[WEBSOCKET_FLASH_CHUNK];
+    WebSocketIovec pieces[2];
+    pieces[0].data = header;
+    pieces[0].length = headerLength;
+    pieces[1].data = chunk;
+
+    frame_length_t written = 0, offset = 0;
+    do
+    {
+        size_t piece = length - offset < sizeof(chunk) ? (size_t)( length - offset ) : sizeof(chunk);
+        memcpy_P( chunk, data + offset, piece );
+        if( mask )
+            websocket_mask( chunk, piece, mask, offset );
+        pieces[1].length = piece;
+
+        // The header goes with the first chunk.
+        byte first = offset ? 1 : 0;
+        size_t wrote = m_socket->writev( pieces + first, 2 - first );
+        written += wrote;
+        offset += piece;
+        if( wrote != ( first ? 0 : headerLength ) + piece )
+            break;
+    } while( offset < length );
+
+    return sent( written, headerLength + length );
+}
+#endif
+
+byte WebSocket::encodeFrameHeader( uint8_t *header, byte opcode, frame_length_t length, uint8_t *mask )
+{
+    byte headerLength = encodeHeader( header, opcode, length );
+    if( !m_client )
+        return headerLength;
+
+    // A new key for every frame, after the length.
+    uint32_t key = websocket_mask_next( m_maskState );
+    memcpy( mask, &key, 4 );
+    header[1] |= 0x80;
+    memcpy( header + headerLength, mask, 4 );
+    return headerLength + 4;
+}
+
+bool WebSocket::sendMasked( const uint8_t *header, byte headerLength, const uint8_t *mask, const WebSocketIovec *iov, byte count, frame_length_t length )
+{
+    uint8_t chunk[WEBSOCKET_MASK_CHUNK];
+    WebSocketIovec pieces[2];
+    pieces[0].data = header;
+    pieces[0].length = headerLength;
+    pieces[1].data = chunk;
+
+    frame_length_t written = 0, offset = 0;
+    byte index = 0;
+    size_t taken = 0; // Bytes of iov[index] already in a chunk.
+    do
+    {
+        // Gather a chunk's worth from the caller's pieces, then mask it.
+        size_t piece = 0;
+        while( piece < sizeof(chunk) && index < count )
+        {
+            size_t take = iov[index].length - taken;
+            if( take > sizeof(chunk) - piece )
+                take = sizeof(chunk) - piece;
+            memcpy( chunk + piece, iov[index].data + taken, take );
+            piece += take;
+            taken += take;
+            if( taken == iov[index].length )
+            {
+                index++;
+                taken = 0;
+            }
+        }
+        websocket_mask( chunk, piece, mask, offset );
+        pieces[1].length = piece;
+
+        // The header goes with the first chunk.
+        byte first = offset ? 1 : 0;
+        size_t wrote = m_socket->writev( pieces + first, 2 - first );
+        written += wrote;
+        offset += piece;
+        if( wrote != ( first ? 0 : headerLength ) + piece )
+            break;
+    } while( offset < length );
+
+    return sent( written, headerLength + length );
+}
+
+bool WebSocket::sendEncoded( const WebSocketIovec *iov, byte count, frame_length_t length )
+{
+    return sent( m_socket->writev( iov, count ), iov[0].length + length );
+}
+
+bool WebSocket::sent( frame_length_t written, frame_length_t expected )
+{
+    WEBSOCKET_COUNT( bytesOut, written );
+
+    if( written == expected )
+    {
+        WEBSOCKET_COUNT( framesOut, 1 );
+        m_writeFailures = 0;
+        return true;
+    }
+
+    m_totalWriteFailures++;
+    WEBSOCKET_COUNT( writeFailures, 1 );
+
+    // Half a frame leaves the stream unusable. If nothing went out we can
+    // try again next time, a few times.
+    if( written || ++m_writeFailures >= WEBSOCKET_MAX_WRITE_FAILURES )
+    {
+#ifdef DEBUG
+        Serial.println(F("Write failed, disconnecting."));
+#endif
+        close();
+    }
+    return false;
+}
+
+bool WebSocket::beginFrame( byte opcode, frame_length_t length )
+{
+    if( CONNECTED != m_state )
+    {
+#ifdef DEBUG
+        Serial.println(F("No connection to client, no data sent."));
+#endif
+        return false;
+    }
+
+    uint8_t header[WEBSOCKET_MAX_HEADER];
+    byte headerLength = encodeFrameHeader( header, 0x80 | opcode, length, m_streamMask ); // Final frame, opcode
+    m_streamOffset = 0;
+    WEBSOCKET_COUNT( framesOut, 1 );
+    WEBSOCKET_COUNT( bytesOut, headerLength );
+    return m_socket->write( header, headerLength ) == headerLength;
+}
+
+size_t WebSocket::writeFrameData( const uint8_t *data, size_t length )
+{
+    if( !m_client )
+    {
+        size_t written = m_socket->write( data, length );
+        WEBSOCKET_COUNT( bytesOut, written );
+        return written;
+    }
+
+    // Masked through the stack, carrying on from where the last piece left off.
+    uint8_t chunk[WEBSOCKET_MASK_CHUNK];
+    size_t written = 0;
+    while( written < length )
+    {
+        size_t piece = length - written < sizeof(chunk) ? length - written : sizeof(chunk);
+        memcpy( chunk, data + written, piece );
+        websocket_mask( chunk, piece, m_streamMask, m_streamOffset );
+        size_t wrote = m_socket->write( chunk, piece );
+        written += wrote;
+        m_streamOffset += wrote;
+        if( wrote != piece )
+            break;
+    }
+    WEBSOCKET_COUNT( bytesOut, written );
+    return written;
 }
 
 void WebSocket::setKeepalive(unsigned int interval)
@@ -351,21 +1138,52 @@ void WebSocket::setTimeout(unsigned int deadline)
 
 bool WebSocket::checkTimeout()
 {
+    // Unsigned differences stay right across millis() wraparound.
     unsigned long now = millis();
-    if( m_lastPacketTime + m_timeout > now )
+    if( m_timeout && now - m_lastPacketTime >= m_timeout )
     {
-        m_lastPacketTime = now;
+#ifdef DEBUG
+        Serial.println(F("Connection timed out."));
+#endif
         close();
         return false;
     }
 
     // Send a ping:
-    if( m_lastPingTime + m_keepaliveInterval > now )
+    if( m_state == CONNECTED && m_keepaliveInterval && now - m_lastPacketTime >= m_keepaliveInterval && now - m_lastPingTime >= m_keepaliveInterval )
     {
         m_lastPingTime = now;
-        m_socket.write( (uint8_t)0x89 );
-        m_socket.write( (uint8_t)0x0 );
+        WEBSOCKET_COUNT( pingsOut, 1 );
+        sendControl( OPCODE_PING, NULL, 0 );
     }
 
     return true;
 }
+
+bool WebSocket::nextTimeout( unsigned long &deadline )
+{
+    bool due = false;
+    if( m_timeout )
+    {
+        deadline = m_lastPacketTime + m_timeout;
+        due = true;
+    }
+
+    if( m_state == CONNECTED && m_keepaliveInterval )
+    {
+        // A ping is due once both the last packet and the last ping are old enough.
+        unsigned long last = (long)( m_lastPingTime - m_lastPacketTime ) > 0 ? m_lastPingTime : m_lastPacketTime;
+        unsigned long ping = last + m_keepaliveInterval;
+        if( !due || (long)( ping - deadline ) < 0 )
+            deadline = ping;
+        due = true;
+    }
+    return due;
+}
+
+#if WEBSOCKET_STATS
+word WebSocket::printStats( WebSocketWritable &to )
+{
+    return to.printf_P( F("{" WEBSOCKET_STATS_JSON "}"), WEBSOCKET_STATS_ARGS( m_stats ) );
+}
+#endif
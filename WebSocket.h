@@ -1,38 +1,104 @@
-#include <Arduino.h> // Arduino 1.0 or greater is required
+#include "WebSocketPlatform.h"
 #include <stdlib.h>
 #include <stdarg.h>
 
-#include <SPI.h>
-#include <Ethernet.h>
-
 #include "WebSocketWritable.h"
+#include "WebSocketTransport.h"
+#include "WebSocketBufferPool.h"
+#include "WebSocketTimerWheel.h"
+#include "WebSocketHandshake.h"
+#include "WebSocketAccept.h"
+#include "WebSocketDeflate.h"
+#include "WebSocketStats.h"
+#include "WebSocketCoroutine.h"
+#include "WebSocketEthernet.h"
+#include "WebSocketEpoll.h"
 
 #ifndef WEBSOCKET_H_
 #define WEBSOCKET_H_
 
+// Transport used when none is provided. Elsewhere there's none, and only
+// the constructors that take a transport are declared.
+#if defined(ARDUINO)
+#define WEBSOCKET_DEFAULT_TRANSPORT 1
+typedef EthernetTransport DefaultTransport;
+typedef EthernetServerTransport DefaultServerTransport;
+#elif defined(WEBSOCKET_EPOLL)
+#define WEBSOCKET_DEFAULT_TRANSPORT 1
+typedef PosixTransport DefaultTransport;
+typedef EpollServerTransport DefaultServerTransport;
+#else
+#define WEBSOCKET_DEFAULT_TRANSPORT 0
+#endif
+
 #ifndef htons
 #define htons(x) ( ((x)<<8) | (((x)>>8)&0xFF) )
 #endif
 
+// Longest frame header: opcode, length, 64-bit extended length and mask.
+#define WEBSOCKET_MAX_HEADER 14
+
+// Frames a client sends are masked through a buffer of this many bytes on
+// the stack, a piece of the payload at a time, leaving the caller's alone.
+#ifndef WEBSOCKET_MASK_CHUNK
+#if defined(__AVR__)
+#define WEBSOCKET_MASK_CHUNK 64
+#elif defined(ARDUINO)
+#define WEBSOCKET_MASK_CHUNK 256
+#else
+#define WEBSOCKET_MASK_CHUNK 4096
+#endif
+#endif
+
+// Consecutive failed writes before a connection is given up on.
+#ifndef WEBSOCKET_MAX_WRITE_FAILURES
+#define WEBSOCKET_MAX_WRITE_FAILURES 3
+#endif
+
+// Stack space for a handshake line or response.
+#ifndef WEBSOCKET_HANDSHAKE_BUFFER
+#if defined(__AVR__)
+#define WEBSOCKET_HANDSHAKE_BUFFER 160
+#elif WEBSOCKET_DEFLATE
+#define WEBSOCKET_HANDSHAKE_BUFFER 512 // Room for an extension offer or reply.
+#else
+#define WEBSOCKET_HANDSHAKE_BUFFER 256
+#endif
+#endif
+
+// Longest control frame payload.
+#define WEBSOCKET_MAX_CONTROL 125
+
+// Room kept in each slab past the frame size, so a ping or close can arrive
+// while a reassembled message fills the rest. AVR can't spare it; there a
+// control frame that doesn't fit closes the connection (1009).
+#ifndef WEBSOCKET_CONTROL_RESERVE
+#if defined(__AVR__)
+#define WEBSOCKET_CONTROL_RESERVE 0
+#else
+#define WEBSOCKET_CONTROL_RESERVE WEBSOCKET_MAX_CONTROL
+#endif
+#endif
+
+// Slab size that holds a frame of 'maxFrameSize', its header, a terminator
+// and the control frame reserve, and the frame size a slab holds.
+#define WEBSOCKET_SLAB_OVERHEAD ( WEBSOCKET_MAX_HEADER + 1 + WEBSOCKET_CONTROL_RESERVE )
+#define WEBSOCKET_SLAB_SIZE(maxFrameSize) ( (maxFrameSize) + WEBSOCKET_SLAB_OVERHEAD )
+#define WEBSOCKET_SLAB_FRAME(slabSize) ( (slabSize) > WEBSOCKET_SLAB_OVERHEAD ? (slabSize) - WEBSOCKET_SLAB_OVERHEAD : 0 )
+
 // CRLF characters to terminate lines/handshakes in headers.
 #define CRLF "\r\n"
 
 typedef struct {
     bool isMasked;
     bool isFinal;
+    byte rsv; // RSV1-3 bits, as they sit in the first header byte.
     byte opcode;
     byte mask[4];
-    word length;
+    frame_length_t length;
     char *data;
 } Frame;
 
-// Frame.
-extern Frame frame;
-
-// Shared with WebSocketServer
-extern word frameCapacity; // Maximum amount of data the frame can accept.
-extern bool initialised;
-
 class WebSocket : public WebSocketWritable {
 public:
     typedef enum {DISCONNECTED=0, HANDSHAKE=1, CONNECTED=2} State;
@@ -40,16 +106,20 @@ public:
 protected:
     typedef void Callback(WebSocket &socket, void *opaque);
     typedef void DataCallback(WebSocket &socket, char *socketString, word frameLength, void *opaque);
+    typedef void DataChunkCallback(WebSocket &socket, char *chunk, word chunkLength, bool isLast, void *opaque);
 
     Callback *onConnect;
     Callback *onDisconnect;
     DataCallback *onData;
+    DataChunkCallback *onDataChunk;
 
     void *m_connectOpaque;
     void *m_disconnectOpaque;
     void *m_dataOpaque;
+    void *m_dataChunkOpaque;
 
-    EthernetClient m_socket;
+    WebSocketTransport *m_socket;
+    bool m_ownsSocket;
 
     // Connection state:
     State m_state;
@@ -63,27 +133,143 @@ protected:
     // Just to keep track of the last timestamp.
     unsigned long m_lastPacketTime, m_lastPingTime;
 
+    // Next keepalive or timeout check, when a WebSocketServer drives them.
+    WebSocketTimer m_timer;
+
+    // Opening handshake headers, parsed as they arrive.
+    WebSocketHandshake m_handshake;
+
+    // Receive buffers are borrowed from here:
+    WebSocketBufferPool *m_pool;
+    bool m_ownsPool;
+
+    // Receive buffer, filled with bulk reads and parsed in place. Only held
+    // while there's something in it, NULL otherwise.
+    uint8_t *m_rxBuffer;
+    word m_rxCapacity;
+    word m_rxStart, m_rxEnd; // Unparsed bytes lie between these.
+
+    // Incoming frame parser, resumed on each listen():
+    typedef enum {FRAME_HEADER=0, FRAME_PAYLOAD} ParseState;
+    ParseState m_parseState;
+    Frame m_frame; // Frame being received.
+    frame_length_t m_payloadOffset; // Payload bytes of m_frame streamed so far.
+
+    // Consecutive writes that sent nothing, and failed writes overall.
+    byte m_writeFailures;
+    unsigned long m_totalWriteFailures;
+
+    // Set by connect(): frames we send are masked, with keys drawn from
+    // m_maskState. m_keySeed made the handshake key, and makes it again to
+    // check the server's answer.
+    bool m_client;
+    uint32_t m_maskState;
+    uint32_t m_keySeed;
+
+    // Mask of the frame started by beginFrame(), and its payload bytes
+    // written so far.
+    uint8_t m_streamMask[4];
+    frame_length_t m_streamOffset;
+
+    // Current data message. Fragments being reassembled collect at the
+    // start of the receive buffer, m_messageLength bytes so far.
+    byte m_messageOpcode;
+    bool m_inMessage;
+    word m_messageLength;
+
+#if WEBSOCKET_DEFLATE
+    // permessage-deflate settings to offer or accept, and the connection's
+    // codec once the handshake agrees on it.
+    const WebSocketDeflateOptions *m_deflateOptions;
+    WebSocketDeflate *m_deflate;
+    bool m_messageCompressed; // RSV1 was set on the current data message.
+#endif
+
+#if WEBSOCKET_STATS
+    WebSocketStats m_stats;
+#endif
+
+#if WEBSOCKET_COROUTINES
+    // Set up by the first receive(), or by a server for accept().
+    WebSocketReceiver *m_receiver;
+    WebSocketReceiver *receiver();
+#endif
+
 public:
+#if WEBSOCKET_DEFAULT_TRANSPORT
+    // Outbound socket over the platform's default transport.
     WebSocket(word maxFrameSize = 96);
+#endif
+
+    // Socket over a caller-provided transport, which must outlive it.
+    WebSocket(WebSocketTransport *transport, word maxFrameSize = 96);
+
+    // Socket that borrows its buffers from a shared pool. The frame size
+    // follows from the pool's slab size. Both must outlive the socket.
+    WebSocket(WebSocketTransport *transport, WebSocketBufferPool *pool);
     ~WebSocket();
 
     void registerDataCallback(DataCallback *callback, void *opaque=NULL) { onData = callback; m_dataOpaque = opaque; }
-    void registerConnectCallback(Callback *callback, void *opaque=NULL) { onDisconnect = callback; m_connectOpaque = opaque; }
+
+    // Receive messages piece by piece as they arrive instead of whole, so they
+    // needn't fit in the frame buffer. Takes precedence over the data callback.
+    void registerDataChunkCallback(DataChunkCallback *callback, void *opaque=NULL) { onDataChunk = callback; m_dataChunkOpaque = opaque; }
+    void registerConnectCallback(Callback *callback, void *opaque=NULL) { onConnect = callback; m_connectOpaque = opaque; }
     void registerDisconnectCallback(Callback *callback, void *opaque=NULL) { onDisconnect = callback; m_disconnectOpaque = opaque; }
 
+    // Connect to "ws://host:port[/resource]" as a client. Frames sent from
+    // then on are masked, as RFC 6455 requires of clients, and the server's
+    // handshake response has to answer our Sec-WebSocket-Key.
     bool connect(const char *url);
 
     // Are we connected?
-    bool connected() { return m_socket.connected(); }
+    bool connected() { return m_socket->connected(); }
 
     // Outbound may be in HANDSHAKE, inbound will be eitheir DISCONNECTED or CONNECTED
     State status() { return m_state; }
 
     // To get things like host/port info:
-    EthernetClient socket() { return m_socket; }
+    WebSocketTransport &socket() { return *m_socket; }
+
+    // Embeds data in a frame of the given opcode and sends to client. The
+    // header and payload leave in one write.
+    frame_length_t sendFrame(byte opcode, const WebSocketIovec *iov, byte count);
+    using WebSocketWritable::sendFrame;
+
+#ifdef WEBSOCKET_FLASH_CHUNK
+    frame_length_t sendFrame_P(byte opcode, const uint8_t *data, frame_length_t length);
+#endif
+
+    bool sendFragment(byte opcode, const uint8_t *data, size_t length, bool final);
+
+    // Send a frame too large to hold in memory: beginFrame() sends the header
+    // for a payload of 'length' bytes, which must then follow in pieces
+    // through writeFrameData().
+    bool beginFrame(byte opcode, frame_length_t length);
+    size_t writeFrameData(const uint8_t *data, size_t length);
+
+    // Count of frames that failed to send on this connection.
+    unsigned long writeFailures() { return m_totalWriteFailures; }
 
-    // Embeds data in frame and sends to client.
-    byte send(char *str, word length);
+#if WEBSOCKET_STATS
+    // This connection's counters so far.
+    const WebSocketStats &stats() { return m_stats; }
+
+    // Send them to 'to' (this socket, or another) as one JSON text frame,
+    // which takes a frame size of 256 or so. Returns the bytes sent.
+    word printStats(WebSocketWritable &to);
+#endif
+
+#if WEBSOCKET_COROUTINES
+    // From a coroutine, 'co_await socket.receive()' waits for the next whole
+    // message, which comes from listen() as the data callback would have.
+    // Replaces the data callback. The message is empty once the connection
+    // has closed; the socket must outlive the wait. One coroutine at a time.
+    WebSocketReceiver::Awaiter receive();
+#endif
+
+    // Opcode of the message being delivered to a data callback, OPCODE_TEXT or OPCODE_BINARY.
+    Opcode opcode() { return (Opcode)m_messageOpcode; }
 
     // Handle incoming data.
     void listen();
@@ -97,33 +283,134 @@ public:
     // Set to connection timeout in milliseconds, or 0 for "never timeout". It still can if the underlying socket dies.
     void setTimeout(unsigned int deadline);
 
-    // Called also by WebSocketServer:
-    static void initialise( word maxFrameSize );
+    // Buffers come from each socket's pool now, so there's nothing shared to
+    // set up or free. Kept so existing sketches compile.
+    static void initialise( word ) {}
+    static void deinitialise() {}
+
+    // Where receive buffers and printf() scratch space come from.
+    WebSocketBufferPool *bufferPool() { return m_pool; }
 
-    // Free as much RAM as possible, requiring WebSocket::initialise() to be called before resuming use.
-    static void deinitialise();
+#if WEBSOCKET_DEFLATE
+    // Offer permessage-deflate with these settings when connecting, or NULL
+    // (the default) for plain frames. They must outlive the socket.
+    void setDeflate(const WebSocketDeflateOptions *options) { m_deflateOptions = options; }
+
+    // Did the handshake agree on permessage-deflate? Data frames from
+    // sendFrame() and friends are then compressed, beginFrame() ones aren't.
+    bool compressing() { return m_deflate != NULL; }
+#endif
 
 private:
-    // Discovers if the client's header is requesting an upgrade to a
-    // websocket connection.
+    // Reads the server's response to our upgrade request as it arrives.
+    // Returns false if the handshake failed.
     bool outboundHandshake(); // Called for receiving end of handshake.
 
     // Outbound handshake:
     bool sendOutboundHandshakeRequest(const char *url, const char *host, word port);
 
-    // Reads a frame from client. Returns false if user disconnects, 
-    // or unhandled frame is received. Server must then disconnect, or an error occurs.
+    // Reads frames from client as their bytes arrive, keeping partial headers
+    // between calls. Returns false if user disconnects, or unhandled frame
+    // is received. Server must then disconnect, or an error occurs.
     bool getFrame();
 
-    // Calculate if the socket is timed-out or not.
-    bool checkTimeout();
+    // Validate a newly parsed header against the message in progress.
+    bool checkFrame();
+    bool isDataFrame() { return !( m_frame.opcode & 0x8 ); }
+
+    // Unmask a fully-arrived payload in place, reassemble fragments, and act
+    // on complete messages.
+    bool processFrame(char *payload);
+    bool dispatchFrame();
+
+    // Top up the receive buffer with one bulk read, borrowing a slab if
+    // need be. Returns the count read, 0 if nothing was (or no slab was
+    // free), or -1 if the connection is gone.
+    int fillBuffer();
+    void compactBuffer();
+
+    // Hand the receive buffer back to the pool once nothing is left in it,
+    // or drop its contents and parser state when 'discard' is set.
+    void releaseBuffer(bool discard = false);
+
+    // Send a close frame with a status code (1002 protocol error, 1009 too big...)
+    void sendClose(word status);
+
+    // Send a control frame with up to 125 bytes of payload, which is masked
+    // in place if need be.
+    void sendControl(byte opcode, uint8_t *payload, byte length);
+
+    // Sec-WebSocket-Key made from 'seed', and whether the server's
+    // Sec-WebSocket-Accept answers ours.
+    static void handshakeKey(char *key, uint32_t seed);
+    bool acceptValid();
+
+    // Pass part of a streamed message to the chunk callback, decompressing
+    // it on the way if need be. Returns false if it couldn't be.
+    bool deliverChunk(char *chunk, word length, bool isLast);
+    void chunkCallback(char *chunk, word length, bool isLast);
+
+    // Take up the extensions the server's response agreed to. Returns false
+    // if they aren't what we offered.
+    bool confirmExtensions();
+
+#if WEBSOCKET_DEFLATE
+    // WebSocketDeflate sinks: send compressed frames, and pass decompressed
+    // chunks or messages on.
+    static bool sendDeflated(void *context, uint8_t *data, word length, bool final);
+    static bool deliverInflatedChunk(void *context, uint8_t *data, word length, bool final);
+    static bool deliverInflatedMessage(void *context, uint8_t *data, word length, bool final);
+#endif
 
 protected:
-    // Generate a Base64-encoded SHA1 SUM of the static key, optionally prefixed by a provided key:
-    char *checksum( char *key=NULL );
+    // Close the socket if it has been quiet for longer than the timeout, and
+    // ping it once it has been quiet for the keepalive interval. Returns
+    // false if it was closed.
+    bool checkTimeout();
+
+    // When checkTimeout() next has something to do. Returns false if never.
+    bool nextTimeout(unsigned long &deadline);
+
+    // Feed whatever has arrived to m_handshake, leaving anything after the
+    // headers in the receive buffer.
+    WebSocketHandshake::Result readHandshake();
+
+    // Generate a Base64-encoded SHA1 SUM of the static key, optionally prefixed by a provided key,
+    // into 'result' (WEBSOCKET_ACCEPT_LENGTH characters and a terminator):
+    void checksum( char *result, const char *key=NULL );
 
     // Update state
     void setStatus( State state ) { m_state = state; }
+
+#if WEBSOCKET_DEFLATE
+    // Start compressing with what the handshake agreed on.
+    void startDeflate(const WebSocketDeflateOptions &options, const WebSocketDeflate::Params &params);
+#endif
+
+    // Encode a header for a frame we send, as encodeHeader() does. On a
+    // client connection it's masked, with a new key copied to 'mask'.
+    byte encodeFrameHeader(uint8_t *header, byte opcode, frame_length_t length, uint8_t *mask);
+
+    // Write an encoded, masked header, then the payload gathered from 'iov'
+    // and masked WEBSOCKET_MASK_CHUNK bytes at a time, the first chunk
+    // along with the header.
+    bool sendMasked(const uint8_t *header, byte headerLength, const uint8_t *mask, const WebSocketIovec *iov, byte count, frame_length_t length);
+
+    // Write an already encoded frame, header first in 'iov', as one vectored
+    // write, counting failures. The connection is closed once the stream
+    // can't be trusted.
+    bool sendEncoded(const WebSocketIovec *iov, byte count, frame_length_t length);
+
+    // Account for a frame of which 'written' of 'expected' bytes went out,
+    // as sendEncoded() does.
+    bool sent(frame_length_t written, frame_length_t expected);
+
+#ifdef WEBSOCKET_FLASH_CHUNK
+    // Write an encoded header, then 'length' payload bytes read from program
+    // memory a chunk at a time, the first chunk along with the header. Each
+    // chunk is masked on the way if 'mask' isn't NULL.
+    bool sendEncoded_P(const uint8_t *header, byte headerLength, const uint8_t *data, frame_length_t length, const uint8_t *mask = NULL);
+#endif
 };
 
 #endif
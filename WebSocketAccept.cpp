@@ -0,0 +1,341 @@
+#include "WebSocketAccept.h"
+#include "Base64.h"
+
+#if ( defined(__x86_64__) || defined(__i386__) ) && defined(__GNUC__)
+#include <immintrin.h>
+#include <cpuid.h>
+#define WEBSOCKET_ACCEPT_SHANI 1
+#elif defined(__ARM_FEATURE_SHA2) || defined(__ARM_FEATURE_CRYPTO)
+#include <arm_neon.h>
+#define WEBSOCKET_ACCEPT_ARMV8 1
+#endif
+
+static const char guid[] PROGMEM = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+
+static const uint32_t initialState[5] PROGMEM = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0 };
+
+static inline uint32_t rol32(uint32_t x, byte bits)
+{
+    return ( x << bits ) | ( x >> ( 32 - bits ) );
+}
+
+// Plain SHA-1 compression of 'count' 64-byte blocks.
+static void compress(uint32_t state[5], const uint8_t *block, byte count)
+{
+    for( ; count; count--, block += 64 )
+    {
+        uint32_t w[16];
+        for( byte i = 0; i < 16; i++ )
+            w[i] = ( (uint32_t)block[4*i] << 24 ) | ( (uint32_t)block[4*i+1] << 16 ) | ( (uint32_t)block[4*i+2] << 8 ) | block[4*i+3];
+
+        uint32_t a = state[0], b = state[1], c = state[2], d = state[3], e = state[4], t;
+        for( byte i = 0; i < 80; i++ )
+        {
+            if( i >= 16 )
+                w[i&15] = rol32( w[(i+13)&15] ^ w[(i+8)&15] ^ w[(i+2)&15] ^ w[i&15], 1 );
+
+            if( i < 20 )
+                t = ( d ^ ( b & ( c ^ d ) ) ) + 0x5a827999;
+            else if( i < 40 )
+                t = ( b ^ c ^ d ) + 0x6ed9eba1;
+            else if( i < 60 )
+                t = ( ( b & c ) | ( d & ( b | c ) ) ) + 0x8f1bbcdc;
+            else
+                t = ( b ^ c ^ d ) + 0xca62c1d6;
+
+            t += rol32( a, 5 ) + e + w[i&15];
+            e = d;
+            d = c;
+            c = rol32( b, 30 );
+            b = a;
+            a = t;
+        }
+        state[0] += a;
+        state[1] += b;
+        state[2] += c;
+        state[3] += d;
+        state[4] += e;
+    }
+}
+
+#if defined(WEBSOCKET_ACCEPT_SHANI)
+
+__attribute__((target("sha,sse4.1,ssse3")))
+static void compressShaNi(uint32_t state[5], const uint8_t *block, byte count)
+{
+    const __m128i swap = _mm_set_epi64x( 0x0001020304050607ULL, 0x08090a0b0c0d0e0fULL );
+
+    __m128i abcd = _mm_shuffle_epi32( _mm_loadu_si128( (const __m128i *)state ), 0x1b );
+    __m128i e0 = _mm_set_epi32( state[4], 0, 0, 0 );
+    __m128i e1, msg0, msg1, msg2, msg3;
+
+    for( ; count; count--, block += 64 )
+    {
+        __m128i abcdSaved = abcd;
+        __m128i eSaved = e0;
+
+            // Rounds 0-3
+            msg0 = _mm_shuffle_epi8( _mm_loadu_si128( (const __m128i *)( block + 0 ) ), swap );
+            e0 = _mm_add_epi32( e0, msg0 );
+            e1 = abcd;
+            abcd = _mm_sha1rnds4_epu32( abcd, e0, 0 );
+
+            // Rounds 4-7
+            msg1 = _mm_shuffle_epi8( _mm_loadu_si128( (const __m128i *)( block + 16 ) ), swap );
+            e1 = _mm_sha1nexte_epu32( e1, msg1 );
+            e0 = abcd;
+            abcd = _mm_sha1rnds4_epu32( abcd, e1, 0 );
+            msg0 = _mm_sha1msg1_epu32( msg0, msg1 );
+
+            // Rounds 8-11
+            msg2 = _mm_shuffle_epi8( _mm_loadu_si128( (const __m128i *)( block + 32 ) ), swap );
+            e0 = _mm_sha1nexte_epu32( e0, msg2 );
+            e1 = abcd;
+            abcd = _mm_sha1rnds4_epu32( abcd, e0, 0 );
+            msg1 = _mm_sha1msg1_epu32( msg1, msg2 );
+            msg0 = _mm_xor_si128( msg0, msg2 );
+
+            // Rounds 12-15
+            msg3 = _mm_shuffle_epi8( _mm_loadu_si128( (const __m128i *)( block + 48 ) ), swap );
+            e1 = _mm_sha1nexte_epu32( e1, msg3 );
+            e0 = abcd;
+            msg0 = _mm_sha1msg2_epu32( msg0, msg3 );
+            abcd = _mm_sha1rnds4_epu32( abcd, e1, 0 );
+            msg2 = _mm_sha1msg1_epu32( msg2, msg3 );
+            msg1 = _mm_xor_si128( msg1, msg3 );
+
+            // Rounds 16-19
+            e0 = _mm_sha1nexte_epu32( e0, msg0 );
+            e1 = abcd;
+            msg1 = _mm_sha1msg2_epu32( msg1, msg0 );
+            abcd = _mm_sha1rnds4_epu32( abcd, e0, 0 );
+            msg3 = _mm_sha1msg1_epu32( msg3, msg0 );
+            msg2 = _mm_xor_si128( msg2, msg0 );
+
+            // Rounds 20-23
+            e1 = _mm_sha1nexte_epu32( e1, msg1 );
+            e0 = abcd;
+            msg2 = _mm_sha1msg2_epu32( msg2, msg1 );
+            abcd = _mm_sha1rnds4_epu32( abcd, e1, 1 );
+            msg0 = _mm_sha1msg1_epu32( msg0, msg1 );
+            msg3 = _mm_xor_si128( msg3, msg1 );
+
+            // Rounds 24-27
+            e0 = _mm_sha1nexte_epu32( e0, msg2 );
+            e1 = abcd;
+            msg3 = _mm_sha1msg2_epu32( msg3, msg2 );
+            abcd = _mm_sha1rnds4_epu32( abcd, e0, 1 );
+            msg1 = _mm_sha1msg1_epu32( msg1, msg2 );
+            msg0 = _mm_xor_si128( msg0, msg2 );
+
+            // Rounds 28-31
+            e1 = _mm_sha1nexte_epu32( e1, msg3 );
+            e0 = abcd;
+            msg0 = _mm_sha1msg2_epu32( msg0, msg3 );
+            abcd = _mm_sha1rnds4_epu32( abcd, e1, 1 );
+            msg2 = _mm_sha1msg1_epu32( msg2, msg3 );
+            msg1 = _mm_xor_si128( msg1, msg3 );
+
+            // Rounds 32-35
+            e0 = _mm_sha1nexte_epu32( e0, msg0 );
+            e1 = abcd;
+            msg1 = _mm_sha1msg2_epu32( msg1, msg0 );
+            abcd = _mm_sha1rnds4_epu32( abcd, e0, 1 );
+            msg3 = _mm_sha1msg1_epu32( msg3, msg0 );
+            msg2 = _mm_xor_si128( msg2, msg0 );
+
+            // Rounds 36-39
+            e1 = _mm_sha1nexte_epu32( e1, msg1 );
+            e0 = abcd;
+            msg2 = _mm_sha1msg2_epu32( msg2, msg1 );
+            abcd = _mm_sha1rnds4_epu32( abcd, e1, 1 );
+            msg0 = _mm_sha1msg1_epu32( msg0, msg1 );
+            msg3 = _mm_xor_si128( msg3, msg1 );
+
+            // Rounds 40-43
+            e0 = _mm_sha1nexte_epu32( e0, msg2 );
+            e1 = abcd;
+            msg3 = _mm_sha1msg2_epu32( msg3, msg2 );
+            abcd = _mm_sha1rnds4_epu32( abcd, e0, 2 );
+            msg1 = _mm_sha1msg1_epu32( msg1, msg2 );
+            msg0 = _mm_xor_si128( msg0, msg2 );
+
+            // Rounds 44-47
+            e1 = _mm_sha1nexte_epu32( e1, msg3 );
+            e0 = abcd;
+            msg0 = _mm_sha1msg2_epu32( msg0, msg3 );
+            abcd = _mm_sha1rnds4_epu32( abcd, e1, 2 );
+            msg2 = _mm_sha1msg1_epu32( msg2, msg3 );
+            msg1 = _mm_xor_si128( msg1, msg3 );
+
+            // Rounds 48-51
+            e0 = _mm_sha1nexte_epu32( e0, msg0 );
+            e1 = abcd;
+            msg1 = _mm_sha1msg2_epu32( msg1, msg0 );
+            abcd = _mm_sha1rnds4_epu32( abcd, e0, 2 );
+            msg3 = _mm_sha1msg1_epu32( msg3, msg0 );
+            msg2 = _mm_xor_si128( msg2, msg0 );
+
+            // Rounds 52-55
+            e1 = _mm_sha1nexte_epu32( e1, msg1 );
+            e0 = abcd;
+            msg2 = _mm_sha1msg2_epu32( msg2, msg1 );
+            abcd = _mm_sha1rnds4_epu32( abcd, e1, 2 );
+            msg0 = _mm_sha1msg1_epu32( msg0, msg1 );
+            msg3 = _mm_xor_si128( msg3, msg1 );
+
+            // Rounds 56-59
+            e0 = _mm_sha1nexte_epu32( e0, msg2 );
+            e1 = abcd;
+            msg3 = _mm_sha1msg2_epu32( msg3, msg2 );
+            abcd = _mm_sha1rnds4_epu32( abcd, e0, 2 );
+            msg1 = _mm_sha1msg1_epu32( msg1, msg2 );
+            msg0 = _mm_xor_si128( msg0, msg2 );
+
+            // Rounds 60-63
+            e1 = _mm_sha1nexte_epu32( e1, msg3 );
+            e0 = abcd;
+            msg0 = _mm_sha1msg2_epu32( msg0, msg3 );
+            abcd = _mm_sha1rnds4_epu32( abcd, e1, 3 );
+            msg2 = _mm_sha1msg1_epu32( msg2, msg3 );
+            msg1 = _mm_xor_si128( msg1, msg3 );
+
+            // Rounds 64-67
+            e0 = _mm_sha1nexte_epu32( e0, msg0 );
+            e1 = abcd;
+            msg1 = _mm_sha1msg2_epu32( msg1, msg0 );
+            abcd = _mm_sha1rnds4_epu32( abcd, e0, 3 );
+            msg3 = _mm_sha1msg1_epu32( msg3, msg0 );
+            msg2 = _mm_xor_si128( msg2, msg0 );
+
+            // Rounds 68-71
+            e1 = _mm_sha1nexte_epu32( e1, msg1 );
+            e0 = abcd;
+            msg2 = _mm_sha1msg2_epu32( msg2, msg1 );
+            abcd = _mm_sha1rnds4_epu32( abcd, e1, 3 );
+            msg3 = _mm_xor_si128( msg3, msg1 );
+
+            // Rounds 72-75
+            e0 = _mm_sha1nexte_epu32( e0, msg2 );
+            e1 = abcd;
+            msg3 = _mm_sha1msg2_epu32( msg3, msg2 );
+            abcd = _mm_sha1rnds4_epu32( abcd, e0, 3 );
+
+            // Rounds 76-79
+            e1 = _mm_sha1nexte_epu32( e1, msg3 );
+            e0 = abcd;
+            abcd = _mm_sha1rnds4_epu32( abcd, e1, 3 );
+
+        e0 = _mm_sha1nexte_epu32( e0, eSaved );
+        abcd = _mm_add_epi32( abcd, abcdSaved );
+    }
+
+    _mm_storeu_si128( (__m128i *)state, _mm_shuffle_epi32( abcd, 0x1b ) );
+    state[4] = _mm_extract_epi32( e0, 3 );
+}
+
+static bool haveShaNi()
+{
+    static int supported = -1;
+    if( supported < 0 )
+    {
+        unsigned int a, b, c, d;
+        supported = __get_cpuid( 1, &a, &b, &c, &d ) && ( c & bit_SSSE3 ) && ( c & bit_SSE4_1 ) &&
+            __get_cpuid_count( 7, 0, &a, &b, &c, &d ) && ( b & bit_SHA ) ? 1 : 0;
+    }
+    return supported;
+}
+
+#elif defined(WEBSOCKET_ACCEPT_ARMV8)
+
+static void compressArmv8(uint32_t state[5], const uint8_t *block, byte count)
+{
+    static const uint32_t k[4] = { 0x5a827999, 0x6ed9eba1, 0x8f1bbcdc, 0xca62c1d6 };
+
+    uint32x4_t abcd = vld1q_u32( state );
+    uint32_t e = state[4];
+
+    for( ; count; count--, block += 64 )
+    {
+        uint32x4_t abcdSaved = abcd;
+        uint32_t eSaved = e;
+
+        // Message schedule, four words at a time.
+        uint32x4_t w[20];
+        for( byte i = 0; i < 4; i++ )
+            w[i] = vreinterpretq_u32_u8( vrev32q_u8( vld1q_u8( block + 16*i ) ) );
+        for( byte i = 4; i < 20; i++ )
+            w[i] = vsha1su1q_u32( vsha1su0q_u32( w[i-4], w[i-3], w[i-2] ), w[i-1] );
+
+        for( byte i = 0; i < 20; i++ )
+        {
+            uint32x4_t wk = vaddq_u32( w[i], vdupq_n_u32( k[i/5] ) );
+            uint32_t next = vsha1h_u32( vgetq_lane_u32( abcd, 0 ) );
+            if( i < 5 )
+                abcd = vsha1cq_u32( abcd, e, wk );
+            else if( i < 10 || i >= 15 )
+                abcd = vsha1pq_u32( abcd, e, wk );
+            else
+                abcd = vsha1mq_u32( abcd, e, wk );
+            e = next;
+        }
+
+        abcd = vaddq_u32( abcd, abcdSaved );
+        e += eSaved;
+    }
+
+    vst1q_u32( state, abcd );
+    state[4] = e;
+}
+
+#endif
+
+static void compressBlock(uint32_t state[5], const uint8_t *block)
+{
+#if defined(WEBSOCKET_ACCEPT_SHANI)
+    if( haveShaNi() )
+        compressShaNi( state, block, 1 );
+    else
+#endif
+#if defined(WEBSOCKET_ACCEPT_ARMV8)
+    compressArmv8( state, block, 1 );
+#else
+    compress( state, block, 1 );
+#endif
+}
+
+void websocket_accept(char *accept, const char *key)
+{
+    uint32_t state[5];
+    memcpy_P( state, initialState, sizeof(state) );
+
+    // Key, GUID and the 0x80 end marker...
+    uint8_t block[64];
+    memcpy( block, key, WEBSOCKET_KEY_LENGTH );
+    memcpy_P( block + WEBSOCKET_KEY_LENGTH, guid, 36 );
+    block[60] = 0x80;
+    block[61] = block[62] = block[63] = 0;
+    compressBlock( state, block );
+
+    // ...then a block of zeros ending in the message length: 60 bytes is 480 bits.
+    memset( block, 0, 62 );
+    block[62] = 480 >> 8;
+    block[63] = 480 & 0xff;
+    compressBlock( state, block );
+
+    uint8_t digest[20];
+    for( byte i = 0; i < 5; i++ )
+    {
+        digest[4*i] = state[i] >> 24;
+        digest[4*i+1] = state[i] >> 16;
+        digest[4*i+2] = state[i] >> 8;
+        digest[4*i+3] = state[i];
+    }
+    base64_encode( accept, (char *)digest, sizeof(digest) );
+}
+
+bool websocket_key_valid(const char *key)
+{
+    char raw[16 + 2];
+    return strlen( key ) == WEBSOCKET_KEY_LENGTH && base64_decode_strict( raw, key, WEBSOCKET_KEY_LENGTH ) == 16;
+}
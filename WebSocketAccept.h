@@ -0,0 +1,25 @@
+#include "WebSocketPlatform.h"
+
+#ifndef H_WEBSOCKETACCEPT
+#define H_WEBSOCKETACCEPT
+
+// A Sec-WebSocket-Key as clients send it: 16 random bytes in Base64.
+#define WEBSOCKET_KEY_LENGTH 24
+
+// Sec-WebSocket-Accept: a SHA-1 digest in Base64.
+#define WEBSOCKET_ACCEPT_LENGTH 28
+
+// Compute the Sec-WebSocket-Accept value for a WEBSOCKET_KEY_LENGTH
+// character key: Base64 of the SHA-1 of the key and the protocol GUID.
+// 'accept' receives WEBSOCKET_ACCEPT_LENGTH characters and a terminator.
+//
+// Key and GUID always make 60 bytes, so this is exactly two SHA-1 blocks,
+// the second of them constant. No streaming, no heap, and SHA-NI or the
+// ARMv8 SHA-1 instructions where the CPU has them.
+void websocket_accept(char *accept, const char *key);
+
+// True if 'key' is canonical Base64 for exactly 16 bytes, as RFC 6455
+// requires of a Sec-WebSocket-Key.
+bool websocket_key_valid(const char *key);
+
+#endif
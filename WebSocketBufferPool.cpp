@@ -0,0 +1,72 @@
+#include "WebSocketBufferPool.h"
+
+WebSocketBufferPool::WebSocketBufferPool(word slabSize, word slabCount) :
+    m_ownsMemory(true),
+    m_free(NULL),
+    m_slabSize(slabSize),
+    m_slabCount(slabCount),
+    m_available(slabCount)
+{
+    m_memory = new uint8_t[ WEBSOCKET_POOL_BYTES( slabSize, slabCount ) ];
+    if( !m_memory )
+    {
+        // Out of RAM (AVR new returns NULL): an empty pool.
+        m_slabCount = m_available = 0;
+        return;
+    }
+
+    carve();
+}
+
+WebSocketBufferPool::WebSocketBufferPool(uint8_t *memory, word slabSize, word slabCount) :
+    m_memory(memory),
+    m_ownsMemory(false),
+    m_free(NULL),
+    m_slabSize(slabSize),
+    m_slabCount(slabCount),
+    m_available(slabCount)
+{
+    carve();
+}
+
+WebSocketBufferPool::~WebSocketBufferPool()
+{
+    if( m_ownsMemory )
+        delete[] m_memory;
+}
+
+void WebSocketBufferPool::carve()
+{
+    // Keep every slab aligned for the free list link.
+    if( m_slabSize < sizeof(uint8_t *) )
+        m_slabSize = sizeof(uint8_t *);
+    size_t stride = WEBSOCKET_POOL_STRIDE( m_slabSize );
+
+    for( word x = m_slabCount; x > 0; x-- )
+    {
+        uint8_t *slab = m_memory + stride * ( x - 1 );
+        memcpy( slab, &m_free, sizeof(m_free) );
+        m_free = slab;
+    }
+}
+
+uint8_t *WebSocketBufferPool::acquire()
+{
+    uint8_t *slab = m_free;
+    if( !slab )
+        return NULL;
+
+    memcpy( &m_free, slab, sizeof(m_free) );
+    m_available--;
+    return slab;
+}
+
+void WebSocketBufferPool::release(uint8_t *slab)
+{
+    if( !slab )
+        return;
+
+    memcpy( slab, &m_free, sizeof(m_free) );
+    m_free = slab;
+    m_available++;
+}
@@ -0,0 +1,52 @@
+#include "WebSocketPlatform.h"
+
+#ifndef H_WEBSOCKETBUFFERPOOL
+#define H_WEBSOCKETBUFFERPOOL
+
+// Bytes a pool of 'count' slabs of 'size' takes, each slab rounded up to
+// keep the free list links aligned. A constant expression, for sizing
+// static storage.
+#define WEBSOCKET_POOL_STRIDE(size) ( ( (size) < sizeof(uint8_t *) ? sizeof(uint8_t *) : (size_t)(size) ) + sizeof(uint8_t *) - 1 ) / sizeof(uint8_t *) * sizeof(uint8_t *)
+#define WEBSOCKET_POOL_BYTES(size, count) ( WEBSOCKET_POOL_STRIDE(size) * (size_t)(count) )
+
+// Fixed-size slabs carved out of one allocation. Sockets borrow a slab only
+// while they hold unparsed input or a partial message, so receive memory is
+// bounded by the pool rather than by the number of connections.
+class WebSocketBufferPool {
+public:
+    WebSocketBufferPool(word slabSize, word slabCount);
+
+    // Carve the slabs out of caller-provided memory instead, at least
+    // WEBSOCKET_POOL_BYTES(slabSize, slabCount) bytes aligned for a pointer,
+    // which must outlive the pool.
+    WebSocketBufferPool(uint8_t *memory, word slabSize, word slabCount);
+    ~WebSocketBufferPool();
+
+    // A free slab, or NULL if they're all lent out.
+    uint8_t *acquire();
+
+    // Hand back a slab from acquire().
+    void release(uint8_t *slab);
+
+    word slabSize() { return m_slabSize; }
+    word slabCount() { return m_slabCount; }
+
+    // Count of slabs not lent out.
+    word available() { return m_available; }
+
+private:
+    uint8_t *m_memory;
+    bool m_ownsMemory;
+
+    // Free slabs, linked through their first bytes.
+    uint8_t *m_free;
+
+    word m_slabSize;
+    word m_slabCount;
+    word m_available;
+
+    // Link every slab into the free list.
+    void carve();
+};
+
+#endif
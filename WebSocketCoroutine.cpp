@@ -0,0 +1,127 @@
+#include "WebSocketCoroutine.h"
+
+#if WEBSOCKET_COROUTINES
+
+#include "WebSocket.h"
+
+//#define DEBUG 1
+
+thread_local WebSocketFramePool::Block *WebSocketFramePool::s_free[WebSocketFramePool::CLASSES];
+
+void WebSocketFramePool::trim()
+{
+    for( byte x=0; x < CLASSES; x++ )
+    {
+        while( s_free[x] )
+        {
+            Block *next = s_free[x]->next;
+            free( s_free[x] );
+            s_free[x] = next;
+        }
+    }
+}
+
+WebSocketReceiver::WebSocketReceiver() :
+    m_message(),
+    m_head(NULL),
+    m_tail(NULL),
+    m_held(NULL),
+    m_closed(false)
+{
+}
+
+WebSocketReceiver::~WebSocketReceiver()
+{
+    free( m_held );
+    while( m_head )
+    {
+        Queued *next = m_head->next;
+        free( m_head );
+        m_head = next;
+    }
+}
+
+void WebSocketReceiver::deliver( WebSocket &socket, char *data, word length, void *opaque )
+{
+    WebSocketReceiver *receiver = (WebSocketReceiver *)opaque;
+    if( receiver->m_waiter )
+    {
+        // Straight from the receive buffer, which stays put until the
+        // coroutine waits again and we return.
+        receiver->m_message.opcode = socket.opcode();
+        receiver->m_message.data = data;
+        receiver->m_message.length = length;
+
+        std::coroutine_handle<> waiter = receiver->m_waiter;
+        receiver->m_waiter = nullptr;
+        waiter.resume();
+        return;
+    }
+
+    // Nobody waiting: keep a copy, terminated like the original.
+    Queued *queued = (Queued *)malloc( offsetof(Queued, data) + length + 1 );
+    if( !queued )
+    {
+#ifdef DEBUG
+        Serial.println(F("No memory to queue a message for a coroutine."));
+#endif
+        return;
+    }
+
+    queued->next = NULL;
+    queued->message.opcode = socket.opcode();
+    queued->message.data = queued->data;
+    queued->message.length = length;
+    memcpy( queued->data, data, length );
+    queued->data[length] = '\0';
+
+    if( receiver->m_tail )
+        receiver->m_tail->next = queued;
+    else
+        receiver->m_head = queued;
+    receiver->m_tail = queued;
+}
+
+void WebSocketReceiver::close()
+{
+    m_closed = true;
+    if( !m_waiter )
+        return;
+
+    std::coroutine_handle<> waiter = m_waiter;
+    m_waiter = nullptr;
+    waiter.resume();
+}
+
+bool WebSocketReceiver::wait( std::coroutine_handle<> waiter )
+{
+    if( m_waiter )
+    {
+#ifdef DEBUG
+        Serial.println(F("Two coroutines receiving on one socket."));
+#endif
+        return false;
+    }
+
+    m_waiter = waiter;
+    return true;
+}
+
+WebSocketMessage WebSocketReceiver::take()
+{
+    free( m_held );
+    m_held = NULL;
+
+    WebSocketMessage message = m_message;
+    m_message = WebSocketMessage();
+    if( message.opcode || !m_head )
+        return message; // Handed over, or closed.
+
+    m_held = m_head;
+    m_head = m_head->next;
+    if( !m_head )
+        m_tail = NULL;
+    return m_held->message;
+}
+
+#endif
@@ -0,0 +1,151 @@
+#include "WebSocketPlatform.h"
+
+#ifndef H_WEBSOCKETCOROUTINE
+#define H_WEBSOCKETCOROUTINE
+
+// C++20 coroutines: co_await a socket's next message or a server's next
+// connection, on the thread that calls listen(). Define WEBSOCKET_COROUTINES
+// as 1 to build them in, for the library and every file that includes it
+// alike: it adds members to WebSocket and WebSocketServer, so it can't be
+// left to each file's -std.
+#ifndef WEBSOCKET_COROUTINES
+#define WEBSOCKET_COROUTINES 0
+#endif
+
+#if WEBSOCKET_COROUTINES
+
+#ifndef __cpp_impl_coroutine
+#error "WEBSOCKET_COROUTINES needs a compiler with C++20 coroutines (-std=c++20)."
+#endif
+
+#include <coroutine>
+
+class WebSocket;
+
+// Coroutine frames, recycled through per-thread free lists in steps of
+// GRAIN bytes so a new session doesn't cost a malloc(). Larger frames are
+// malloc()ed as usual.
+class WebSocketFramePool {
+public:
+    // NULL when out of memory, so a promise type allocating through it has
+    // to be able to say so: get_return_object_on_allocation_failure().
+    static void *allocate(size_t size)
+    {
+        size_t index = ( size - 1 ) / GRAIN;
+        if( index >= CLASSES )
+            return malloc( size );
+
+        Block *block = s_free[index];
+        if( !block )
+            return malloc( ( index + 1 ) * GRAIN );
+        s_free[index] = block->next;
+        return block;
+    }
+
+    static void release(void *frame, size_t size)
+    {
+        size_t index = ( size - 1 ) / GRAIN;
+        if( index >= CLASSES )
+        {
+            free( frame );
+            return;
+        }
+
+        Block *block = (Block *)frame;
+        block->next = s_free[index];
+        s_free[index] = block;
+    }
+
+    // Hand this thread's spare frames back to malloc().
+    static void trim();
+
+private:
+    enum { GRAIN = 64, CLASSES = 16 };
+
+    typedef struct Block {
+        struct Block *next;
+    } Block;
+
+    static thread_local Block *s_free[CLASSES];
+};
+
+// Return type for coroutines run by the server's loop. One starts at once,
+// runs to its first co_await that has to wait, and frees itself when it
+// returns; there's nothing to keep or await.
+class WebSocketTask {
+public:
+    struct promise_type {
+        WebSocketTask get_return_object() { return WebSocketTask(); }
+        std::suspend_never initial_suspend() noexcept { return std::suspend_never(); }
+        std::suspend_never final_suspend() noexcept { return std::suspend_never(); }
+        void return_void() {}
+        void unhandled_exception() { abort(); }
+
+        // Out of memory, the coroutine simply doesn't run.
+        static void *operator new(size_t size) noexcept { return WebSocketFramePool::allocate( size ); }
+        static void operator delete(void *frame, size_t size) { WebSocketFramePool::release( frame, size ); }
+        static WebSocketTask get_return_object_on_allocation_failure() { return WebSocketTask(); }
+    };
+};
+
+// A message from co_await socket.receive(). Text is terminated, as for the
+// data callback. The data is good until the coroutine next waits. Tests
+// false once the connection has closed.
+struct WebSocketMessage {
+    byte opcode; // OPCODE_TEXT or OPCODE_BINARY, 0 once closed.
+    char *data;
+    word length;
+
+    explicit operator bool() const { return opcode != 0; }
+};
+
+// A socket's side of co_await receive(): the coroutine waiting, and copies
+// of messages that came in while it wasn't.
+class WebSocketReceiver {
+public:
+    class Awaiter {
+    public:
+        Awaiter(WebSocketReceiver *receiver) : m_receiver(receiver) {}
+
+        bool await_ready() { return !m_receiver || m_receiver->ready(); }
+        bool await_suspend(std::coroutine_handle<> waiter) { return m_receiver->wait( waiter ); }
+        WebSocketMessage await_resume() { return m_receiver ? m_receiver->take() : WebSocketMessage(); }
+
+    private:
+        WebSocketReceiver *m_receiver;
+    };
+
+    WebSocketReceiver();
+    ~WebSocketReceiver();
+
+    // Data callback: hand a message to the waiting coroutine, or queue a copy.
+    static void deliver(WebSocket &socket, char *data, word length, void *opaque);
+
+    // The connection has closed: wake the coroutine with an empty message,
+    // once what's queued has been taken. Or it has been reopened.
+    void close();
+    void reopen() { m_closed = false; }
+
+private:
+    typedef struct Queued {
+        struct Queued *next;
+        WebSocketMessage message;
+        char data[1];
+    } Queued;
+
+    std::coroutine_handle<> m_waiter;
+    WebSocketMessage m_message; // Being handed over from the receive buffer.
+    Queued *m_head, *m_tail;
+    Queued *m_held; // Last queued message taken, freed with the next.
+    bool m_closed;
+
+    bool ready() { return m_head || m_closed; }
+
+    // Returns false, not waiting, if another coroutine already is.
+    bool wait(std::coroutine_handle<> waiter);
+    WebSocketMessage take();
+};
+
+#endif
+
+#endif
@@ -0,0 +1,397 @@
+#include "WebSocketDeflate.h"
+
+#if WEBSOCKET_DEFLATE
+
+// One extension from a Sec-WebSocket-Extensions list.
+typedef struct {
+    bool deflate; // It's permessage-deflate...
+    bool valid; // ...with well-formed parameters, none of them repeated.
+    byte seen; // Parameters present, below.
+    bool serverNoContextTakeover;
+    bool clientNoContextTakeover;
+    byte serverMaxWindowBits; // 0 if absent.
+    byte clientMaxWindowBits; // 0 if absent or given without a value.
+} Extension;
+
+enum { SERVER_NO_TAKEOVER=0x01, CLIENT_NO_TAKEOVER=0x02, SERVER_WINDOW=0x04, CLIENT_WINDOW=0x08 };
+
+static const char *skipSpace(const char *p)
+{
+    while( *p == ' ' || *p == '\t' )
+        p++;
+    return p;
+}
+
+// Copy the token or quoted string at 'p' into 'token', which is left empty
+// if it doesn't fit. Returns the position after it.
+static const char *readToken(const char *p, char *token, byte size)
+{
+    byte n = 0;
+    bool quoted = ( *p == '"' );
+    if( quoted )
+        p++;
+
+    for( ; *p && ( quoted ? *p != '"' : !strchr( " \t,;=\"", *p ) ); p++ )
+    {
+        if( n == 0xFF || n >= size - 1 )
+            n = 0xFF;
+        else
+            token[n++] = *p;
+    }
+    if( quoted && *p == '"' )
+        p++;
+
+    token[n == 0xFF ? 0 : n] = '\0';
+    return p;
+}
+
+// A window size, 8 to 15 with no leading zero, or 0 if it's anything else.
+static byte windowBits(const char *value)
+{
+    if( !value || value[0] < '1' || value[0] > '9' )
+        return 0;
+    char *end;
+    long bits = strtol( value, &end, 10 );
+    return ( *end == '\0' && bits >= 8 && bits <= 15 ) ? bits : 0;
+}
+
+static bool applyParameter(Extension &extension, const char *name, const char *value)
+{
+    byte flag;
+    if( !strcasecmp( name, "server_no_context_takeover" ) && !value )
+    {
+        flag = SERVER_NO_TAKEOVER;
+        extension.serverNoContextTakeover = true;
+    }
+    else if( !strcasecmp( name, "client_no_context_takeover" ) && !value )
+    {
+        flag = CLIENT_NO_TAKEOVER;
+        extension.clientNoContextTakeover = true;
+    }
+    else if( !strcasecmp( name, "server_max_window_bits" ) && windowBits( value ) )
+    {
+        flag = SERVER_WINDOW;
+        extension.serverMaxWindowBits = windowBits( value );
+    }
+    else if( !strcasecmp( name, "client_max_window_bits" ) && ( !value || windowBits( value ) ) )
+    {
+        flag = CLIENT_WINDOW;
+        extension.clientMaxWindowBits = windowBits( value );
+    }
+    else
+        return false;
+
+    if( extension.seen & flag )
+        return false;
+    extension.seen |= flag;
+    return true;
+}
+
+// Parse the extension at 'p' and return the position of the next one.
+static const char *parseExtension(const char *p, Extension &extension)
+{
+    memset( &extension, 0, sizeof(extension) );
+    extension.valid = true;
+
+    char name[32], value[8];
+    p = skipSpace( readToken( skipSpace( p ), name, sizeof(name) ) );
+    extension.deflate = !strcasecmp( name, "permessage-deflate" );
+
+    while( *p == ';' )
+    {
+        p = skipSpace( readToken( skipSpace( p + 1 ), name, sizeof(name) ) );
+        bool hasValue = ( *p == '=' );
+        if( hasValue )
+            p = skipSpace( readToken( skipSpace( p + 1 ), value, sizeof(value) ) );
+        if( !applyParameter( extension, name, hasValue ? value : NULL ) )
+            extension.valid = false;
+    }
+
+    // Anything else before the next comma is malformed.
+    if( *p && *p != ',' )
+    {
+        extension.valid = false;
+        while( *p && *p != ',' )
+            p++;
+    }
+    return *p == ',' ? p + 1 : p;
+}
+
+static int append(char *buffer, size_t size, int used, const char *format, unsigned int value = 0)
+{
+    if( used < 0 || (size_t)used >= size )
+        return used;
+    int written = snprintf( buffer + used, size - used, format, value );
+    return written < 0 ? -1 : used + written;
+}
+
+bool WebSocketDeflate::accept(const char *offers, const WebSocketDeflateOptions &options, Params &params, char *response, size_t size)
+{
+    for( const char *p = offers; *skipSpace( p ); )
+    {
+        Extension offer;
+        p = parseExtension( p, offer );
+        if( !offer.deflate || !offer.valid )
+            continue;
+
+        // Our window, within whatever limit the client set.
+        byte serverBits = options.serverMaxWindowBits;
+        if( offer.serverMaxWindowBits && offer.serverMaxWindowBits < serverBits )
+            serverBits = offer.serverMaxWindowBits;
+
+        // The client's window can only be limited if it says it can do that.
+        byte clientBits = 15;
+        if( offer.seen & CLIENT_WINDOW )
+        {
+            clientBits = options.clientMaxWindowBits;
+            if( offer.clientMaxWindowBits && offer.clientMaxWindowBits < clientBits )
+                clientBits = offer.clientMaxWindowBits;
+        }
+        else if( options.clientMaxWindowBits < 15 )
+            continue;
+
+        params.deflateBits = serverBits > 8 ? serverBits : 0;
+        params.inflateBits = clientBits;
+        params.deflateReset = offer.serverNoContextTakeover || options.serverNoContextTakeover;
+        params.inflateReset = offer.clientNoContextTakeover || options.clientNoContextTakeover;
+
+        int used = append( response, size, 0, "permessage-deflate" );
+        if( params.deflateReset )
+            used = append( response, size, used, "; server_no_context_takeover" );
+        if( params.inflateReset )
+            used = append( response, size, used, "; client_no_context_takeover" );
+        if( ( offer.seen & SERVER_WINDOW ) || serverBits < 15 )
+            used = append( response, size, used, "; server_max_window_bits=%u", serverBits );
+        if( offer.clientMaxWindowBits || clientBits < 15 )
+            used = append( response, size, used, "; client_max_window_bits=%u", clientBits );
+        return used >= 0 && (size_t)used < size;
+    }
+    return false;
+}
+
+void WebSocketDeflate::offer(char *offer, size_t size, const WebSocketDeflateOptions &options)
+{
+    int used = append( offer, size, 0, "permessage-deflate; client_max_window_bits" );
+    if( options.clientMaxWindowBits < 15 )
+        used = append( offer, size, used, "=%u", options.clientMaxWindowBits );
+    if( options.serverMaxWindowBits < 15 )
+        used = append( offer, size, used, "; server_max_window_bits=%u", options.serverMaxWindowBits );
+    if( options.serverNoContextTakeover )
+        used = append( offer, size, used, "; server_no_context_takeover" );
+    if( options.clientNoContextTakeover )
+        append( offer, size, used, "; client_no_context_takeover" );
+}
+
+bool WebSocketDeflate::confirm(const char *response, const WebSocketDeflateOptions &options, Params &params)
+{
+    // Exactly the one extension we offered.
+    Extension reply;
+    if( *skipSpace( parseExtension( response, reply ) ) || !reply.deflate || !reply.valid )
+        return false;
+
+    // The server must keep within any limits we asked for...
+    params.inflateBits = reply.serverMaxWindowBits ? reply.serverMaxWindowBits : 15;
+    if( params.inflateBits > options.serverMaxWindowBits )
+        return false;
+    if( options.serverNoContextTakeover && !reply.serverNoContextTakeover )
+        return false;
+    params.inflateReset = reply.serverNoContextTakeover;
+
+    // ...and may set some for us, but only with a value.
+    if( ( reply.seen & CLIENT_WINDOW ) && !reply.clientMaxWindowBits )
+        return false;
+    byte clientBits = options.clientMaxWindowBits;
+    if( reply.clientMaxWindowBits && reply.clientMaxWindowBits < clientBits )
+        clientBits = reply.clientMaxWindowBits;
+    params.deflateBits = clientBits > 8 ? clientBits : 0;
+    params.deflateReset = reply.clientNoContextTakeover || options.clientNoContextTakeover;
+    return true;
+}
+
+WebSocketDeflate::WebSocketDeflate(const WebSocketDeflateOptions &options, const Params &params, word capacity) :
+    m_params(params),
+    m_memLevel(options.memLevel),
+    m_level(options.level),
+    m_threshold(options.threshold),
+    m_capacity(capacity),
+    m_deflating(false),
+    m_inflating(false),
+    m_deflated(NULL),
+    m_inflated(NULL)
+{
+}
+
+WebSocketDeflate::~WebSocketDeflate()
+{
+    endDeflate();
+    endInflate();
+}
+
+bool WebSocketDeflate::startDeflate()
+{
+    if( m_deflating )
+        return true;
+
+    if( !m_deflated )
+        m_deflated = (uint8_t *)malloc( WEBSOCKET_DEFLATE_CHUNK );
+    memset( &m_deflater, 0, sizeof(m_deflater) );
+
+    // Negative window bits: raw deflate, no zlib header or checksum.
+    if( !m_deflated || deflateInit2( &m_deflater, m_level, Z_DEFLATED, -m_params.deflateBits, m_memLevel, Z_DEFAULT_STRATEGY ) != Z_OK )
+        return false;
+    m_deflating = true;
+    return true;
+}
+
+bool WebSocketDeflate::startInflate()
+{
+    if( m_inflating )
+        return true;
+
+    if( !m_inflated )
+        m_inflated = (uint8_t *)malloc( m_capacity + 1 );
+    memset( &m_inflater, 0, sizeof(m_inflater) );
+    if( !m_inflated || inflateInit2( &m_inflater, -m_params.inflateBits ) != Z_OK )
+        return false;
+    m_inflating = true;
+    return true;
+}
+
+void WebSocketDeflate::endDeflate()
+{
+    if( m_deflating )
+        deflateEnd( &m_deflater );
+    m_deflating = false;
+    free( m_deflated );
+    m_deflated = NULL;
+}
+
+void WebSocketDeflate::endInflate()
+{
+    if( m_inflating )
+        inflateEnd( &m_inflater );
+    m_inflating = false;
+    free( m_inflated );
+    m_inflated = NULL;
+}
+
+WebSocketDeflate::Result WebSocketDeflate::compress(const WebSocketIovec *iov, byte count, Sink *sink, void *context)
+{
+    if( !startDeflate() )
+    {
+        endDeflate();
+        return FAILED;
+    }
+
+    Result result = OK;
+    word pending = 0;
+    for( byte x=0; x <= count && result == OK; x++ )
+    {
+        // Each piece, then an empty pass that flushes to a byte boundary.
+        bool flush = ( x == count );
+        if( !flush && !iov[x].length )
+            continue;
+        m_deflater.next_in = flush ? NULL : (Bytef *)iov[x].data;
+        m_deflater.avail_in = flush ? 0 : iov[x].length;
+
+        do
+        {
+            m_deflater.next_out = m_deflated + pending;
+            m_deflater.avail_out = WEBSOCKET_DEFLATE_CHUNK - pending;
+            if( deflate( &m_deflater, flush ? Z_SYNC_FLUSH : Z_NO_FLUSH ) == Z_STREAM_ERROR )
+            {
+                result = FAILED;
+                break;
+            }
+
+            pending = WEBSOCKET_DEFLATE_CHUNK - m_deflater.avail_out;
+            if( pending == WEBSOCKET_DEFLATE_CHUNK )
+            {
+                // Full frame. The last 4 bytes stay, they may be the start of
+                // the flush marker.
+                if( !sink( context, m_deflated, pending - 4, false ) )
+                {
+                    result = ABORTED;
+                    break;
+                }
+                memmove( m_deflated, m_deflated + pending - 4, 4 );
+                pending = 4;
+            }
+        } while( m_deflater.avail_in || ( flush && !m_deflater.avail_out ) );
+    }
+
+    // The flush ends in 00 00 FF FF, which the receiver puts back.
+    if( result == OK && !sink( context, m_deflated, pending >= 4 ? pending - 4 : 0, true ) )
+        result = ABORTED;
+
+    // Unless the peer saw the whole message, our history no longer matches
+    // its own; starting afresh keeps later messages decodable.
+    if( result != OK || m_params.deflateReset )
+        endDeflate();
+    return result;
+}
+
+WebSocketDeflate::Result WebSocketDeflate::decompress(const uint8_t *data, size_t length, bool final, Sink *sink, void *context)
+{
+    static const uint8_t marker[4] = { 0x00, 0x00, 0xFF, 0xFF };
+
+    if( !startInflate() )
+    {
+        endInflate();
+        return FAILED;
+    }
+
+    Result result = OK;
+    size_t pending = 0;
+    for( byte pass=0; pass < ( final ? 2 : 1 ) && result == OK; pass++ )
+    {
+        // The payload, then the marker the sender stripped.
+        m_inflater.next_in = (Bytef *)( pass ? marker : data );
+        m_inflater.avail_in = pass ? sizeof(marker) : length;
+
+        do
+        {
+            // Inflating into the terminator's byte as well tells output
+            // that only just fills the buffer, which can still be the last
+            // piece, from more than a buffer's worth.
+            m_inflater.next_out = m_inflated + pending;
+            m_inflater.avail_out = m_capacity + 1 - pending;
+            int status = inflate( &m_inflater, Z_SYNC_FLUSH );
+            pending = m_capacity + 1 - m_inflater.avail_out;
+
+            if( status == Z_STREAM_END )
+                inflateReset( &m_inflater ); // The sender closed the stream with a final block.
+            else if( status != Z_OK && status != Z_BUF_ERROR )
+            {
+                result = FAILED;
+                break;
+            }
+
+            if( pending > m_capacity )
+            {
+                uint8_t spill = m_inflated[m_capacity];
+                m_inflated[m_capacity] = '\0';
+                if( !sink( context, m_inflated, m_capacity, false ) )
+                {
+                    result = ABORTED;
+                    break;
+                }
+                m_inflated[0] = spill;
+                pending = 1;
+            }
+        } while( m_inflater.avail_in || !m_inflater.avail_out );
+    }
+
+    if( result == OK && ( pending || final ) )
+    {
+        m_inflated[pending] = '\0';
+        if( !sink( context, m_inflated, pending, final ) )
+            result = ABORTED;
+    }
+
+    if( result != OK || ( final && m_params.inflateReset ) )
+        endInflate();
+    return result;
+}
+
+#endif
@@ -0,0 +1,139 @@
+#include "WebSocketPlatform.h"
+#include "WebSocketWritable.h"
+
+#ifndef H_WEBSOCKETDEFLATE
+#define H_WEBSOCKETDEFLATE
+
+// permessage-deflate (RFC 7692) is built on zlib, so it's compiled in on
+// hosts that have it and never on AVR. Define WEBSOCKET_DEFLATE as 0 or 1
+// to override, e.g. on an ESP32 with zlib available.
+#if defined(__AVR__)
+#undef WEBSOCKET_DEFLATE
+#define WEBSOCKET_DEFLATE 0
+#elif !defined(WEBSOCKET_DEFLATE) && defined(WEBSOCKET_HOST) && defined(__has_include)
+#if __has_include(<zlib.h>)
+#define WEBSOCKET_DEFLATE 1
+#endif
+#endif
+
+#ifndef WEBSOCKET_DEFLATE
+#define WEBSOCKET_DEFLATE 0
+#endif
+
+#if WEBSOCKET_DEFLATE
+
+#include <zlib.h>
+
+// Largest compressed frame sent; longer messages go out in fragments.
+#ifndef WEBSOCKET_DEFLATE_CHUNK
+#define WEBSOCKET_DEFLATE_CHUNK 1024
+#endif
+
+// Room for a Sec-WebSocket-Extensions value we send.
+#define WEBSOCKET_DEFLATE_HEADER 160
+
+// permessage-deflate settings for a WebSocket or a WebSocketServer, named
+// as in RFC 7692: the server settings govern what the server sends, the
+// client ones what the client sends, whichever end this is.
+//
+// Compressing costs about 2^(windowBits + 2) + 2^(memLevel + 9) bytes per
+// connection, decompressing 2^windowBits + 7K. Without context takeover the
+// state is only held while a message is in flight.
+class WebSocketDeflateOptions {
+public:
+    WebSocketDeflateOptions() :
+        serverMaxWindowBits(15),
+        clientMaxWindowBits(15),
+        serverNoContextTakeover(false),
+        clientNoContextTakeover(false),
+        memLevel(8),
+        level(Z_DEFAULT_COMPRESSION),
+        threshold(64)
+    {}
+
+    // LZ77 window, 8 (256 bytes) to 15 (32K) bits. zlib can't compress
+    // with an 8 bit window, so a side limited to that sends uncompressed.
+    byte serverMaxWindowBits;
+    byte clientMaxWindowBits;
+
+    // Compress each message on its own, without reference to earlier ones.
+    bool serverNoContextTakeover;
+    bool clientNoContextTakeover;
+
+    // zlib memLevel (1 to 9) and level for our own compression.
+    byte memLevel;
+    int level;
+
+    // Messages shorter than this are sent uncompressed.
+    word threshold;
+};
+
+// One connection's permessage-deflate state, created once the handshake
+// has agreed on it.
+class WebSocketDeflate {
+public:
+    // What the handshake agreed on.
+    typedef struct {
+        byte inflateBits; // Window of what the peer sends.
+        byte deflateBits; // Window we may use, 0 if we can't compress.
+        bool inflateReset; // Peer compresses each message on its own.
+        bool deflateReset; // So do we.
+    } Params;
+
+    // ABORTED if a sink returned false, FAILED for bad input or no memory.
+    typedef enum { OK=0, ABORTED, FAILED } Result;
+
+    // Receives output a buffer at a time; returning false abandons the message.
+    typedef bool Sink(void *context, uint8_t *data, word length, bool final);
+
+    // Server: choose the first acceptable permessage-deflate offer in a
+    // Sec-WebSocket-Extensions value and write the reply into 'response'.
+    // Returns false if there is none.
+    static bool accept(const char *offers, const WebSocketDeflateOptions &options, Params &params, char *response, size_t size);
+
+    // Client: write our offer into 'offer'.
+    static void offer(char *offer, size_t size, const WebSocketDeflateOptions &options);
+
+    // Client: check the server's reply to our offer. Returns false if it
+    // asks for anything we didn't offer.
+    static bool confirm(const char *response, const WebSocketDeflateOptions &options, Params &params);
+
+    // 'capacity' is the largest message decompress() may pass on in one piece.
+    WebSocketDeflate(const WebSocketDeflateOptions &options, const Params &params, word capacity);
+    ~WebSocketDeflate();
+
+    // Worth compressing a message of 'length' bytes?
+    bool compresses(frame_length_t length) { return m_params.deflateBits && length >= m_threshold; }
+
+    // Compress a message given as 'count' pieces. 'sink' gets the output a
+    // frame at a time, at most WEBSOCKET_DEFLATE_CHUNK bytes, with 'final'
+    // on the last.
+    Result compress(const WebSocketIovec *iov, byte count, Sink *sink, void *context);
+
+    // Decompress the next piece of a message's payload. 'sink' is passed
+    // 'capacity' bytes whenever more than that have built up, and whatever
+    // there is once the piece is used up, with 'final' set after the last
+    // piece. Output is terminated, there's room for that.
+    Result decompress(const uint8_t *data, size_t length, bool final, Sink *sink, void *context);
+
+private:
+    Params m_params;
+    byte m_memLevel;
+    int m_level;
+    word m_threshold;
+    word m_capacity;
+
+    // Each direction's stream and output buffer, set up when first needed.
+    z_stream m_deflater, m_inflater;
+    bool m_deflating, m_inflating;
+    uint8_t *m_deflated, *m_inflated;
+
+    bool startDeflate();
+    bool startInflate();
+    void endDeflate();
+    void endInflate();
+};
+
+#endif
+
+#endif
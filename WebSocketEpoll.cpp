@@ -0,0 +1,497 @@
+#include "WebSocketEpoll.h"
+
+#ifdef WEBSOCKET_EPOLL
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+//#define DEBUG 1
+
+static void setNonBlocking(int fd)
+{
+    fcntl( fd, F_SETFL, fcntl( fd, F_GETFL, 0 ) | O_NONBLOCK );
+}
+
+static void setNoDelay(int fd)
+{
+    // Frames are written whole, so don't wait to coalesce them.
+    int one = 1;
+    setsockopt( fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one) );
+}
+
+PosixTransport::PosixTransport(int fd) :
+    m_fd(fd),
+    m_hungUp(false),
+    m_peerClosed(false),
+    m_queue(NULL),
+    m_queueStart(0),
+    m_queueEnd(0),
+    m_queueCapacity(0),
+    m_epollFd(-1),
+    m_watchingIn(true),
+    m_watchingOut(false)
+{
+}
+
+PosixTransport::~PosixTransport()
+{
+    stop();
+}
+
+bool PosixTransport::connect(const char *host, word port)
+{
+    stop();
+    m_hungUp = false;
+    m_peerClosed = false;
+
+    char service[8];
+    snprintf( service, sizeof(service), "%u", port );
+
+    struct addrinfo hints, *result;
+    memset( &hints, 0, sizeof(hints) );
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if( getaddrinfo( host, service, &hints, &result ) != 0 )
+        return false;
+
+    for( struct addrinfo *ai = result; ai; ai = ai->ai_next )
+    {
+        int fd = socket( ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol );
+        if( fd < 0 )
+            continue;
+
+        if( ::connect( fd, ai->ai_addr, ai->ai_addrlen ) == 0 )
+        {
+            setNonBlocking( fd );
+            setNoDelay( fd );
+            m_fd = fd;
+            break;
+        }
+        close( fd );
+    }
+    freeaddrinfo( result );
+
+    return m_fd >= 0;
+}
+
+bool PosixTransport::connected()
+{
+    if( m_fd < 0 || m_hungUp )
+        return false;
+
+    // Like EthernetClient, stay "connected" while unread data remains. Only
+    // asked once epoll has seen the peer hang up; read() notices otherwise.
+    return !m_peerClosed || available() > 0;
+}
+
+int PosixTransport::available()
+{
+    int count = 0;
+    if( m_fd < 0 || ioctl( m_fd, FIONREAD, &count ) < 0 )
+        return 0;
+    return count;
+}
+
+int PosixTransport::read(uint8_t *buffer, size_t length)
+{
+    if( m_fd < 0 || m_hungUp )
+        return -1;
+
+    // Without a server transport to say when the socket drains, what's
+    // queued goes out as the owner comes back to read.
+    if( m_queueEnd != m_queueStart && m_epollFd < 0 && !flushQueue() )
+        return -1;
+
+    ssize_t got = recv( m_fd, buffer, length, 0 );
+    if( got > 0 )
+        return got;
+
+    if( got < 0 && ( errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ) )
+        return 0;
+
+    // Orderly shutdown or a hard error.
+    m_hungUp = true;
+    return -1;
+}
+
+size_t PosixTransport::write(const uint8_t *buffer, size_t length)
+{
+    WebSocketIovec iov = { buffer, length };
+    return writev( &iov, 1 );
+}
+
+size_t PosixTransport::writev(const WebSocketIovec *iov, byte count)
+{
+    if( count > WEBSOCKET_MAX_IOV )
+        return WebSocketTransport::writev( iov, count );
+
+    if( m_fd < 0 || m_hungUp )
+        return 0;
+
+    struct iovec vec[WEBSOCKET_MAX_IOV];
+    size_t total = 0;
+    for( byte x=0; x < count; x++ )
+    {
+        vec[x].iov_base = (void *)iov[x].data;
+        vec[x].iov_len = iov[x].length;
+        total += iov[x].length;
+    }
+
+    // Anything already waiting goes first, and if it can't, this waits behind it.
+    if( m_queueEnd != m_queueStart && !flushQueue() )
+        return 0;
+
+    // One sendmsg() for the lot, unless the send buffer fills part way.
+    size_t written = 0;
+    byte first = 0;
+    while( m_queueEnd == m_queueStart && first < count )
+    {
+        struct msghdr msg;
+        memset( &msg, 0, sizeof(msg) );
+        msg.msg_iov = vec + first;
+        msg.msg_iovlen = count - first;
+
+        ssize_t sent = sendmsg( m_fd, &msg, MSG_NOSIGNAL );
+        if( sent > 0 )
+        {
+            written += sent;
+            while( first < count && (size_t)sent >= vec[first].iov_len )
+                sent -= vec[first++].iov_len;
+            if( first < count )
+            {
+                vec[first].iov_base = (uint8_t *)vec[first].iov_base + sent;
+                vec[first].iov_len -= sent;
+            }
+            continue;
+        }
+
+        if( sent < 0 && errno == EINTR )
+            continue;
+
+        if( sent < 0 && ( errno == EAGAIN || errno == EWOULDBLOCK ) )
+            break;
+
+        m_hungUp = true;
+        return written;
+    }
+
+    // The send buffer is full: keep the rest for when it drains.
+    if( first < count && !enqueue( vec + first, count - first ) )
+    {
+#ifdef DEBUG
+        fprintf( stderr, "Write queue limit reached, dropping connection.\n" );
+#endif
+        m_hungUp = true;
+        return written;
+    }
+    return total;
+}
+
+bool PosixTransport::enqueue(const struct iovec *vec, int count)
+{
+    size_t length = 0;
+    for( int x=0; x < count; x++ )
+        length += vec[x].iov_len;
+
+    size_t queued = m_queueEnd - m_queueStart;
+    if( queued + length > WEBSOCKET_WRITE_QUEUE_LIMIT )
+        return false;
+
+    if( m_queueEnd + length > m_queueCapacity )
+    {
+        // Move what's left down, and grow if that isn't enough.
+        memmove( m_queue, m_queue + m_queueStart, queued );
+        m_queueStart = 0;
+        m_queueEnd = queued;
+
+        size_t capacity = m_queueCapacity ? m_queueCapacity : 4096;
+        while( capacity < queued + length )
+            capacity *= 2;
+        if( capacity != m_queueCapacity )
+        {
+            uint8_t *grown = (uint8_t *)realloc( m_queue, capacity );
+            if( !grown )
+                return false;
+            m_queue = grown;
+            m_queueCapacity = capacity;
+        }
+    }
+
+    for( int x=0; x < count; x++ )
+    {
+        memcpy( m_queue + m_queueEnd, vec[x].iov_base, vec[x].iov_len );
+        m_queueEnd += vec[x].iov_len;
+    }
+    watchOutput( true );
+    return true;
+}
+
+bool PosixTransport::flushQueue()
+{
+    while( m_queueStart < m_queueEnd )
+    {
+        ssize_t sent = send( m_fd, m_queue + m_queueStart, m_queueEnd - m_queueStart, MSG_NOSIGNAL );
+        if( sent > 0 )
+        {
+            m_queueStart += sent;
+            continue;
+        }
+
+        if( sent < 0 && errno == EINTR )
+            continue;
+
+        if( sent < 0 && ( errno == EAGAIN || errno == EWOULDBLOCK ) )
+            return true; // Still draining.
+
+        m_hungUp = true;
+        return false;
+    }
+
+    // Drained. Idle connections don't hold on to a queue.
+    free( m_queue );
+    m_queue = NULL;
+    m_queueStart = m_queueEnd = m_queueCapacity = 0;
+    watchOutput( false );
+    return true;
+}
+
+void PosixTransport::watchOutput(bool watch)
+{
+    if( watch != m_watchingOut && updateEvents( m_watchingIn, watch ) )
+        m_watchingOut = watch;
+}
+
+void PosixTransport::watchInput(bool watch)
+{
+    if( watch != m_watchingIn && updateEvents( watch, m_watchingOut ) )
+        m_watchingIn = watch;
+}
+
+bool PosixTransport::updateEvents(bool in, bool out)
+{
+    if( m_epollFd < 0 || m_fd < 0 )
+        return false;
+
+    // Levels, so input left unread is reported again and again; while it
+    // has to wait, so does the peer closing, once we know of it.
+    struct epoll_event ev;
+    ev.events = 0;
+    if( in )
+        ev.events |= EPOLLIN;
+    if( in || !m_peerClosed )
+        ev.events |= EPOLLRDHUP;
+    if( out )
+        ev.events |= EPOLLOUT;
+    ev.data.ptr = this;
+    return epoll_ctl( m_epollFd, EPOLL_CTL_MOD, m_fd, &ev ) == 0;
+}
+
+void PosixTransport::stop()
+{
+    if( m_fd < 0 )
+        return;
+
+    // One last try at what's queued; the kernel sends the rest of its own
+    // buffer after close().
+    if( m_queueEnd != m_queueStart && !m_hungUp )
+        flushQueue();
+    free( m_queue );
+    m_queue = NULL;
+    m_queueStart = m_queueEnd = m_queueCapacity = 0;
+
+    close( m_fd );
+    m_fd = -1;
+    m_watchingIn = true;
+    m_watchingOut = false;
+}
+
+EpollServerTransport::EpollServerTransport(word port) :
+    m_port(port),
+    m_listenFd(-1),
+    m_epollFd(-1),
+    m_wakeFd(-1),
+    m_pollTimeout(0),
+    m_reusePort(false),
+    m_acceptPending(false),
+    m_woken(false)
+{
+}
+
+EpollServerTransport::~EpollServerTransport()
+{
+    end();
+}
+
+void EpollServerTransport::end()
+{
+    if( m_listenFd >= 0 )
+        close( m_listenFd );
+    if( m_epollFd >= 0 )
+        close( m_epollFd );
+    if( m_wakeFd >= 0 )
+        close( m_wakeFd );
+    m_listenFd = m_epollFd = m_wakeFd = -1;
+    m_acceptPending = false;
+}
+
+void EpollServerTransport::begin()
+{
+    // Once is enough; accepted connections are in the epoll set.
+    if( m_listenFd >= 0 )
+        return;
+
+    m_epollFd = epoll_create1( EPOLL_CLOEXEC );
+    m_listenFd = socket( AF_INET6, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0 );
+    if( m_epollFd < 0 || m_listenFd < 0 )
+    {
+        end();
+        return;
+    }
+
+    int one = 1, zero = 0;
+    setsockopt( m_listenFd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one) );
+    if( m_reusePort )
+        setsockopt( m_listenFd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one) );
+    setsockopt( m_listenFd, IPPROTO_IPV6, IPV6_V6ONLY, &zero, sizeof(zero) ); // Accept IPv4 too.
+
+    struct sockaddr_in6 addr;
+    memset( &addr, 0, sizeof(addr) );
+    addr.sin6_family = AF_INET6;
+    addr.sin6_addr = in6addr_any;
+    addr.sin6_port = htons( m_port );
+
+    if( bind( m_listenFd, (struct sockaddr *)&addr, sizeof(addr) ) < 0 || ::listen( m_listenFd, SOMAXCONN ) < 0 )
+    {
+#ifdef DEBUG
+        perror( "EpollServerTransport::begin" );
+#endif
+        end(); // Nothing to keep; begin() can try again.
+        return;
+    }
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL; // NULL marks the listening socket.
+    epoll_ctl( m_epollFd, EPOLL_CTL_ADD, m_listenFd, &ev );
+
+    m_wakeFd = eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC );
+    if( m_wakeFd >= 0 )
+    {
+        ev.events = EPOLLIN;
+        ev.data.ptr = &m_wakeFd; // Marks the wakeup.
+        epoll_ctl( m_epollFd, EPOLL_CTL_ADD, m_wakeFd, &ev );
+    }
+
+    m_acceptPending = true;
+}
+
+void EpollServerTransport::wake()
+{
+    if( m_wakeFd < 0 )
+        return;
+
+    // Only fails if the counter would overflow, with a wakeup pending anyway.
+    uint64_t one = 1;
+    ssize_t written = ::write( m_wakeFd, &one, sizeof(one) );
+    (void)written;
+}
+
+bool EpollServerTransport::takeWakeup()
+{
+    bool woken = m_woken;
+    m_woken = false;
+    return woken;
+}
+
+WebSocketTransport *EpollServerTransport::accept()
+{
+    if( m_listenFd < 0 || !m_acceptPending )
+        return NULL;
+
+    int fd = accept4( m_listenFd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC );
+    if( fd < 0 )
+    {
+        // Drained (EAGAIN) or out of descriptors; poll() will tell us when to retry.
+        m_acceptPending = false;
+        return NULL;
+    }
+
+    setNoDelay( fd );
+
+    PosixTransport *transport = new PosixTransport( fd );
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLRDHUP;
+    ev.data.ptr = transport;
+    if( epoll_ctl( m_epollFd, EPOLL_CTL_ADD, fd, &ev ) < 0 )
+    {
+        delete transport;
+        return NULL;
+    }
+    transport->m_epollFd = m_epollFd;
+
+    return transport;
+}
+
+void EpollServerTransport::release(WebSocketTransport *transport)
+{
+    PosixTransport *t = (PosixTransport *)transport;
+    if( t->fd() >= 0 )
+        epoll_ctl( m_epollFd, EPOLL_CTL_DEL, t->fd(), NULL );
+    delete t;
+}
+
+int EpollServerTransport::poll(WebSocketTransport **ready, int max)
+{
+    if( m_epollFd < 0 )
+        return 0;
+
+    struct epoll_event events[64];
+    if( max > 64 )
+        max = 64;
+
+    int count = epoll_wait( m_epollFd, events, max, m_pollTimeout );
+    if( count < 0 )
+        return 0;
+
+    int found = 0;
+    for( int x=0; x < count; x++ )
+    {
+        if( !events[x].data.ptr )
+            m_acceptPending = true;
+        else if( events[x].data.ptr == &m_wakeFd )
+        {
+            uint64_t count;
+            if( ::read( m_wakeFd, &count, sizeof(count) ) > 0 )
+                m_woken = true;
+        }
+        else
+        {
+            PosixTransport *t = (PosixTransport *)events[x].data.ptr;
+
+            // Room to send: carry on with what's queued. Only reported
+            // further if that fails, so the server can drop it.
+            bool failed = ( events[x].events & EPOLLOUT ) && !t->flushQueue();
+            if( ( events[x].events & ( EPOLLRDHUP | EPOLLHUP | EPOLLERR ) ) && !t->m_peerClosed )
+            {
+                t->m_peerClosed = true;
+                if( !t->m_watchingIn )
+                    t->updateEvents( false, t->m_watchingOut );
+            }
+            if( failed || ( events[x].events & ~EPOLLOUT ) )
+                ready[found++] = t;
+        }
+    }
+    return found;
+}
+
+#endif
@@ -0,0 +1,116 @@
+#include "WebSocketTransport.h"
+
+#ifndef H_WEBSOCKETEPOLL
+#define H_WEBSOCKETEPOLL
+
+#if defined(__linux__) && !defined(ARDUINO)
+
+#define WEBSOCKET_EPOLL 1
+
+// Bytes a connection may have waiting for a slow reader. Past this it's
+// dropped, rather than buffering without end or holding up the others.
+#ifndef WEBSOCKET_WRITE_QUEUE_LIMIT
+#define WEBSOCKET_WRITE_QUEUE_LIMIT 262144
+#endif
+
+struct iovec;
+
+// WebSocketTransport over a non-blocking POSIX TCP socket. Writes never wait:
+// what the kernel won't take yet is queued and sent as the socket drains,
+// which EpollServerTransport reports, or on the next read or write.
+class PosixTransport : public WebSocketTransport {
+public:
+    PosixTransport(int fd = -1);
+    ~PosixTransport();
+
+    int fd() { return m_fd; }
+
+    bool connect(const char *host, word port);
+    bool connected();
+    int available();
+    int read(uint8_t *buffer, size_t length);
+    size_t write(const uint8_t *buffer, size_t length);
+    size_t writev(const WebSocketIovec *iov, byte count);
+    void stop();
+    void watchInput(bool watch);
+
+    // Count of bytes written but still waiting to go out.
+    size_t queued() { return m_queueEnd - m_queueStart; }
+
+private:
+    friend class EpollServerTransport;
+
+    int m_fd;
+    bool m_hungUp;
+    bool m_peerClosed; // Reported by epoll; unread input may remain.
+
+    // Unsent bytes lie between m_queueStart and m_queueEnd.
+    uint8_t *m_queue;
+    size_t m_queueStart, m_queueEnd, m_queueCapacity;
+
+    // Set by the server transport that watches us, which is told to wake
+    // us once the socket drains while anything is queued.
+    int m_epollFd;
+    bool m_watchingIn;
+    bool m_watchingOut;
+
+    // Append what sendmsg() didn't take. Returns false past the limit.
+    bool enqueue(const struct iovec *vec, int count);
+
+    // Send what's queued, as much as the socket takes. Returns false if
+    // the connection failed.
+    bool flushQueue();
+    void watchOutput(bool watch);
+
+    // Tell epoll what we're waiting for now.
+    bool updateEvents(bool in, bool out);
+};
+
+// Listening TCP socket with an epoll set of accepted connections, so one
+// WebSocketServer::listen() loop only touches the sockets that have work.
+class EpollServerTransport : public WebSocketServerTransport {
+public:
+    EpollServerTransport(word port);
+    ~EpollServerTransport();
+
+    void begin();
+    WebSocketTransport *accept();
+    void release(WebSocketTransport *transport);
+    int poll(WebSocketTransport **ready, int max);
+
+    // Milliseconds poll() may block waiting for events (default 0, never block).
+    void setPollTimeout(int ms) { m_pollTimeout = ms; }
+
+    // Share the port with other listeners through SO_REUSEPORT, the kernel
+    // spreading connections among them. Set before begin().
+    void setReusePort(bool reuse) { m_reusePort = reuse; }
+
+    // Did begin() get the port? If not it left nothing open, and can be
+    // called again; once it has, calling it again does nothing.
+    bool listening() { return m_listenFd >= 0; }
+
+    // Cut short a poll() in progress, or the next one. Safe from any thread.
+    void wake();
+
+    // True, once, after poll() was woken.
+    bool takeWakeup();
+
+private:
+    word m_port;
+    int m_listenFd;
+    int m_epollFd;
+    int m_wakeFd;
+    int m_pollTimeout;
+    bool m_reusePort;
+
+    // Set when the listening socket was reported ready by poll().
+    bool m_acceptPending;
+    bool m_woken;
+
+    // Close the listener, epoll set and wakeup.
+    void end();
+};
+
+#endif
+
+#endif
@@ -0,0 +1,72 @@
+#include "WebSocketEthernet.h"
+
+#if defined(ARDUINO)
+
+int EthernetTransport::read(uint8_t *buffer, size_t length)
+{
+    if( !m_client.available() )
+        return m_client.connected() ? 0 : -1;
+
+    return m_client.read( buffer, length );
+}
+
+void EthernetTransport::stop()
+{
+    // Give the chip a moment to send what's still in its buffer.
+    if( m_client )
+    {
+        m_client.flush();
+        delayMicroseconds(10000);
+    }
+    m_client.stop();
+}
+
+EthernetServerTransport::EthernetServerTransport(word port) :
+    m_server(port)
+{
+    for( byte x=0; x < MAX_SOCK_NUM; x++ )
+        m_inUse[x] = false;
+}
+
+WebSocketTransport *EthernetServerTransport::accept()
+{
+    // EthernetServer::available() hands back any client with pending data,
+    // including ones we've already accepted.
+    EthernetClient cli = m_server.available();
+    if( !cli )
+        return NULL;
+
+    for( byte x=0; x < MAX_SOCK_NUM; x++ )
+        if( m_inUse[x] && m_clients[x].m_client == cli )
+            return NULL;
+
+    for( byte x=0; x < MAX_SOCK_NUM; x++ )
+    {
+        if( m_inUse[x] )
+            continue;
+
+        m_inUse[x] = true;
+        m_clients[x].m_client = cli;
+        m_clients[x].setContext( NULL );
+        return &m_clients[x];
+    }
+
+    // More clients than hardware sockets, shouldn't happen.
+    cli.stop();
+    return NULL;
+}
+
+void EthernetServerTransport::release(WebSocketTransport *transport)
+{
+    for( byte x=0; x < MAX_SOCK_NUM; x++ )
+    {
+        if( transport != &m_clients[x] )
+            continue;
+
+        m_clients[x].stop();
+        m_inUse[x] = false;
+        return;
+    }
+}
+
+#endif
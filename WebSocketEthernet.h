@@ -0,0 +1,52 @@
+#include "WebSocketTransport.h"
+
+#ifndef H_WEBSOCKETETHERNET
+#define H_WEBSOCKETETHERNET
+
+#if defined(ARDUINO)
+
+#include <SPI.h>
+#include <Ethernet.h>
+
+// WebSocketTransport over an EthernetClient (W5100 and friends).
+class EthernetTransport : public WebSocketTransport {
+public:
+    EthernetTransport() {}
+    EthernetTransport(const EthernetClient &client) : m_client(client) {}
+
+    EthernetClient &client() { return m_client; }
+
+    bool connect(const char *host, word port) { return m_client.connect( host, port ); }
+    bool connected() { return m_client.connected(); }
+    int available() { return m_client.available(); }
+    int read(uint8_t *buffer, size_t length);
+    size_t write(const uint8_t *buffer, size_t length) { return m_client.write( buffer, length ); }
+    void flush() { m_client.flush(); }
+    void stop();
+
+private:
+    friend class EthernetServerTransport;
+
+    EthernetClient m_client;
+};
+
+// Accepts EthernetClients from an EthernetServer. Connections live in a fixed
+// table sized to the hardware socket count, so accepting never allocates.
+class EthernetServerTransport : public WebSocketServerTransport {
+public:
+    EthernetServerTransport(word port);
+
+    void begin() { m_server.begin(); }
+    WebSocketTransport *accept();
+    void release(WebSocketTransport *transport);
+
+private:
+    EthernetServer m_server;
+
+    EthernetTransport m_clients[MAX_SOCK_NUM];
+    bool m_inUse[MAX_SOCK_NUM];
+};
+
+#endif
+
+#endif
@@ -0,0 +1,230 @@
+#include "WebSocketFormat.h"
+
+#include <float.h>
+#include <math.h>
+
+// Digits of the longest number printed, backwards, plus sign and point.
+#if defined(__AVR__)
+#define FORMAT_DIGITS 52   // FLT_MAX with 9 decimals
+#else
+#define FORMAT_DIGITS 324  // DBL_MAX with 9 decimals
+#endif
+
+// Lay out a sign and 'count' characters, given last first, in 'width'.
+static char *place(char *out, char *end, char sign, const char *reversed, word count, byte flags, byte width)
+{
+    word length = count + ( sign ? 1 : 0 );
+    word pad = width > length ? width - length : 0;
+    if( end - out < length + pad )
+        return NULL;
+
+    if( !( flags & ( WEBSOCKET_FORMAT_LEFT | WEBSOCKET_FORMAT_ZERO ) ) )
+    {
+        memset( out, ' ', pad );
+        out += pad;
+    }
+    if( sign )
+        *out++ = sign;
+    if( ( flags & ( WEBSOCKET_FORMAT_LEFT | WEBSOCKET_FORMAT_ZERO ) ) == WEBSOCKET_FORMAT_ZERO )
+    {
+        memset( out, '0', pad );
+        out += pad;
+    }
+    while( count )
+        *out++ = reversed[--count];
+    if( flags & WEBSOCKET_FORMAT_LEFT )
+    {
+        memset( out, ' ', pad );
+        out += pad;
+    }
+    return out;
+}
+
+static char signOf(bool negative, byte flags)
+{
+    if( negative )
+        return '-';
+    if( flags & WEBSOCKET_FORMAT_PLUS )
+        return '+';
+    if( flags & WEBSOCKET_FORMAT_SPACE )
+        return ' ';
+    return 0;
+}
+
+char *websocket_format_integer(char *out, char *end, websocket_format_uint value, bool negative, byte base, byte flags, byte width)
+{
+    char digits[sizeof(websocket_format_uint) * 3];
+    byte count = 0;
+    char ten = ( flags & WEBSOCKET_FORMAT_UPPER ) ? 'A' : 'a';
+
+    // Decimal on its own, so the compiler can divide by a constant.
+    if( base == 10 )
+    {
+        do {
+            digits[count++] = '0' + value % 10;
+            value /= 10;
+        } while( value );
+    }
+    else
+    {
+        byte shift = base == 16 ? 4 : 3;
+        do {
+            byte digit = value & ( base - 1 );
+            digits[count++] = digit < 10 ? '0' + digit : ten + digit - 10;
+            value >>= shift;
+        } while( value );
+    }
+
+    return place( out, end, signOf( negative, flags ), digits, count, flags, width );
+}
+
+// 'fraction' (0 <= fraction < 1) times 'unit', truncated, and whether the
+// part left over is below (-1), exactly (0) or above (1) a half. Worked out
+// on the exact binary value, so nothing is rounded twice.
+static websocket_format_uint scaleFraction(double fraction, websocket_format_uint unit, signed char &order)
+{
+    // fraction is m / 2^k, m an integer of DBL_MANT_DIG bits. Below 1, k is
+    // at least DBL_MANT_DIG.
+    int exponent;
+#if DBL_MANT_DIG <= 32
+    // AVR's doubles are floats: a 24-bit m times a 32-bit unit is one
+    // 32 x 32 -> 64 bit product, and nothing wider is needed.
+    uint32_t m = ldexp( frexp( fraction, &exponent ), DBL_MANT_DIG );
+    int k = DBL_MANT_DIG - exponent;
+    if( k >= 64 )
+    {
+        order = -1; // The product is below 2^56, so all of it is under a half.
+        return 0;
+    }
+
+    uint64_t product = (uint64_t)m * unit;
+    uint64_t rest = product & ( ( (uint64_t)1 << k ) - 1 );
+    uint64_t half = (uint64_t)1 << ( k - 1 );
+    order = rest < half ? -1 : rest > half;
+    return product >> k;
+#else
+    uint64_t m = ldexp( frexp( fraction, &exponent ), DBL_MANT_DIG );
+    int k = DBL_MANT_DIG - exponent;
+
+    // m * unit, up to 83 bits, as hi * 2^32 + lo.
+    uint64_t lo = ( m & 0xffffffff ) * unit;
+    uint64_t hi = ( m >> 32 ) * unit + ( lo >> 32 );
+    lo &= 0xffffffff;
+
+    int shift = k - 32;
+    if( shift >= 64 )
+    {
+        order = -1; // The product is below 2^84, so all of it is under a half.
+        return 0;
+    }
+
+    // What shifts out is the low 'shift' bits of hi, then lo.
+    uint64_t rest = shift ? hi & ( (uint64_t)-1 >> ( 64 - shift ) ) : 0;
+    if( !shift )
+        order = lo < 0x80000000 ? -1 : lo > 0x80000000;
+    else
+    {
+        uint64_t half = (uint64_t)1 << ( shift - 1 );
+        order = rest < half ? -1 : ( rest > half || lo );
+    }
+    return hi >> shift;
+#endif
+}
+
+char *websocket_format_float(char *out, char *end, double value, byte flags, byte width, byte precision)
+{
+    char digits[FORMAT_DIGITS];
+    word count = 0;
+
+    bool negative = signbit( value );
+    if( negative )
+        value = -value;
+
+    if( isnan( value ) || isinf( value ) )
+    {
+        const char *name = isnan( value ) ? "nan" : "inf";
+        char a = ( flags & WEBSOCKET_FORMAT_UPPER ) ? 'A' - 'a' : 0;
+        for( byte x = 3; x > 0; x-- )
+            digits[count++] = name[x - 1] + a;
+        return place( out, end, signOf( negative, flags ), digits, count, flags & ~WEBSOCKET_FORMAT_ZERO, width );
+    }
+
+    websocket_format_uint unit = 1;
+    for( byte x = 0; x < precision; x++ )
+        unit *= 10;
+
+    // value - whole is exact. Ties go to the even digit, as printf()'s do.
+    double whole = floor( value );
+    signed char order;
+    websocket_format_uint fraction = scaleFraction( value - whole, unit, order );
+    bool odd = precision ? fraction & 1 : fmod( whole, 2 ) != 0;
+    if( order > 0 || ( order == 0 && odd ) )
+        fraction++;
+    if( fraction >= unit )
+    {
+        fraction -= unit;
+        whole += 1;
+    }
+
+    for( byte x = 0; x < precision; x++ )
+    {
+        digits[count++] = '0' + fraction % 10;
+        fraction /= 10;
+    }
+    if( precision )
+        digits[count++] = '.';
+
+    if( whole < (double)(websocket_format_uint)-1 )
+    {
+        websocket_format_uint integer = whole;
+        do {
+            digits[count++] = '0' + integer % 10;
+            integer /= 10;
+        } while( integer );
+    }
+    else
+    {
+        // Beyond the integers, a digit at a time. Only the leading digits
+        // are right; a double doesn't hold more than that anyway.
+        do {
+            digits[count++] = '0' + (byte)fmod( whole, 10 );
+            whole = floor( whole / 10 );
+        } while( whole >= 1 && count < FORMAT_DIGITS );
+    }
+
+    return place( out, end, signOf( negative, flags ), digits, count, flags, width );
+}
+
+char *websocket_format_string(char *out, char *end, const char *str, bool progmem, byte flags, byte width, int precision)
+{
+    if( !str )
+    {
+        str = PSTR("(null)");
+        progmem = true;
+    }
+
+    // Bounded by the precision, so what's read needn't be terminated.
+    size_t limit = precision >= 0 ? (size_t)precision : (size_t)-1;
+    size_t length = progmem ? strnlen_P( str, limit ) : strnlen( str, limit );
+
+    byte pad = width > length ? width - length : 0;
+    if( (size_t)( end - out ) < length + pad )
+        return NULL;
+
+    if( !( flags & WEBSOCKET_FORMAT_LEFT ) )
+    {
+        memset( out, ' ', pad );
+        out += pad;
+    }
+    if( progmem )
+        memcpy_P( out, str, length );
+    else
+        memcpy( out, str, length );
+    out += length;
+    if( flags & WEBSOCKET_FORMAT_LEFT )
+    {
+        memset( out, ' ', pad );
+        out += pad;
+    }
+    return out;
+}
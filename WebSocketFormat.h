@@ -0,0 +1,273 @@
+#include "WebSocketPlatform.h"
+
+#ifndef H_WEBSOCKETFORMAT
+#define H_WEBSOCKETFORMAT
+
+// Formats parsed at compile time, for WebSocketWritable::print(). Each
+// conversion becomes a direct call to one of the emitters below, with its
+// flags, width and precision fixed, so nothing is parsed at run time and
+// vfprintf() isn't linked in on AVR.
+//
+// Supported: %d %i %u %x %X %o %c %s %f %F and %%, the flags '-' '0' '+'
+// and ' ', a width, and a precision for %f (up to 9) and %s. Length
+// modifiers (l, ll, h...) are accepted and ignored: each argument is
+// formatted as its own type. Anything else fails to compile.
+//
+// The format is given as WEBSOCKET_FORMAT("temp=%d"), which works from
+// C++11, or with C++20 as a template argument, print<"temp=%d">(...).
+
+// Widest integer printed. AVR stops at 32 bits to keep the division cheap.
+#if defined(__AVR__)
+typedef unsigned long websocket_format_uint;
+#else
+typedef unsigned long long websocket_format_uint;
+#endif
+
+#define WEBSOCKET_FORMAT_LEFT  0x01
+#define WEBSOCKET_FORMAT_ZERO  0x02
+#define WEBSOCKET_FORMAT_PLUS  0x04
+#define WEBSOCKET_FORMAT_SPACE 0x08
+#define WEBSOCKET_FORMAT_UPPER 0x10
+
+// Emitters: each writes one conversion at 'out', and returns the end of
+// what it wrote, or NULL if it doesn't fit before 'end'.
+char *websocket_format_integer(char *out, char *end, websocket_format_uint value, bool negative, byte base, byte flags, byte width);
+// Rounded from the exact value, ties to even, as printf() does. Integer
+// parts past 2^64 (2^32 on AVR) are right in their leading digits only.
+char *websocket_format_float(char *out, char *end, double value, byte flags, byte width, byte precision);
+// At most 'precision' characters, all if it's negative.
+char *websocket_format_string(char *out, char *end, const char *str, bool progmem, byte flags, byte width, int precision);
+
+typedef enum { WEBSOCKET_FORMAT_END, WEBSOCKET_FORMAT_LITERAL, WEBSOCKET_FORMAT_PERCENT, WEBSOCKET_FORMAT_CONVERSION } WebSocketFormatKind;
+
+// A format, as a type: its characters, and the parsing done on them by the
+// compiler. The text itself is kept in program memory, for copying out the
+// literal parts.
+template<char... C>
+struct WebSocketFormat {
+    static constexpr char chars[sizeof...(C) + 1] = { C..., '\0' };
+    static const char text[sizeof...(C) + 1];
+
+    static constexpr char at(size_t i) { return i < sizeof...(C) ? chars[i] : '\0'; }
+
+    static constexpr byte kind(size_t i)
+    {
+        return at(i) == '\0' ? WEBSOCKET_FORMAT_END :
+               at(i) != '%' ? WEBSOCKET_FORMAT_LITERAL :
+               at(i + 1) == '%' ? WEBSOCKET_FORMAT_PERCENT : WEBSOCKET_FORMAT_CONVERSION;
+    }
+
+    static constexpr size_t literalEnd(size_t i) { return at(i) == '\0' || at(i) == '%' ? i : literalEnd(i + 1); }
+
+    static constexpr bool isFlag(char c) { return c == '-' || c == '0' || c == '+' || c == ' '; }
+    static constexpr byte flag(char c)
+    {
+        return c == '-' ? WEBSOCKET_FORMAT_LEFT : c == '0' ? WEBSOCKET_FORMAT_ZERO :
+               c == '+' ? WEBSOCKET_FORMAT_PLUS : WEBSOCKET_FORMAT_SPACE;
+    }
+    static constexpr byte flags(size_t i) { return isFlag(at(i)) ? flag(at(i)) | flags(i + 1) : 0; }
+    static constexpr size_t flagsEnd(size_t i) { return isFlag(at(i)) ? flagsEnd(i + 1) : i; }
+
+    static constexpr bool isDigit(char c) { return c >= '0' && c <= '9'; }
+    static constexpr unsigned long number(size_t i, unsigned long n) { return isDigit(at(i)) ? number(i + 1, n * 10 + at(i) - '0') : n; }
+    static constexpr size_t numberEnd(size_t i) { return isDigit(at(i)) ? numberEnd(i + 1) : i; }
+
+    static constexpr bool isLength(char c) { return c == 'h' || c == 'l' || c == 'L' || c == 'q' || c == 'j' || c == 'z' || c == 't'; }
+    static constexpr size_t lengthEnd(size_t i) { return isLength(at(i)) ? lengthEnd(i + 1) : i; }
+};
+
+template<char... C> constexpr char WebSocketFormat<C...>::chars[sizeof...(C) + 1];
+template<char... C> const char WebSocketFormat<C...>::text[sizeof...(C) + 1] PROGMEM = { C..., '\0' };
+
+// The conversion starting with the '%' at I.
+template<typename F, size_t I>
+struct WebSocketFormatSpec {
+    enum {
+        WIDTH_AT = F::flagsEnd(I + 1),
+        DOT_AT = F::numberEnd(WIDTH_AT),
+        PRECISION_AT = F::at(DOT_AT) == '.' ? DOT_AT + 1 : DOT_AT,
+        CONVERSION_AT = F::lengthEnd(F::numberEnd(PRECISION_AT)),
+
+        FLAGS = F::flags(I + 1),
+        WIDTH = F::number(WIDTH_AT, 0),
+        PRECISION = F::at(DOT_AT) == '.' ? (long)F::number(PRECISION_AT, 0) : -1,
+        CONVERSION = F::at(CONVERSION_AT),
+        NEXT = CONVERSION_AT + 1
+    };
+
+    static_assert( CONVERSION == 'd' || CONVERSION == 'i' || CONVERSION == 'u' || CONVERSION == 'x' || CONVERSION == 'X' ||
+                   CONVERSION == 'o' || CONVERSION == 'c' || CONVERSION == 's' || CONVERSION == 'f' || CONVERSION == 'F',
+                   "print(): unsupported conversion in the format" );
+    static_assert( WIDTH < 256 && PRECISION < 256, "print(): width or precision too large" );
+};
+
+// One argument, by its type, for conversion Conv.
+template<char Conv, byte Flags, byte Width, int Precision>
+struct WebSocketFormatArgument {
+    enum {
+        SIGNED = Conv == 'd' || Conv == 'i',
+        BASE = Conv == 'x' || Conv == 'X' ? 16 : Conv == 'o' ? 8 : 10,
+        // '+' and ' ' only apply to signed conversions.
+        UNSIGNED_FLAGS = ( Flags & ~( WEBSOCKET_FORMAT_PLUS | WEBSOCKET_FORMAT_SPACE ) ) | ( Conv == 'X' ? WEBSOCKET_FORMAT_UPPER : 0 )
+    };
+
+    static char *emit(char *out, char *end, int value) { return signedInteger<unsigned>( out, end, value ); }
+    static char *emit(char *out, char *end, unsigned value) { return unsignedInteger( out, end, value ); }
+    static char *emit(char *out, char *end, long value) { return signedInteger<unsigned long>( out, end, value ); }
+    static char *emit(char *out, char *end, unsigned long value) { return unsignedInteger( out, end, value ); }
+#if !defined(__AVR__)
+    static char *emit(char *out, char *end, long long value) { return signedInteger<unsigned long long>( out, end, value ); }
+    static char *emit(char *out, char *end, unsigned long long value) { return unsignedInteger( out, end, value ); }
+#endif
+
+    static char *emit(char *out, char *end, double value)
+    {
+        static_assert( Conv == 'f' || Conv == 'F', "print(): floating point takes %f" );
+        static_assert( Precision <= 9, "print(): %f goes to 9 decimal places" );
+        return websocket_format_float( out, end, value, Conv == 'F' ? Flags | WEBSOCKET_FORMAT_UPPER : Flags, Width, Precision < 0 ? 6 : Precision );
+    }
+
+    static char *emit(char *out, char *end, const char *value)
+    {
+        static_assert( Conv == 's', "print(): strings take %s" );
+        return websocket_format_string( out, end, value, false, Flags, Width, Precision );
+    }
+
+    static char *emit(char *out, char *end, const __FlashStringHelper *value)
+    {
+        static_assert( Conv == 's', "print(): strings take %s" );
+        return websocket_format_string( out, end, (const char *)value, true, Flags, Width, Precision );
+    }
+
+private:
+    // Signed types printed as themselves for %d, and as their unsigned
+    // counterpart U otherwise, as printf() would.
+    template<typename U, typename T>
+    static char *signedInteger(char *out, char *end, T value)
+    {
+        if( !SIGNED )
+            return unsignedInteger( out, end, (U)value );
+        if( value < 0 )
+            return websocket_format_integer( out, end, -(websocket_format_uint)value, true, 10, Flags, Width );
+        return websocket_format_integer( out, end, value, false, 10, Flags, Width );
+    }
+
+    template<typename U>
+    static char *unsignedInteger(char *out, char *end, U value)
+    {
+        static_assert( Conv != 's' && Conv != 'f' && Conv != 'F', "print(): integers take %d, %i, %u, %x, %X, %o or %c" );
+        static_assert( Precision < 0, "print(): no precision for integers" );
+        if( Conv == 'c' )
+        {
+            char c = value;
+            return websocket_format_string( out, end, &c, false, Flags, Width, 1 );
+        }
+        return websocket_format_integer( out, end, value, false, BASE, SIGNED ? Flags : (byte)UNSIGNED_FLAGS, Width );
+    }
+};
+
+// The format from I on, as a chain of emitters.
+template<typename F, size_t I, byte Kind = F::kind(I)>
+struct WebSocketFormatStep;
+
+template<typename F, size_t I>
+struct WebSocketFormatStep<F, I, WEBSOCKET_FORMAT_END> {
+    enum { ARGUMENTS = 0 };
+
+    static char *emit(char *out, char *) { return out; }
+};
+
+template<typename F, size_t I>
+struct WebSocketFormatStep<F, I, WEBSOCKET_FORMAT_LITERAL> {
+    enum { LENGTH = F::literalEnd(I) - I };
+    typedef WebSocketFormatStep<F, I + LENGTH> Next;
+    enum { ARGUMENTS = Next::ARGUMENTS };
+
+    template<typename... Args>
+    static char *emit(char *out, char *end, const Args &... args)
+    {
+        if( end - out < LENGTH )
+            return NULL;
+        memcpy_P( out, F::text + I, LENGTH );
+        return Next::emit( out + LENGTH, end, args... );
+    }
+};
+
+template<typename F, size_t I>
+struct WebSocketFormatStep<F, I, WEBSOCKET_FORMAT_PERCENT> {
+    typedef WebSocketFormatStep<F, I + 2> Next;
+    enum { ARGUMENTS = Next::ARGUMENTS };
+
+    template<typename... Args>
+    static char *emit(char *out, char *end, const Args &... args)
+    {
+        if( out == end )
+            return NULL;
+        *out = '%';
+        return Next::emit( out + 1, end, args... );
+    }
+};
+
+template<typename F, size_t I>
+struct WebSocketFormatStep<F, I, WEBSOCKET_FORMAT_CONVERSION> {
+    typedef WebSocketFormatSpec<F, I> Spec;
+    typedef WebSocketFormatArgument<Spec::CONVERSION, Spec::FLAGS, Spec::WIDTH, Spec::PRECISION> Argument;
+    typedef WebSocketFormatStep<F, Spec::NEXT> Next;
+    enum { ARGUMENTS = Next::ARGUMENTS + 1 };
+
+    template<typename T, typename... Args>
+    static char *emit(char *out, char *end, const T &value, const Args &... args)
+    {
+        out = Argument::emit( out, end, value );
+        if( !out )
+            return NULL;
+        return Next::emit( out, end, args... );
+    }
+};
+
+// WEBSOCKET_FORMAT("..."): a format of up to 64 characters, made into a
+// WebSocketFormat by taking the literal apart a character at a time.
+template<typename Kept, size_t N, char... Rest>
+struct WebSocketFormatTrim {
+    static_assert( N == 0, "WEBSOCKET_FORMAT() takes up to 64 characters" );
+    typedef Kept type;
+};
+
+template<char... K, size_t N, char H, char... Rest>
+struct WebSocketFormatTrim<WebSocketFormat<K...>, N, H, Rest...> : WebSocketFormatTrim<WebSocketFormat<K..., H>, N - 1, Rest...> {};
+
+template<char... K, char H, char... Rest>
+struct WebSocketFormatTrim<WebSocketFormat<K...>, 0, H, Rest...> {
+    typedef WebSocketFormat<K...> type;
+};
+
+#define WEBSOCKET_FORMAT_CHAR(s, i) ( (i) < sizeof(s) ? (s)[(i) < sizeof(s) ? (i) : 0] : '\0' )
+#define WEBSOCKET_FORMAT_4(s, i) WEBSOCKET_FORMAT_CHAR(s, i), WEBSOCKET_FORMAT_CHAR(s, i + 1), WEBSOCKET_FORMAT_CHAR(s, i + 2), WEBSOCKET_FORMAT_CHAR(s, i + 3)
+#define WEBSOCKET_FORMAT_16(s, i) WEBSOCKET_FORMAT_4(s, i), WEBSOCKET_FORMAT_4(s, i + 4), WEBSOCKET_FORMAT_4(s, i + 8), WEBSOCKET_FORMAT_4(s, i + 12)
+#define WEBSOCKET_FORMAT_64(s, i) WEBSOCKET_FORMAT_16(s, i), WEBSOCKET_FORMAT_16(s, i + 16), WEBSOCKET_FORMAT_16(s, i + 32), WEBSOCKET_FORMAT_16(s, i + 48)
+#define WEBSOCKET_FORMAT(s) WebSocketFormatTrim<WebSocketFormat<>, sizeof(s) - 1, WEBSOCKET_FORMAT_64(s, 0)>::type()
+
+// C++20: the format as a template argument, print<"temp=%d">(t).
+#if defined(__cpp_nontype_template_args) && __cpp_nontype_template_args >= 201911L
+#define WEBSOCKET_FORMAT_LITERALS 1
+
+template<size_t N>
+struct WebSocketFixedString {
+    constexpr WebSocketFixedString(const char (&str)[N]) { for( size_t x = 0; x < N; x++ ) text[x] = str[x]; }
+    char text[N];
+};
+
+template<size_t... I> struct WebSocketFormatIndices {};
+template<size_t N, size_t... I> struct WebSocketFormatCount : WebSocketFormatCount<N - 1, N - 1, I...> {};
+template<size_t... I> struct WebSocketFormatCount<0, I...> { typedef WebSocketFormatIndices<I...> type; };
+
+template<WebSocketFixedString S, typename = typename WebSocketFormatCount<sizeof(S.text) - 1>::type>
+struct WebSocketFormatOf;
+
+template<WebSocketFixedString S, size_t... I>
+struct WebSocketFormatOf<S, WebSocketFormatIndices<I...> > {
+    typedef WebSocketFormat<S.text[I]...> type;
+};
+#endif
+
+#endif
@@ -0,0 +1,276 @@
+#include "WebSocketHandshake.h"
+
+typedef enum { START_LINE=0, LINE_START, NAME, VALUE, DONE } State;
+
+// Headers we look for, lower case.
+enum { UPGRADE=0, CONNECTION, HOST, VERSION, KEY, ACCEPT, EXTENSIONS, HEADER_COUNT, NO_HEADER=0xFF };
+
+static const char names[HEADER_COUNT][25] PROGMEM = {
+    "upgrade",
+    "connection",
+    "host",
+    "sec-websocket-version",
+    "sec-websocket-key",
+    "sec-websocket-accept",
+    "sec-websocket-extensions"
+};
+
+// Token that must appear in the comma separated value, if any.
+static const char tokens[HEADER_COUNT][10] PROGMEM = {
+    "websocket",
+    "upgrade",
+    "",
+    "13",
+    "",
+    ""
+};
+
+static const byte flags[HEADER_COUNT] = {
+    WebSocketHandshake::HAS_UPGRADE,
+    WebSocketHandshake::HAS_CONNECTION,
+    WebSocketHandshake::HAS_HOST,
+    WebSocketHandshake::HAS_VERSION,
+    WebSocketHandshake::HAS_KEY,
+    WebSocketHandshake::HAS_KEY,
+    WebSocketHandshake::HAS_EXTENSIONS
+};
+
+static const char requestLine[] PROGMEM = "GET ";
+static const char statusLine[] PROGMEM = "HTTP/1.1 101";
+
+static char lower(char c)
+{
+    return ( c >= 'A' && c <= 'Z' ) ? c + ( 'a' - 'A' ) : c;
+}
+
+void WebSocketHandshake::reset(Kind kind, const char *pathPrefix)
+{
+    m_pathPrefix = pathPrefix && *pathPrefix ? pathPrefix : NULL;
+    m_kind = kind;
+    m_state = START_LINE;
+    m_header = NO_HEADER;
+    m_candidates = 0;
+    m_match = 0;
+    m_found = 0;
+    m_keyLength = 0;
+    m_lineLength = 0;
+    m_total = 0;
+    m_key[0] = '\0';
+#if WEBSOCKET_DEFLATE
+    m_extensionsLength = m_extensionsMark = 0;
+    m_extensionsFull = false;
+    m_extensions[0] = '\0';
+#endif
+}
+
+#if WEBSOCKET_DEFLATE
+void WebSocketHandshake::appendExtension(char c)
+{
+    if( m_extensionsFull )
+        return;
+
+    // Keep whole extensions only: past the end of the buffer, drop back to
+    // the last one that fit and ignore the rest.
+    if( m_extensionsLength >= sizeof(m_extensions) - 1 )
+    {
+        m_extensionsLength = m_extensionsMark;
+        m_extensions[m_extensionsLength] = '\0';
+        m_extensionsFull = true;
+        return;
+    }
+
+    if( c == ',' )
+        m_extensionsMark = m_extensionsLength;
+    m_extensions[m_extensionsLength++] = c;
+    m_extensions[m_extensionsLength] = '\0';
+}
+#endif
+
+bool WebSocketHandshake::matchPath(char c, word index)
+{
+    if( !m_pathPrefix || ( m_found & HAS_PATH ) )
+        return true; // Anything goes from here on.
+
+    if( c != m_pathPrefix[index] )
+        return false;
+    if( !m_pathPrefix[index + 1] )
+        m_found |= HAS_PATH;
+    return true;
+}
+
+bool WebSocketHandshake::endToken()
+{
+    // Whole token matched, and nothing more to it?
+    bool matched = m_match != 0xFF && m_match && !pgm_read_byte( &tokens[m_header][m_match] );
+    m_match = 0;
+    return matched;
+}
+
+WebSocketHandshake::Result WebSocketHandshake::parse(const uint8_t *data, word length, word &used)
+{
+    if( m_state == DONE )
+    {
+        used = 0;
+        return COMPLETE;
+    }
+
+    for( used = 0; used < length; )
+    {
+        char c = data[used++];
+
+        if( ++m_total > WEBSOCKET_MAX_HANDSHAKE )
+            return FAILED;
+
+        if( c == '\r' ) // Ignored, lines may end with a bare LF.
+            continue;
+
+        if( c == '\n' )
+        {
+            switch( m_state )
+            {
+                case START_LINE:
+                    if( !m_lineLength )
+                        continue; // Stray blank lines ahead of the request are allowed.
+                    if( m_match == 0xFF || m_match < strlen_P( m_kind == REQUEST ? requestLine : statusLine ) )
+                        return FAILED;
+                    m_found |= HAS_START_LINE;
+                    if( m_kind == REQUEST && !m_pathPrefix )
+                        m_found |= HAS_PATH;
+                    break;
+
+                case LINE_START:
+                    // A blank line ends the headers; anything after it is frames.
+                    m_state = DONE;
+                    return COMPLETE;
+
+                case VALUE:
+                    if( m_header == KEY || m_header == ACCEPT )
+                    {
+                        if( m_keyLength )
+                            m_found |= HAS_KEY;
+                    }
+                    else if( m_header != NO_HEADER && pgm_read_byte( &tokens[m_header][0] ) && endToken() )
+                        m_found |= flags[m_header];
+                    break;
+            }
+
+            m_state = LINE_START;
+            m_lineLength = 0;
+            continue;
+        }
+
+        if( ++m_lineLength > WEBSOCKET_MAX_HEADER_LINE )
+            return FAILED;
+
+        switch( m_state )
+        {
+            case START_LINE:
+            {
+                PGM_P prefix = m_kind == REQUEST ? requestLine : statusLine;
+                byte prefixLength = strlen_P( prefix );
+                if( m_match < prefixLength )
+                    m_match = ( c == (char)pgm_read_byte( prefix + m_match ) ) ? m_match + 1 : 0xFF;
+                else if( m_match == prefixLength && m_kind == RESPONSE )
+                    m_match = c == ' ' ? m_match + 1 : 0xFF; // The status is 101, not 1010.
+                else if( m_match == prefixLength )
+                {
+                    // The resource, up to the space before the version, or
+                    // until it strays from the path prefix.
+                    if( c == ' ' || !matchPath( c, m_lineLength - prefixLength - 1 ) )
+                        m_match++;
+                }
+                break;
+            }
+
+            case LINE_START:
+                m_state = NAME;
+                m_candidates = ( 1 << HEADER_COUNT ) - 1;
+                m_match = 0;
+                // Fall through - this is the name's first character.
+
+            case NAME:
+                if( c == ':' )
+                {
+                    m_header = NO_HEADER;
+                    for( byte x=0; x < HEADER_COUNT; x++ )
+                    {
+                        if( ( m_candidates & ( 1 << x ) ) && !pgm_read_byte( &names[x][m_match] ) )
+                            m_header = x;
+                    }
+
+                    // The key comes in the request, the accept value in the response.
+                    if( ( m_header == KEY && m_kind != REQUEST ) || ( m_header == ACCEPT && m_kind != RESPONSE ) )
+                        m_header = NO_HEADER;
+
+                    if( m_header == HOST || m_header == EXTENSIONS )
+                        m_found |= flags[m_header];
+#if WEBSOCKET_DEFLATE
+                    // Repeated headers make one list.
+                    if( m_header == EXTENSIONS && m_extensionsLength )
+                        appendExtension( ',' );
+#endif
+                    if( m_header == KEY || m_header == ACCEPT )
+                        m_keyLength = 0;
+
+                    m_state = VALUE;
+                    m_match = 0;
+                    break;
+                }
+
+                if( m_match >= sizeof(names[0]) - 1 )
+                {
+                    m_candidates = 0; // Longer than any we know.
+                    break;
+                }
+
+                c = lower( c );
+                for( byte x=0; x < HEADER_COUNT; x++ )
+                {
+                    if( ( m_candidates & ( 1 << x ) ) && c != (char)pgm_read_byte( &names[x][m_match] ) )
+                        m_candidates &= ~( 1 << x );
+                }
+                m_match++;
+                break;
+
+            case VALUE:
+                if( m_header == NO_HEADER )
+                    break;
+
+                if( m_header == KEY || m_header == ACCEPT )
+                {
+                    // Base64, so any whitespace is padding around it.
+                    if( c == ' ' || c == '\t' )
+                        break;
+                    if( m_keyLength >= sizeof(m_key) - 1 )
+                        return FAILED;
+                    m_key[m_keyLength++] = c;
+                    m_key[m_keyLength] = '\0';
+                    break;
+                }
+
+#if WEBSOCKET_DEFLATE
+                if( m_header == EXTENSIONS )
+                {
+                    appendExtension( c );
+                    break;
+                }
+#endif
+
+                if( !pgm_read_byte( &tokens[m_header][0] ) )
+                    break;
+
+                if( c == ',' || c == ' ' || c == '\t' )
+                {
+                    if( endToken() )
+                        m_found |= flags[m_header];
+                }
+                else if( m_match != 0xFF )
+                {
+                    char t = pgm_read_byte( &tokens[m_header][m_match] );
+                    m_match = ( t && lower( c ) == t ) ? m_match + 1 : 0xFF;
+                }
+                break;
+        }
+    }
+    return INCOMPLETE;
+}
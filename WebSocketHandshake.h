@@ -0,0 +1,96 @@
+#include "WebSocketPlatform.h"
+#include "WebSocketDeflate.h"
+
+#ifndef H_WEBSOCKETHANDSHAKE
+#define H_WEBSOCKETHANDSHAKE
+
+// Longest header block accepted, and longest single line in it.
+#ifndef WEBSOCKET_MAX_HANDSHAKE
+#define WEBSOCKET_MAX_HANDSHAKE 8192
+#endif
+#ifndef WEBSOCKET_MAX_HEADER_LINE
+#define WEBSOCKET_MAX_HEADER_LINE 4096
+#endif
+
+// Room for a Sec-WebSocket-Key (24 characters) or -Accept (28) and a terminator.
+#define WEBSOCKET_HANDSHAKE_KEY 32
+
+// Room for Sec-WebSocket-Extensions, where permessage-deflate is built in.
+#ifndef WEBSOCKET_HANDSHAKE_EXTENSIONS
+#define WEBSOCKET_HANDSHAKE_EXTENSIONS 256
+#endif
+
+// Incremental parser for the HTTP side of the opening handshake: the
+// client's upgrade request, or the server's response. Bytes are fed as they
+// arrive, each looked at once, and only what the handshake needs is kept,
+// so a request split across packets costs nothing extra. Header names are
+// matched without regard to case.
+class WebSocketHandshake {
+public:
+    typedef enum { REQUEST=0, RESPONSE } Kind;
+    typedef enum { INCOMPLETE=0, COMPLETE, FAILED } Result;
+
+    // What was found, see found().
+    enum {
+        HAS_START_LINE = 0x01, // "GET ..." request, or "HTTP/1.1 101" response
+        HAS_UPGRADE = 0x02, // Upgrade: websocket
+        HAS_CONNECTION = 0x04, // Connection: Upgrade
+        HAS_HOST = 0x08, // Host:
+        HAS_VERSION = 0x10, // Sec-WebSocket-Version: 13
+        HAS_KEY = 0x20, // Sec-WebSocket-Key (request) or Sec-WebSocket-Accept (response)
+        HAS_EXTENSIONS = 0x40, // Sec-WebSocket-Extensions
+        HAS_PATH = 0x80 // Request for a resource under the path prefix
+    };
+
+    WebSocketHandshake() { reset( REQUEST ); }
+
+    // Start over, expecting a request or a response. A request is for a
+    // resource under 'pathPrefix' if it starts with it; NULL takes any.
+    void reset(Kind kind, const char *pathPrefix = NULL);
+
+    // Parse up to 'length' bytes, stopping after the blank line that ends
+    // the headers; 'used' is set to the count consumed. FAILED if the
+    // headers are malformed or too large.
+    Result parse(const uint8_t *data, word length, word &used);
+
+    byte found() { return m_found; }
+    bool has(byte flags) { return ( m_found & flags ) == flags; }
+
+    // Value of Sec-WebSocket-Key or Sec-WebSocket-Accept.
+    char *key() { return m_key; }
+
+#if WEBSOCKET_DEFLATE
+    // Sec-WebSocket-Extensions, repeated headers joined by commas. Offers
+    // that don't fit are left out.
+    const char *extensions() { return m_extensions; }
+#endif
+
+private:
+    const char *m_pathPrefix;
+    byte m_kind;
+    byte m_state;
+    byte m_header; // Header whose value is being read.
+    byte m_candidates; // Known header names still matching the one being read.
+    byte m_match; // Characters of the name or token matched so far.
+    byte m_found;
+    byte m_keyLength;
+    word m_lineLength;
+    word m_total;
+    char m_key[WEBSOCKET_HANDSHAKE_KEY];
+#if WEBSOCKET_DEFLATE
+    word m_extensionsLength;
+    word m_extensionsMark; // End of the last extension that fit.
+    bool m_extensionsFull;
+    char m_extensions[WEBSOCKET_HANDSHAKE_EXTENSIONS];
+
+    void appendExtension(char c);
+#endif
+
+    bool endToken();
+
+    // Compare a character of the request's resource with the prefix;
+    // false if it differs.
+    bool matchPath(char c, word index);
+};
+
+#endif
@@ -0,0 +1,149 @@
+#include "WebSocketMask.h"
+
+#if defined(__GLIBC__)
+#include <unistd.h>
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define WEBSOCKET_MASK_X86 1
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define WEBSOCKET_MASK_NEON 1
+#endif
+
+#if defined(__AVR__)
+
+void websocket_mask(uint8_t *data, size_t length, const uint8_t mask[4], size_t offset)
+{
+    // 8-bit core: wider words don't help, just avoid the per-byte modulo.
+    uint8_t m[4];
+    for( byte i = 0; i < 4; i++ )
+        m[i] = mask[(offset + i) & 3];
+
+    while( length >= 4 )
+    {
+        data[0] ^= m[0];
+        data[1] ^= m[1];
+        data[2] ^= m[2];
+        data[3] ^= m[3];
+        data += 4;
+        length -= 4;
+    }
+    for( byte i = 0; i < length; i++ )
+        data[i] ^= m[i];
+}
+
+#else
+
+static inline uint32_t maskWord(const uint8_t *m)
+{
+    uint32_t w;
+    memcpy( &w, m, 4 );
+    return w;
+}
+
+#if defined(WEBSOCKET_MASK_X86) && defined(__GNUC__) && !defined(__AVX2__)
+// Built for baseline x86, pick up AVX2 at runtime when the CPU has it.
+#define WEBSOCKET_MASK_AVX2_DISPATCH 1
+
+__attribute__((target("avx2")))
+static size_t maskAvx2(uint8_t *data, size_t length, const uint8_t *m)
+{
+    __m256i key = _mm256_set1_epi32( maskWord( m ) );
+    size_t done = 0;
+    for( ; done + 32 <= length; done += 32 )
+    {
+        __m256i v = _mm256_loadu_si256( (const __m256i *)(data + done) );
+        _mm256_storeu_si256( (__m256i *)(data + done), _mm256_xor_si256( v, key ) );
+    }
+    return done;
+}
+
+static bool haveAvx2()
+{
+    static int supported = -1;
+    if( supported < 0 )
+        supported = __builtin_cpu_supports( "avx2" ) ? 1 : 0;
+    return supported;
+}
+#endif
+
+void websocket_mask(uint8_t *data, size_t length, const uint8_t mask[4], size_t offset)
+{
+    // Mask rotated to start at 'offset', repeated to fill a 64-bit word.
+    uint8_t m[8];
+    for( byte i = 0; i < 8; i++ )
+        m[i] = mask[(offset + i) & 3];
+
+    size_t done = 0;
+
+    // Short payloads aren't worth setting up for.
+    if( length >= 16 )
+    {
+#if defined(WEBSOCKET_MASK_AVX2_DISPATCH)
+        if( haveAvx2() )
+            done = maskAvx2( data, length, m );
+#elif defined(WEBSOCKET_MASK_X86) && defined(__AVX2__)
+        __m256i key32 = _mm256_set1_epi32( maskWord( m ) );
+        for( ; done + 32 <= length; done += 32 )
+        {
+            __m256i v = _mm256_loadu_si256( (const __m256i *)(data + done) );
+            _mm256_storeu_si256( (__m256i *)(data + done), _mm256_xor_si256( v, key32 ) );
+        }
+#endif
+
+#if defined(WEBSOCKET_MASK_X86)
+        // SSE2 is part of the x86-64 baseline.
+        __m128i key = _mm_set1_epi32( maskWord( m ) );
+        for( ; done + 16 <= length; done += 16 )
+        {
+            __m128i v = _mm_loadu_si128( (const __m128i *)(data + done) );
+            _mm_storeu_si128( (__m128i *)(data + done), _mm_xor_si128( v, key ) );
+        }
+#elif defined(WEBSOCKET_MASK_NEON)
+        uint8x16_t key = vreinterpretq_u8_u32( vdupq_n_u32( maskWord( m ) ) );
+        for( ; done + 16 <= length; done += 16 )
+            vst1q_u8( data + done, veorq_u8( vld1q_u8( data + done ), key ) );
+#endif
+    }
+
+    // Word at a time. Every block so far was a multiple of 4 bytes long, so
+    // the mask phase is unchanged.
+    uint64_t key64;
+    memcpy( &key64, m, 8 );
+    for( ; done + 8 <= length; done += 8 )
+    {
+        uint64_t v;
+        memcpy( &v, data + done, 8 );
+        v ^= key64;
+        memcpy( data + done, &v, 8 );
+    }
+
+    for( ; done < length; done++ )
+        data[done] ^= m[done & 3];
+}
+
+#endif
+
+uint32_t websocket_mask_seed()
+{
+    static uint32_t calls;
+    uint32_t seed = 0;
+#if defined(__GLIBC__)
+    if( getentropy( &seed, sizeof(seed) ) != 0 )
+        seed = 0;
+#elif defined(ESP32)
+    seed = esp_random();
+#endif
+
+    // Stirred (MurmurHash3's finaliser) so nearby clock readings don't
+    // give nearby seeds.
+    uint32_t x = seed ^ micros() ^ ( (uint32_t)millis() << 16 ) ^ ( ++calls * 0x9e3779b9UL );
+    x ^= x >> 16;
+    x *= 0x85ebca6bUL;
+    x ^= x >> 13;
+    x *= 0xc2b2ae35UL;
+    x ^= x >> 16;
+    return x ? x : 0x6d2b79f5UL;
+}
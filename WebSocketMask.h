@@ -0,0 +1,32 @@
+#include "WebSocketPlatform.h"
+
+#ifndef H_WEBSOCKETMASK
+#define H_WEBSOCKETMASK
+
+// XOR 'length' bytes at 'data' in place with the 4-byte frame mask, starting
+// 'offset' bytes into the mask cycle (the count of payload bytes already
+// processed, for payloads handled in pieces). Masking and unmasking are the
+// same operation.
+//
+// Works a machine word at a time, with SSE2/AVX2 or NEON on hosts that have
+// them. AVR gets a plain byte loop.
+void websocket_mask(uint8_t *data, size_t length, const uint8_t mask[4], size_t offset = 0);
+
+// Masking keys for frames a client sends: xorshift32, a few shifts per key
+// and four bytes of state per connection. Not cryptographic; masking only
+// has to keep the bytes on the wire from being chosen by the sender.
+// 'state' must not be 0.
+static inline uint32_t websocket_mask_next(uint32_t &state)
+{
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return state;
+}
+
+// A seed for websocket_mask_next(), never 0: from the kernel on glibc
+// hosts, the hardware generator on ESP32, and mixed with the clock and a
+// count of calls everywhere, so no two are alike.
+uint32_t websocket_mask_seed();
+
+#endif
@@ -0,0 +1,69 @@
+#include "WebSocketPlatform.h"
+
+#ifdef WEBSOCKET_HOST
+
+#include <time.h>
+#include <unistd.h>
+
+HostSerial Serial;
+
+static unsigned long long monotonicMicros()
+{
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return (unsigned long long)ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+// Truncated to unsigned long like the Arduino core, so callers still have to
+// handle wraparound.
+unsigned long millis()
+{
+    return (unsigned long)( monotonicMicros() / 1000 );
+}
+
+unsigned long micros()
+{
+    return (unsigned long)monotonicMicros();
+}
+
+void delay(unsigned long ms)
+{
+    usleep( ms * 1000 );
+}
+
+void delayMicroseconds(unsigned int us)
+{
+    usleep( us );
+}
+
+size_t Print::write(const uint8_t *buffer, size_t size)
+{
+    size_t n = 0;
+    while( size-- )
+        n += write( *buffer++ );
+    return n;
+}
+
+size_t Print::print(long n)
+{
+    char buf[24];
+    return write( (const uint8_t *)buf, snprintf( buf, sizeof(buf), "%ld", n ) );
+}
+
+size_t Print::print(unsigned long n)
+{
+    char buf[24];
+    return write( (const uint8_t *)buf, snprintf( buf, sizeof(buf), "%lu", n ) );
+}
+
+size_t HostSerial::write(uint8_t c)
+{
+    return fwrite( &c, 1, 1, stderr );
+}
+
+size_t HostSerial::write(const uint8_t *buffer, size_t size)
+{
+    return fwrite( buffer, 1, size, stderr );
+}
+
+#endif
@@ -0,0 +1,83 @@
+#ifndef H_WEBSOCKETPLATFORM
+#define H_WEBSOCKETPLATFORM
+
+#if defined(ARDUINO)
+
+#include <Arduino.h> // Arduino 1.0 or greater is required
+
+#else
+
+// Host build (Linux gateways, off-device testing). Provides just enough of
+// the Arduino core for the library to compile unchanged.
+#define WEBSOCKET_HOST 1
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <strings.h>
+#include <arpa/inet.h>
+
+typedef uint8_t byte;
+typedef uint16_t word;
+typedef bool boolean;
+
+// Flash strings are ordinary strings on the host.
+class __FlashStringHelper;
+#define F(s) ((const __FlashStringHelper *)(s))
+#define PROGMEM
+#define PSTR(s) (s)
+#define PGM_P const char *
+#define pgm_read_byte(p) (*(const uint8_t *)(p))
+#define pgm_read_word(p) (*(const uint16_t *)(p))
+#define pgm_read_dword(p) (*(const uint32_t *)(p))
+#define memcpy_P memcpy
+#define strlen_P strlen
+#define strnlen_P strnlen
+#define strstr_P strstr
+#define strcasecmp_P strcasecmp
+#define strncasecmp_P strncasecmp
+#define snprintf_P snprintf
+#define vsnprintf_P vsnprintf
+
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+
+// Minimal Print, enough for Sha1Class and DEBUG tracing.
+class Print {
+public:
+    virtual ~Print() {}
+    virtual size_t write(uint8_t) = 0;
+    virtual size_t write(const uint8_t *buffer, size_t size);
+    size_t write(const char *str) { return str ? write((const uint8_t *)str, strlen(str)) : 0; }
+
+    size_t print(const __FlashStringHelper *str) { return write((const char *)str); }
+    size_t print(const char *str) { return write(str); }
+    size_t print(char c) { return write((uint8_t)c); }
+    size_t print(long n);
+    size_t print(unsigned long n);
+    size_t print(int n) { return print((long)n); }
+    size_t print(unsigned int n) { return print((unsigned long)n); }
+    size_t print(unsigned char n) { return print((unsigned long)n); }
+
+    size_t println() { return write("\r\n"); }
+    template<typename T> size_t println(T value) { size_t n = print(value); return n + println(); }
+};
+
+// DEBUG output goes to stderr.
+class HostSerial : public Print {
+public:
+    void begin(unsigned long) {}
+    size_t write(uint8_t c);
+    size_t write(const uint8_t *buffer, size_t size);
+    using Print::write;
+};
+extern HostSerial Serial;
+
+#endif
+
+#endif
@@ -6,237 +6,685 @@
 
 //#define DEBUG 1
 
-WebSocketServer::WebSocketServer(const char *urlPrefix, int inPort, byte maxConnections, word maxFrameSize) :
-    m_server(inPort),
+#if WEBSOCKET_DEFAULT_TRANSPORT
+WebSocketServer::WebSocketServer(const char *urlPrefix, int inPort, word maxConnections, word maxFrameSize) :
     m_server_urlPrefix(urlPrefix),
+    m_server(new DefaultServerTransport(inPort)),
+    m_ownsServer(true),
     m_maxConnections(maxConnections),
-    m_connectionCount(0)
+    m_pool(new WebSocketBufferPool(WEBSOCKET_SLAB_SIZE(maxFrameSize), maxConnections + 1)), // One spare for printf().
+    m_ownsPool(true),
+    m_connections(NULL),
+    m_socketStorage(NULL)
 {
-#ifdef DEBUG
-    Serial.print(F("1 Frame capacity: "));
-    Serial.println(frameCapacity);
+    setup();
+}
 #endif
 
-    WebSocket::initialise(maxFrameSize);
+WebSocketServer::WebSocketServer(WebSocketServerTransport &transport, const char *urlPrefix, word maxConnections, word maxFrameSize) :
+    m_server_urlPrefix(urlPrefix),
+    m_server(&transport),
+    m_ownsServer(false),
+    m_maxConnections(maxConnections),
+    m_pool(new WebSocketBufferPool(WEBSOCKET_SLAB_SIZE(maxFrameSize), maxConnections + 1)),
+    m_ownsPool(true),
+    m_connections(NULL),
+    m_socketStorage(NULL)
+{
+    setup();
+}
+
+WebSocketServer::WebSocketServer(WebSocketServerTransport &transport, WebSocketBufferPool &pool, const char *urlPrefix, word maxConnections) :
+    m_server_urlPrefix(urlPrefix),
+    m_server(&transport),
+    m_ownsServer(false),
+    m_maxConnections(maxConnections),
+    m_pool(&pool),
+    m_ownsPool(false),
+    m_connections(NULL),
+    m_socketStorage(NULL)
+{
+    setup();
+}
+
+WebSocketServer::WebSocketServer(WebSocketServerTransport &transport, WebSocketBufferPool &pool, const char *urlPrefix, word maxConnections,
+        InboundWebSocket **connections, uint8_t *socketStorage) :
+    m_server_urlPrefix(urlPrefix),
+    m_server(&transport),
+    m_ownsServer(false),
+    m_maxConnections(maxConnections),
+    m_pool(&pool),
+    m_ownsPool(false),
+    m_connections(connections),
+    m_socketStorage(socketStorage)
+{
+    setup();
+}
 
+void WebSocketServer::setup()
+{
 #ifdef DEBUG
-    Serial.print(F("2 Frame capacity: "));
-    Serial.println(frameCapacity);
+    Serial.print(F("Slab size: "));
+    Serial.println(m_pool->slabSize());
 #endif
 
-    m_connections = new InboundWebSocket*[ m_maxConnections ];
-    for( byte x=0; x < m_maxConnections; x++ )
+    m_connectionCount = 0;
+    m_freeSlot = 0;
+    m_starvedCount = 0;
+    m_reapPending = false;
+    m_broadcastFailures = 0;
+    m_ownsConnections = !m_connections;
+    if( m_ownsConnections )
+        m_connections = new InboundWebSocket*[ m_maxConnections ];
+    for( word x=0; x < m_maxConnections; x++ )
         m_connections[x] = NULL;
 
     onConnect = NULL;
     onDisconnect = NULL;
+#if WEBSOCKET_DEFLATE
+    m_deflateOptions = NULL;
+#endif
+#if WEBSOCKET_WORKERS
+    m_outbox = NULL;
+#endif
+#if WEBSOCKET_COROUTINES
+    m_accepted = NULL;
+    m_unclaimed = 0;
+    m_accepting = false;
+    m_closing = false;
+#endif
 }
 
 WebSocketServer::~WebSocketServer()
 {
-    for( byte x=0; x < m_maxConnections; x++ )
+    for( word x=0; x < m_maxConnections; x++ )
     {
         InboundWebSocket *s = m_connections[x];
         if( s )
         {
+            WebSocketTransport *transport = &s->socket();
             if( s->connected() )
                 s->close();
-            delete s;
+#if WEBSOCKET_COROUTINES
+            if( s->m_receiver )
+                s->m_receiver->close();
+#endif
+            destroy( s );
+            m_server->release( transport );
         }
     }
-    delete m_connections;
+    if( m_ownsConnections )
+        delete[] m_connections;
+
+#if WEBSOCKET_COROUTINES
+    // Let a coroutine in accept() finish.
+    m_closing = true;
+    m_unclaimed = 0;
+    if( m_acceptor )
+    {
+        std::coroutine_handle<> acceptor = m_acceptor;
+        m_acceptor = nullptr;
+        acceptor.resume();
+    }
+#endif
+
+#if WEBSOCKET_WORKERS
+    // Workers may still be answering; their replies go nowhere now.
+    if( m_outbox )
+    {
+        m_outbox->detach();
+        m_outbox->release();
+    }
+#endif
+
+    if( m_ownsPool )
+        delete m_pool;
+
+    if( m_ownsServer )
+        delete m_server;
 }
 
-byte WebSocketServer::send( char *data, word length )
+frame_length_t WebSocketServer::sendFrame( byte opcode, const WebSocketIovec *iov, byte count )
 {
-    if( 1 != m_server.write((uint8_t) 0x81) ) // Txt frame opcode
+    if( count >= WEBSOCKET_MAX_IOV )
         return 0;
-    if( length > 125 )
+
+    // Encode once, then fan out to the sockets that have finished their handshake.
+    uint8_t header[WEBSOCKET_MAX_HEADER];
+    WebSocketIovec pieces[WEBSOCKET_MAX_IOV];
+    frame_length_t length = 0;
+    for( byte x=0; x < count; x++ )
     {
-        if( 1 != m_server.write((uint8_t) 0x7E) ) // 16-bit length follows
-            return 0;
-        word lenNBO = htons(length);
-        if( 2 != m_server.write((const uint8_t *)&lenNBO, 2) ) // Length of data in a word, endian swapped.
-            return 0;
+        pieces[x + 1] = iov[x];
+        length += iov[x].length;
     }
-    else
+    pieces[0].data = header;
+    pieces[0].length = encodeHeader( header, 0x80 | opcode, length );
+    WEBSOCKET_COUNT( broadcasts, 1 );
+
+    frame_length_t sent = 0;
+    for( word x=0; x < m_maxConnections; x++ )
     {
-        if( 1 != m_server.write((uint8_t) length) ) // Length of dledata in a byte
-            return 0;
-    }
+        InboundWebSocket *s = m_connections[x];
+        if( !s || s->status() != WebSocket::CONNECTED )
+            continue;
 
-    return m_server.write( (const uint8_t *)data, length );
+        if( s->sendEncoded( pieces, count + 1, length ) )
+            sent = length;
+        else
+        {
+            m_broadcastFailures++;
+            if( !s->connected() )
+                m_reapPending = true; // Can't remove it here, we may be inside its callback.
+        }
+    }
+    return sent;
 }
 
-void WebSocketServer::listen() {
-    // First check existing connections:
-    for( byte x=0; x < m_maxConnections; x++ )
+bool WebSocketServer::sendFragment( byte opcode, const uint8_t *data, size_t length, bool final )
+{
+    if( opcode != OPCODE_CONTINUATION )
+        WEBSOCKET_COUNT( broadcasts, 1 );
+
+    bool sent = false;
+    for( word x=0; x < m_maxConnections; x++ )
     {
-        if( !m_connections[x] )
+        InboundWebSocket *s = m_connections[x];
+        if( !s || s->status() != WebSocket::CONNECTED )
             continue;
 
-        InboundWebSocket *s = m_connections[x];
-        if( !s->connected() )
+        if( s->sendFragment( opcode, data, length, final ) )
+            sent = true;
+        else
         {
-            if( onDisconnect )
-                onDisconnect(*s, m_disconnectOpaque);
+            // Once it has missed a piece it can't have the rest.
+            m_broadcastFailures++;
+            if( s->connected() )
+                s->close();
+            m_reapPending = true;
+        }
+    }
+    return sent;
+}
 
-            m_connectionCount--;
-            delete s;
-            m_connections[x] = NULL;
+#ifdef WEBSOCKET_FLASH_CHUNK
+frame_length_t WebSocketServer::sendFrame_P( byte opcode, const uint8_t *data, frame_length_t length )
+{
+    // Each client gets the whole frame before the next; reading flash again
+    // costs less than keeping track of where each one got to.
+    uint8_t header[WEBSOCKET_MAX_HEADER];
+    byte headerLength = encodeHeader( header, 0x80 | opcode, length );
+    WEBSOCKET_COUNT( broadcasts, 1 );
+
+    frame_length_t sent = 0;
+    for( word x=0; x < m_maxConnections; x++ )
+    {
+        InboundWebSocket *s = m_connections[x];
+        if( !s || s->status() != WebSocket::CONNECTED )
             continue;
-        }
 
-        s->listen();
+        if( s->sendEncoded_P( header, headerLength, data, length ) )
+            sent = length;
+        else
+        {
+            m_broadcastFailures++;
+            if( !s->connected() )
+                m_reapPending = true;
+        }
     }
+    return sent;
+}
+#endif
 
-    EthernetClient cli = m_server.available();
-    if( !cli )
-        return;
+void WebSocketServer::listen() {
+    // Slabs handed back since last time go to those waiting for them.
+    if( m_starvedCount && m_pool->available() )
+        feedStarved();
 
-    // Find a slot:
-    for( byte x=0; x < m_maxConnections; x++ )
+    // First check existing connections:
+    WebSocketTransport *ready[16];
+    int count = m_server->poll( ready, 16 );
+    if( count < 0 )
     {
-        if( m_connections[x] && m_connections[x]->socket() == cli )
-            return;
-
-        if( m_connections[x] )
-            continue;
-
-        InboundWebSocket *s = new InboundWebSocket(this, cli);
-        if( s->status() == WebSocket::DISCONNECTED )
+        // No readiness reports, check them all.
+        for( word x=0; x < m_maxConnections; x++ )
         {
-            delete s;
-            return;
+            if( m_connections[x] )
+                service( m_connections[x] );
         }
+    }
+    else
+    {
+        for( int x=0; x < count; x++ )
+            service( (InboundWebSocket *)ready[x]->context() );
+    }
 
-        m_connections[x] = s;
-        m_connectionCount++;
+#if WEBSOCKET_WORKERS
+    if( m_outbox && m_outbox->deliver() )
+        m_reapPending = true;
+#endif
+
+    if( m_reapPending )
+        reap();
+
+    expireTimers();
+
+    acceptConnections();
+}
+
+void WebSocketServer::reap()
+{
+    m_reapPending = false;
+    for( word x=0; x < m_maxConnections; x++ )
+    {
+        if( m_connections[x] && !m_connections[x]->connected() )
+            remove( m_connections[x] );
+    }
+}
+
+void WebSocketServer::scheduleTimeout(InboundWebSocket *s)
+{
+    unsigned long deadline;
+    if( s->nextTimeout( deadline ) )
+        m_timers.schedule( &s->m_timer, deadline );
+    else
+        m_timers.cancel( &s->m_timer );
+}
+
+void WebSocketServer::expireTimers()
+{
+    unsigned long now = millis();
+    WebSocketTimer *timer;
+    while( ( timer = m_timers.expire( now ) ) )
+    {
+        InboundWebSocket *s = (InboundWebSocket *)timer->context();
+
+        // Sockets aren't rescheduled when traffic arrives; if some did, the
+        // check comes to nothing and the deadline simply moves on.
+        if( s->connected() && s->checkTimeout() && s->connected() )
+            scheduleTimeout( s );
+        else
+            remove( s );
+    }
+}
 
-        // Complete a handshake:
-        if( s->status() == WebSocket::HANDSHAKE )
+void WebSocketServer::service(InboundWebSocket *s)
+{
+    if( s->connected() )
+    {
+        if( s->status() == WebSocket::CONNECTED )
+            s->listen();
+        else if( s->status() == WebSocket::HANDSHAKE && s->socket().available() && ( s->m_rxBuffer || m_pool->available() ) )
         {
-            if( !s->inboundHandshake() )
+            // Complete a handshake, which may take several reads:
+            WebSocketHandshake::Result result = s->inboundHandshake();
+            if( result == WebSocketHandshake::FAILED )
             {
+                WEBSOCKET_COUNT( handshakeFailures, 1 );
                 s->close();
-                continue;
             }
+            else if( result == WebSocketHandshake::COMPLETE )
+            {
+                if( onConnect )
+                {
+                    WEBSOCKET_TIME_CALLBACK();
+                    onConnect(*s, m_connectOpaque);
+                    WEBSOCKET_TIMED_CALLBACK();
+                }
+
+                // Keepalive starts now, with whatever onConnect set up.
+                scheduleTimeout( s );
+
+#if WEBSOCKET_COROUTINES
+                if( m_accepting )
+                    offer( s );
+#endif
 
-            s->setStatus( WebSocket::CONNECTED );
-
-            if( onConnect )
-                onConnect(*s, m_connectOpaque);
+                // Frames may have arrived along with the request.
+                s->listen();
+            }
         }
-        
+
+        // With no slab free, input waits in the socket until one is.
+        if( !s->m_rxBuffer && !m_pool->available() && s->socket().available() )
+            starve( s );
+    }
+
+    if( !s->connected() )
+        remove( s );
+}
+
+void WebSocketServer::starve(InboundWebSocket *s)
+{
+    if( s->m_starved )
         return;
+
+    // Otherwise poll() reports the unread input every time round.
+    s->socket().watchInput( false );
+    s->m_starved = true;
+    m_starvedCount++;
+}
+
+void WebSocketServer::feedStarved()
+{
+    // Those that miss out again go back to waiting.
+    for( word x=0; x < m_maxConnections && m_starvedCount; x++ )
+    {
+        InboundWebSocket *s = m_connections[x];
+        if( s && s->m_starved )
+        {
+            s->socket().watchInput( true );
+            s->m_starved = false;
+            m_starvedCount--;
+        }
     }
+}
 
-    // No room!
-#ifdef DEBUG
-    Serial.println(F("Cannot accept new websocket client, maxConnections reached!"));
+void WebSocketServer::remove(InboundWebSocket *s)
+{
+    if( onDisconnect )
+    {
+        WEBSOCKET_TIME_CALLBACK();
+        onDisconnect(*s, m_disconnectOpaque);
+        WEBSOCKET_TIMED_CALLBACK();
+    }
+
+#if WEBSOCKET_STATS
+    m_stats.traffic.add( s->stats() );
+#endif
+
+#if WEBSOCKET_COROUTINES
+    if( s->m_receiver )
+        s->m_receiver->close();
+    if( s->m_unclaimed )
+        m_unclaimed--;
 #endif
-    cli.stop();
+
+    if( s->m_starved )
+        m_starvedCount--;
+
+    m_timers.cancel( &s->m_timer );
+    m_connectionCount--;
+    m_connections[s->m_slot] = NULL;
+    if( s->m_slot < m_freeSlot )
+        m_freeSlot = s->m_slot;
+
+    WebSocketTransport *transport = &s->socket();
+    destroy( s );
+    m_server->release( transport );
 }
 
-InboundWebSocket::InboundWebSocket( WebSocketServer *server, EthernetClient cli ) :
-    WebSocket(),
-    m_server(server)
+void WebSocketServer::destroy(InboundWebSocket *s)
 {
-    m_socket = cli;
-    setStatus( WebSocket::HANDSHAKE );
+    if( m_socketStorage )
+        s->~InboundWebSocket();
+    else
+        delete s;
 }
 
-bool InboundWebSocket::sendInboundHandshakeResponse( char *key )
+void WebSocketServer::acceptConnections()
 {
-    if( strlen(key) + 101 > frameCapacity )
+    // Bounded so a connection flood can't starve existing clients.
+    for( byte accepted=0; accepted < 16; accepted++ )
     {
-        // Buffer isn't large enough!
-        close();
-        return false;
-    }
+        WebSocketTransport *transport = m_server->accept();
+        if( !transport )
+            return;
 
-    char *csum = checksum(key);
-    snprintf_P( frame.data, frameCapacity, PSTR("HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: Upgrade\r\nSec-WebSocket-Accept: %s\r\n\r\n"), csum );
-    delete csum;
+        // Find a slot:
+        word x = m_freeSlot;
+        while( x < m_maxConnections && m_connections[x] )
+            x++;
 
-    m_socket.write( frame.data );
+        if( x >= m_maxConnections )
+        {
+            // No room!
 #ifdef DEBUG
-    Serial.println( frame.data );
+            Serial.println(F("Cannot accept new websocket client, maxConnections reached!"));
 #endif
-    return true;
+            WEBSOCKET_COUNT( rejected, 1 );
+            m_server->release( transport );
+            continue;
+        }
+
+        // Each slot has its own place in m_socketStorage, if there is one.
+        InboundWebSocket *s;
+        if( m_socketStorage )
+            s = new( m_socketStorage + x * sizeof(InboundWebSocket), WebSocketPlacement() ) InboundWebSocket(this, transport);
+        else
+            s = new InboundWebSocket(this, transport);
+        s->m_slot = x;
+        transport->setContext( s );
+
+        // Stalled handshakes time out too.
+        s->m_lastPacketTime = s->m_lastPingTime = millis();
+        s->m_timer.setContext( s );
+        scheduleTimeout( s );
+
+        m_connections[x] = s;
+        m_connectionCount++;
+        WEBSOCKET_COUNT( accepted, 1 );
+        m_freeSlot = x + 1;
+
+        // The handshake may already be waiting:
+        service( s );
+    }
+}
+
+#if WEBSOCKET_STATS
+WebSocketServerStats WebSocketServer::stats()
+{
+    WebSocketServerStats stats = m_stats;
+    stats.connections = m_connectionCount;
+    stats.broadcastFailures = m_broadcastFailures;
+    for( word x=0; x < m_maxConnections; x++ )
+    {
+        if( m_connections[x] )
+            stats.traffic.add( m_connections[x]->stats() );
+    }
+    return stats;
 }
 
-bool InboundWebSocket::inboundHandshake() {
-    char bite;
-    char key[32];
+word WebSocketServer::printStats( WebSocketWritable &to )
+{
+    WebSocketServerStats s = stats();
+    return to.printf_P( F("{\"connections\":%u,\"accepted\":%lu,\"rejected\":%lu,\"handshakeFailures\":%lu,"
+        "\"broadcasts\":%lu,\"broadcastFailures\":%lu,\"callbackMicros\":%lu,\"traffic\":{" WEBSOCKET_STATS_JSON "}}"),
+        s.connections, s.accepted, s.rejected, s.handshakeFailures, s.broadcasts, s.broadcastFailures, s.callbackMicros,
+        WEBSOCKET_STATS_ARGS( s.traffic ) );
+}
+#endif
 
-    bool hasUpgrade = false;
-    bool hasConnection = false;
-    bool isSupportedVersion = false;
-    bool hasHost = false;
-    bool hasKey = false;
+#if WEBSOCKET_WORKERS
+WebSocketOutbox *WebSocketServer::outbox()
+{
+    if( !m_outbox )
+        m_outbox = new WebSocketOutbox( m_server );
+    return m_outbox;
+}
+#endif
 
+#if WEBSOCKET_COROUTINES
+bool WebSocketServer::AcceptAwaiter::await_suspend( std::coroutine_handle<> acceptor )
+{
+    if( m_server->m_acceptor )
+    {
 #ifdef DEBUG
-    Serial.print(F("Frame capacity: "));
-    Serial.println(frameCapacity);
+        Serial.println(F("Two coroutines accepting on one server."));
 #endif
+        return false;
+    }
+
+    m_server->m_acceptor = acceptor;
+    return true;
+}
+
+void WebSocketServer::offer( InboundWebSocket *s )
+{
+    // Its messages wait for the coroutine that takes it.
+    s->receiver();
 
-    word counter = 0;
-    while( counter < frameCapacity && (bite = m_socket.read()) != -1 )
+    if( !m_acceptor )
     {
-        if( bite == '\r' ) // Ignored.
-            continue;
+        s->m_unclaimed = true;
+        m_unclaimed++;
+        return;
+    }
+
+    std::coroutine_handle<> acceptor = m_acceptor;
+    m_acceptor = nullptr;
+    m_accepted = s;
+    acceptor.resume();
+}
+
+InboundWebSocket *WebSocketServer::claim()
+{
+    InboundWebSocket *s = m_accepted;
+    m_accepted = NULL;
+    if( s || !m_unclaimed || m_closing )
+        return s;
 
-        if( bite != '\n' )
+    for( word x=0; x < m_maxConnections; x++ )
+    {
+        s = m_connections[x];
+        if( s && s->m_unclaimed )
         {
-            frame.data[counter++] = bite;
-            frame.data[counter] = '\0';
-            continue;
+            s->m_unclaimed = false;
+            m_unclaimed--;
+            return s;
         }
+    }
+    return NULL;
+}
+#endif
+
+InboundWebSocket::InboundWebSocket( WebSocketServer *server, WebSocketTransport *transport ) :
+    WebSocket(transport, server->bufferPool()),
+    m_server(server),
+    m_slot(0),
+    m_starved(false)
+{
+#if WEBSOCKET_WORKERS
+    m_strand = NULL;
+#endif
+#if WEBSOCKET_COROUTINES
+    m_unclaimed = false;
+#endif
+    m_handshake.reset( WebSocketHandshake::REQUEST, server->urlPrefix() );
+    setStatus( WebSocket::HANDSHAKE );
+#if WEBSOCKET_DEFLATE
+    setDeflate( server->deflateOptions() );
+#endif
+}
+
+InboundWebSocket::~InboundWebSocket()
+{
+#if WEBSOCKET_WORKERS
+    if( m_strand )
+    {
+        m_strand->detach();
+        m_strand->release();
+    }
+#endif
+}
+
+#if WEBSOCKET_WORKERS
+void InboundWebSocket::registerWorkCallback( WebSocketWorkers &workers, WebSocketStrand::WorkCallback *callback, void *opaque )
+{
+    if( m_strand )
+    {
+        m_strand->detach();
+        m_strand->release();
+    }
+
+    m_strand = new WebSocketStrand( this, m_server->outbox(), &workers, callback, opaque );
+    registerDataCallback( &postToStrand, m_strand );
+}
 
+void InboundWebSocket::postToStrand( WebSocket &socket, char *data, word length, void *opaque )
+{
+    if( !( (WebSocketStrand *)opaque )->post( socket.opcode(), data, length ) )
+    {
 #ifdef DEBUG
-        Serial.print("Got header: ");
-        Serial.println(frame.data);
-#endif
-
-        // Ignore case when comparing and allow 0-n whitespace after ':'. See the spec:
-        // http://www.w3.org/Protocols/rfc2616/rfc2616-sec4.html
-        if( strstr_P( frame.data, PSTR("Upgrade: ") ) )                 hasUpgrade = true;
-        else if( strstr_P( frame.data, PSTR("Connection: ") ) )         hasConnection = true;
-        else if( strstr_P( frame.data, PSTR("Host: ") ) )               hasHost = true;
-        else if( strstr_P( frame.data, PSTR("Sec-WebSocket-Version: ") ) && strstr_P( frame.data, PSTR("13") ) )
-            isSupportedVersion = true;
-        else if( strstr_P( frame.data, PSTR("Sec-WebSocket-Key: ") ) )
-        {
-            hasKey = true;
-            strtok(frame.data, " ");
-            strncpy(key, strtok(NULL, " "), sizeof(key));
-        }
+        Serial.println(F("No memory to queue a message for the workers."));
+#endif
+    }
+}
+#endif
+
+bool InboundWebSocket::sendInboundHandshakeResponse( const char *key )
+{
+    char response[WEBSOCKET_HANDSHAKE_BUFFER];
+    char csum[WEBSOCKET_ACCEPT_LENGTH + 1];
+    checksum( csum, key );
+
+    const char *extensions = "";
+#if WEBSOCKET_DEFLATE
+    // Take up the first permessage-deflate offer we can live with, if any.
+    char reply[WEBSOCKET_DEFLATE_HEADER];
+    WebSocketDeflate::Params params;
+    bool deflate = m_deflateOptions && m_handshake.has( WebSocketHandshake::HAS_EXTENSIONS ) &&
+        WebSocketDeflate::accept( m_handshake.extensions(), *m_deflateOptions, params, reply, sizeof(reply) );
+    if( deflate )
+        extensions = reply;
+#endif
+
+    int written = snprintf_P( response, sizeof(response), PSTR("HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: Upgrade\r\nSec-WebSocket-Accept: %s\r\n%s%s%s\r\n"), csum,
+        *extensions ? "Sec-WebSocket-Extensions: " : "", extensions, *extensions ? CRLF : "" );
 
-        counter = 0; // Start saving new header string
+    if( written < 0 || written >= (int)sizeof(response) )
+    {
+        // Buffer isn't large enough!
+        close();
+        return false;
     }
 
+    WEBSOCKET_COUNT( bytesOut, written );
+    m_socket->write( (const uint8_t *)response, written );
+#ifdef DEBUG
+    Serial.println( response );
+#endif
+
+#if WEBSOCKET_DEFLATE
+    if( deflate )
+        startDeflate( *m_deflateOptions, params );
+#endif
+    return true;
+}
+
+WebSocketHandshake::Result InboundWebSocket::inboundHandshake() {
+    WebSocketHandshake::Result result = readHandshake();
+    if( result != WebSocketHandshake::COMPLETE )
+        return result;
+
     // Assert that we have all headers that are needed. If so, go ahead and
     // send response headers.
-    if( !hasUpgrade || !hasConnection || !isSupportedVersion || !hasHost || !hasKey || !sendInboundHandshakeResponse(key) )
+    const byte required = WebSocketHandshake::HAS_START_LINE | WebSocketHandshake::HAS_UPGRADE | WebSocketHandshake::HAS_CONNECTION |
+        WebSocketHandshake::HAS_HOST | WebSocketHandshake::HAS_VERSION | WebSocketHandshake::HAS_KEY;
+    if( m_handshake.has( required ) && !m_handshake.has( WebSocketHandshake::HAS_PATH ) )
+    {
+        // A resource outside the server's URL prefix.
+        static const char notFound[] PROGMEM = "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+        char response[sizeof(notFound)];
+        memcpy_P( response, notFound, sizeof(notFound) );
+        WEBSOCKET_COUNT( bytesOut, sizeof(notFound) - 1 );
+        m_socket->write( (const uint8_t *)response, sizeof(notFound) - 1 );
+        return WebSocketHandshake::FAILED;
+    }
+
+    if( !m_handshake.has( required ) || !websocket_key_valid( m_handshake.key() ) || !sendInboundHandshakeResponse( m_handshake.key() ) )
     {
         // Nope, failed handshake. Disconnect
 #ifdef DEBUG
-        Serial.print(F("Handshake failed! Upgrade:"));
-        Serial.print( hasUpgrade );
-        Serial.print(F(", Connection:"));
-        Serial.print( hasConnection );
-        Serial.print(F(", Host:"));
-        Serial.print( hasHost );
-        Serial.print(F(", Key:"));
-        Serial.print( hasKey );
-        Serial.print(F(", Version:"));
-        Serial.println( isSupportedVersion );
+        Serial.print(F("Handshake failed! Found: "));
+        Serial.println(m_handshake.found());
 #endif
-        return false;
+        return WebSocketHandshake::FAILED;
     }
 
     setStatus( WebSocket::CONNECTED );
+#ifdef DEBUG
     Serial.println(F("Leaving inbound connection jazz, m_state is CONNECTED."));
-    return true;
+#endif
+    return WebSocketHandshake::COMPLETE;
 }
@@ -1,24 +1,62 @@
 #include "WebSocketWritable.h"
 #include "WebSocket.h"
-#include <SPI.h>
-#include <Ethernet.h>
+#include "WebSocketTransport.h"
+#include "WebSocketWorkers.h"
 
 #ifndef H_WEBSOCKETSERVER
 #define H_WEBSOCKETSERVER
 
+// Construct an object in storage we already have. Tagged rather than the
+// standard placement new, which older AVR cores don't provide.
+struct WebSocketPlacement {};
+inline void *operator new(size_t, void *where, WebSocketPlacement) { return where; }
+inline void operator delete(void *, void *, WebSocketPlacement) {}
+
 class WebSocketServer;
 class InboundWebSocket : public WebSocket {
 protected:
 	friend class WebSocketServer;
 
-	bool sendInboundHandshakeResponse( char *key );
-	bool inboundHandshake();
+	bool sendInboundHandshakeResponse( const char *key );
+
+	// Reads the client's upgrade request as it arrives, and answers it
+	// once complete.
+	WebSocketHandshake::Result inboundHandshake();
 
 	WebSocketServer	*m_server;
 
+	// Index into WebSocketServer::m_connections.
+	word m_slot;
+
+	// Has input but no slab to read it into, so poll() isn't reporting it.
+	bool m_starved;
+
+#if WEBSOCKET_WORKERS
+	// Where messages go when a work callback is registered.
+	WebSocketStrand *m_strand;
+
+	static void postToStrand(WebSocket &socket, char *data, word length, void *opaque);
+#endif
+
+#if WEBSOCKET_COROUTINES
+	// Connected while no coroutine was waiting in accept().
+	bool m_unclaimed;
+#endif
+
 public:
-	InboundWebSocket( WebSocketServer *server, EthernetClient cli );
+	InboundWebSocket( WebSocketServer *server, WebSocketTransport *transport );
+	~InboundWebSocket();
 	WebSocketServer *server() { return m_server; }
+
+#if WEBSOCKET_WORKERS
+	// Hand each message to 'callback' on one of 'workers' threads instead
+	// of handling it here, so a slow handler doesn't hold up the server's
+	// other connections. Messages from one connection are handled one at a
+	// time, in order; answer through the WebSocketReply, whose frames are
+	// sent from the server's thread. Replaces the data callback, and takes
+	// whole messages only. The workers must outlive the server.
+	void registerWorkCallback(WebSocketWorkers &workers, WebSocketStrand::WorkCallback *callback, void *opaque=NULL);
+#endif
 };
 
 class WebSocketServer : public WebSocketWritable {
@@ -37,34 +75,240 @@ friend class WebSocket;
 private:
     const char *m_server_urlPrefix;
 
-    EthernetServer m_server;
+    WebSocketServerTransport *m_server;
+    bool m_ownsServer;
+
+    word m_maxConnections;
+    word m_connectionCount;
 
-    byte m_maxConnections;
-    byte m_connectionCount;
+    // Receive buffers for all connections, lent out while they have input.
+    WebSocketBufferPool *m_pool;
+    bool m_ownsPool;
 
     // Pointer array of client slots:
     InboundWebSocket **m_connections;
+    bool m_ownsConnections;
+
+    // Room for maxConnections InboundWebSockets, one per slot, or NULL to
+    // allocate them as clients arrive.
+    uint8_t *m_socketStorage;
+
+    // Where to start looking for a free slot.
+    word m_freeSlot;
+
+    // Connections waiting for a slab to come free.
+    word m_starvedCount;
+
+    // Set when a socket was closed outside of service(), for listen() to clean up.
+    bool m_reapPending;
+
+    // Per-client sends that failed during broadcasts.
+    unsigned long m_broadcastFailures;
+
+    // Keepalive and timeout deadlines of every connection.
+    WebSocketTimerWheel m_timers;
+
+#if WEBSOCKET_DEFLATE
+    const WebSocketDeflateOptions *m_deflateOptions;
+#endif
+
+#if WEBSOCKET_STATS
+    // Counters, with the traffic of connections that have gone.
+    WebSocketServerStats m_stats;
+#endif
+
+#if WEBSOCKET_WORKERS
+    // Replies from work callbacks, set up when the first is registered.
+    WebSocketOutbox *m_outbox;
+#endif
+
+#if WEBSOCKET_COROUTINES
+    // accept(): the coroutine waiting for a connection, the connection
+    // handed to it, and the count that connected with none waiting.
+    std::coroutine_handle<> m_acceptor;
+    InboundWebSocket *m_accepted;
+    word m_unclaimed;
+    bool m_accepting; // accept() has been called.
+    bool m_closing;
+
+    // A connection finished its handshake: wake the acceptor with it.
+    void offer(InboundWebSocket *s);
+    InboundWebSocket *claim();
+#endif
+
+    void setup();
+
+    // Accept pending connections into free slots.
+    void acceptConnections();
+
+    // Read from one connection, dropping it if it has gone away.
+    void service(InboundWebSocket *s);
+
+    // Stop hearing about a connection's input until a slab is free, and
+    // start again once one is.
+    void starve(InboundWebSocket *s);
+    void feedStarved();
+    void remove(InboundWebSocket *s);
+    void destroy(InboundWebSocket *s);
+    void reap();
+
+    // Put a connection's next keepalive or timeout check on the wheel.
+    void scheduleTimeout(InboundWebSocket *s);
+
+    // Ping or drop the connections whose deadlines have come round.
+    void expireTimers();
 
 public:
-    // Constructor.
-    WebSocketServer(const char *urlPrefix = "/", int inPort = 80, byte maxConnections = 4, word maxFrameSize = 96);
+#if WEBSOCKET_DEFAULT_TRANSPORT
+    // Constructor, listening on the platform's default transport.
+    WebSocketServer(const char *urlPrefix = "/", int inPort = 80, word maxConnections = 4, word maxFrameSize = 96);
+#endif
+
+    // Constructor for a caller-provided listener, which must outlive the server.
+    WebSocketServer(WebSocketServerTransport &transport, const char *urlPrefix = "/", word maxConnections = 4, word maxFrameSize = 96);
+
+    // Constructor drawing buffers from a caller-provided pool, which must
+    // outlive the server. A pool smaller than maxConnections bounds memory
+    // for many mostly idle clients; those that find it empty wait their turn.
+    WebSocketServer(WebSocketServerTransport &transport, WebSocketBufferPool &pool, const char *urlPrefix = "/", word maxConnections = 4);
     ~WebSocketServer();
 
+protected:
+    // Constructor for WebSocketServerT: the slot table and room for the
+    // sockets themselves are provided, so nothing is allocated.
+    WebSocketServer(WebSocketServerTransport &transport, WebSocketBufferPool &pool, const char *urlPrefix, word maxConnections,
+        InboundWebSocket **connections, uint8_t *socketStorage);
+
+public:
+
     // Callbacks
     void registerConnectCallback(Callback *callback, void *opaque=NULL) { onConnect = callback; m_connectOpaque = opaque; }
     void registerDisconnectCallback(Callback *callback, void *opaque=NULL) { onDisconnect = callback; m_disconnectOpaque = opaque; }
 
     // Start listening for connections.
-    void begin() { m_server.begin(); }
+    void begin() { m_server->begin(); }
 
     // Main listener for incoming data. Should be called from the loop.
     void listen();
 
     // Connection count
-    byte connectionCount() { return m_connectionCount; }
+    word connectionCount() { return m_connectionCount; }
+
+    // Requests for resources that don't start with this are answered 404.
+    const char *urlPrefix() { return m_server_urlPrefix; }
+
+    WebSocketBufferPool *bufferPool() { return m_pool; }
+
+#if WEBSOCKET_WORKERS
+    WebSocketOutbox *outbox();
+#endif
+
+#if WEBSOCKET_COROUTINES
+    class AcceptAwaiter {
+    public:
+        AcceptAwaiter(WebSocketServer *server) : m_server(server) {}
+
+        bool await_ready() { return m_server->m_accepted || m_server->m_unclaimed || m_server->m_closing; }
+        bool await_suspend(std::coroutine_handle<> acceptor);
+        InboundWebSocket *await_resume() { return m_server->claim(); }
+
+    private:
+        WebSocketServer *m_server;
+    };
+
+    // From a coroutine, 'co_await server.accept()' waits for the next client
+    // to complete its handshake, after the connect callback, and before any
+    // of its messages are read; they wait for the socket's receive(). NULL
+    // once the server is going. Start accepting before the first client
+    // arrives. One coroutine at a time.
+    AcceptAwaiter accept() { m_accepting = true; return AcceptAwaiter( this ); }
+#endif
+
+#if WEBSOCKET_DEFLATE
+    // Accept permessage-deflate from clients that offer it, with these
+    // settings, or NULL (the default) to refuse it. Applies to connections
+    // accepted from now on; the settings must outlive the server.
+    // Broadcasts are encoded once for everyone, so they go out uncompressed.
+    void setDeflate(const WebSocketDeflateOptions *options) { m_deflateOptions = options; }
+    const WebSocketDeflateOptions *deflateOptions() { return m_deflateOptions; }
+#endif
+
+    // Broadcast a frame to all connected clients. The frame is encoded once
+    // and written to each socket that has completed its handshake.
+    frame_length_t sendFrame(byte opcode, const WebSocketIovec *iov, byte count);
+    using WebSocketWritable::sendFrame;
+
+#ifdef WEBSOCKET_FLASH_CHUNK
+    // Likewise from program memory, streamed to each client in turn.
+    frame_length_t sendFrame_P(byte opcode, const uint8_t *data, frame_length_t length);
+#endif
+
+    // A client that misses part of a fragmented message is disconnected, as
+    // it can't be sent the rest.
+    bool sendFragment(byte opcode, const uint8_t *data, size_t length, bool final);
+
+    // Count of per-client sends that failed during broadcasts. Sockets
+    // keep their own count, see WebSocket::writeFailures().
+    unsigned long broadcastFailures() { return m_broadcastFailures; }
+
+#if WEBSOCKET_STATS
+    // Counters so far, open connections' traffic included.
+    WebSocketServerStats stats();
+
+    // Send them to 'to' as one JSON text frame, which takes a frame size of
+    // 512 or so; an admin connection can ask for them with a message of its
+    // own. Returns the bytes sent.
+    word printStats(WebSocketWritable &to);
+#endif
+};
+
+// Everything a WebSocketServerT needs, set up before the server itself.
+template<word MaxConnections, word MaxFrameSize, class Listener>
+class WebSocketServerStorage {
+protected:
+    enum {
+        SLAB_SIZE = WEBSOCKET_SLAB_SIZE(MaxFrameSize),
+        SLAB_COUNT = MaxConnections + 1 // One spare for printf().
+    };
+
+    WebSocketServerStorage(word port) :
+        m_listener(port),
+        m_pool(m_poolMemory, SLAB_SIZE, SLAB_COUNT)
+    {}
+
+    Listener m_listener;
+    WebSocketBufferPool m_pool;
+    InboundWebSocket *m_connectionTable[MaxConnections];
+    alignas(InboundWebSocket) uint8_t m_socketStorage[MaxConnections * sizeof(InboundWebSocket)];
+    alignas(uint8_t *) uint8_t m_poolMemory[WEBSOCKET_POOL_BYTES(SLAB_SIZE, SLAB_COUNT)];
+};
+
+// A WebSocketServer with its connections, buffers and listener all held
+// inside it, sized at compile time. Declared as a global it lives in static
+// storage, sizeof() is its whole RAM budget, and nothing touches the heap
+// once begin() has been called (permessage-deflate aside, zlib allocates):
+//
+//     WebSocketServerT<4, 128> server("/", 80);
+//
+// Listener is built from the port. EthernetServerTransport never allocates;
+// EpollServerTransport allocates each accepted connection. Platforms without
+// a default transport have to name one.
+#if WEBSOCKET_DEFAULT_TRANSPORT
+template<word MaxConnections, word MaxFrameSize, class Listener = DefaultServerTransport>
+#else
+template<word MaxConnections, word MaxFrameSize, class Listener>
+#endif
+class WebSocketServerT : private WebSocketServerStorage<MaxConnections, MaxFrameSize, Listener>, public WebSocketServer {
+    typedef WebSocketServerStorage<MaxConnections, MaxFrameSize, Listener> Storage;
+
+public:
+    WebSocketServerT(const char *urlPrefix = "/", word inPort = 80) :
+        Storage(inPort),
+        WebSocketServer(Storage::m_listener, Storage::m_pool, urlPrefix, MaxConnections,
+            Storage::m_connectionTable, Storage::m_socketStorage)
+    {}
 
-    // Broadcast to all connected clients.
-    byte send(char *str, word length);
+    Listener &listener() { return Storage::m_listener; }
 };
 
 #endif
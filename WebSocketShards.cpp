@@ -0,0 +1,238 @@
+#include "WebSocketShards.h"
+
+#ifdef WEBSOCKET_EPOLL
+
+#include <unistd.h>
+
+//#define DEBUG 1
+
+static void releaseMessage(WebSocketShardMessage *message)
+{
+    if( __atomic_sub_fetch( &message->references, 1, __ATOMIC_ACQ_REL ) == 0 )
+        free( message );
+}
+
+// One thread's listener, server and mailbox.
+class WebSocketShard {
+public:
+    WebSocketShard(const char *urlPrefix, word port, word maxConnections, word maxFrameSize) :
+        m_listener(port),
+        m_server(m_listener, urlPrefix, maxConnections, maxFrameSize),
+        m_started(false),
+        m_stopping(false),
+        m_connections(0),
+        m_first(0),
+        m_count(0)
+    {
+        pthread_mutex_init( &m_lock, NULL );
+
+        // Block in poll() between events, but come round for the timer
+        // wheel and for stop().
+        m_listener.setReusePort( true );
+        m_listener.setPollTimeout( WEBSOCKET_TIMER_TICK );
+    }
+
+    ~WebSocketShard()
+    {
+        stop();
+        while( m_count )
+        {
+            releaseMessage( m_mailbox[m_first] );
+            m_first = ( m_first + 1 ) % WEBSOCKET_SHARD_MAILBOX;
+            m_count--;
+        }
+        pthread_mutex_destroy( &m_lock );
+    }
+
+    bool start()
+    {
+        if( !m_listener.listening() )
+            m_server.begin();
+        if( !m_listener.listening() )
+            return false;
+
+        m_stopping = false;
+        m_started = pthread_create( &m_thread, NULL, &run, this ) == 0;
+        return m_started;
+    }
+
+    void stop()
+    {
+        if( !m_started )
+            return;
+
+        __atomic_store_n( &m_stopping, true, __ATOMIC_RELEASE );
+        m_listener.wake();
+        pthread_join( m_thread, NULL );
+        m_started = false;
+    }
+
+    // Queue a broadcast, taking a reference. Returns false if the mailbox is full.
+    bool post(WebSocketShardMessage *message)
+    {
+        pthread_mutex_lock( &m_lock );
+        bool room = m_count < WEBSOCKET_SHARD_MAILBOX;
+        if( room )
+        {
+            __atomic_add_fetch( &message->references, 1, __ATOMIC_RELAXED );
+            m_mailbox[( m_first + m_count ) % WEBSOCKET_SHARD_MAILBOX] = message;
+            m_count++;
+        }
+        pthread_mutex_unlock( &m_lock );
+
+        if( room )
+            m_listener.wake();
+        return room;
+    }
+
+    WebSocketServer &server() { return m_server; }
+
+    // Connection count as of the last listen(), readable from any thread.
+    word connections() { return __atomic_load_n( &m_connections, __ATOMIC_RELAXED ); }
+
+private:
+    EpollServerTransport m_listener;
+    WebSocketServer m_server;
+
+    pthread_t m_thread;
+    bool m_started;
+    bool m_stopping;
+    word m_connections;
+
+    // Broadcasts waiting to be sent, oldest at m_first.
+    pthread_mutex_t m_lock;
+    WebSocketShardMessage *m_mailbox[WEBSOCKET_SHARD_MAILBOX];
+    word m_first, m_count;
+
+    static void *run(void *context)
+    {
+        WebSocketShard *shard = (WebSocketShard *)context;
+        while( !__atomic_load_n( &shard->m_stopping, __ATOMIC_ACQUIRE ) )
+        {
+            shard->m_server.listen();
+            __atomic_store_n( &shard->m_connections, shard->m_server.connectionCount(), __ATOMIC_RELAXED );
+            if( shard->m_listener.takeWakeup() )
+                shard->deliver();
+        }
+        return NULL;
+    }
+
+    // Send what's in the mailbox, outside the lock.
+    void deliver()
+    {
+        WebSocketShardMessage *messages[WEBSOCKET_SHARD_MAILBOX];
+        pthread_mutex_lock( &m_lock );
+        word count = m_count;
+        for( word x=0; x < count; x++ )
+            messages[x] = m_mailbox[( m_first + x ) % WEBSOCKET_SHARD_MAILBOX];
+        m_first = ( m_first + count ) % WEBSOCKET_SHARD_MAILBOX;
+        m_count = 0;
+        pthread_mutex_unlock( &m_lock );
+
+        for( word x=0; x < count; x++ )
+        {
+            m_server.sendFrame( messages[x]->opcode, messages[x]->data, messages[x]->length );
+            releaseMessage( messages[x] );
+        }
+    }
+};
+
+WebSocketShardedServer::WebSocketShardedServer(const char *urlPrefix, word port, word shards, word maxConnections, word maxFrameSize) :
+    m_running(false),
+    m_onConnect(NULL),
+    m_onDisconnect(NULL),
+    m_connectOpaque(NULL),
+    m_disconnectOpaque(NULL)
+{
+    if( !shards )
+    {
+        long cpus = sysconf( _SC_NPROCESSORS_ONLN );
+        shards = cpus > 0 ? cpus : 1;
+    }
+
+    m_shardCount = shards;
+    m_shards = new WebSocketShard*[ m_shardCount ];
+    for( word x=0; x < m_shardCount; x++ )
+        m_shards[x] = new WebSocketShard( urlPrefix, port, maxConnections, maxFrameSize );
+}
+
+WebSocketShardedServer::~WebSocketShardedServer()
+{
+    stop();
+    for( word x=0; x < m_shardCount; x++ )
+        delete m_shards[x];
+    delete[] m_shards;
+}
+
+bool WebSocketShardedServer::start()
+{
+    if( m_running )
+        return true;
+
+    for( word x=0; x < m_shardCount; x++ )
+    {
+        WebSocketServer &server = m_shards[x]->server();
+        server.registerConnectCallback( m_onConnect, m_connectOpaque );
+        server.registerDisconnectCallback( m_onDisconnect, m_disconnectOpaque );
+        if( !m_shards[x]->start() )
+        {
+#ifdef DEBUG
+            Serial.println(F("Couldn't start a shard."));
+#endif
+            for( word y=0; y < x; y++ )
+                m_shards[y]->stop();
+            return false;
+        }
+    }
+
+    m_running = true;
+    return true;
+}
+
+void WebSocketShardedServer::stop()
+{
+    if( !m_running )
+        return;
+
+    for( word x=0; x < m_shardCount; x++ )
+        m_shards[x]->stop();
+    m_running = false;
+}
+
+word WebSocketShardedServer::broadcast(byte opcode, const uint8_t *data, size_t length)
+{
+    WebSocketShardMessage *message = (WebSocketShardMessage *)malloc( offsetof(WebSocketShardMessage, data) + length );
+    if( !message )
+        return 0;
+
+    // Our own reference keeps it alive while it's handed round.
+    message->references = 1;
+    message->opcode = opcode;
+    message->length = length;
+    memcpy( message->data, data, length );
+
+    word posted = 0;
+    for( word x=0; x < m_shardCount; x++ )
+    {
+        if( m_shards[x]->post( message ) )
+            posted++;
+    }
+
+    releaseMessage( message );
+    return posted;
+}
+
+WebSocketServer &WebSocketShardedServer::shard(word index)
+{
+    return m_shards[index]->server();
+}
+
+unsigned long WebSocketShardedServer::connectionCount()
+{
+    unsigned long count = 0;
+    for( word x=0; x < m_shardCount; x++ )
+        count += m_shards[x]->connections();
+    return count;
+}
+
+#endif
@@ -0,0 +1,81 @@
+#include "WebSocketServer.h"
+
+#ifndef H_WEBSOCKETSHARDS
+#define H_WEBSOCKETSHARDS
+
+#ifdef WEBSOCKET_EPOLL
+
+#include <pthread.h>
+
+// Broadcasts a shard can have queued before further ones are dropped.
+#ifndef WEBSOCKET_SHARD_MAILBOX
+#define WEBSOCKET_SHARD_MAILBOX 64
+#endif
+
+class WebSocketShard;
+
+// A broadcast on its way to the shards, shared by all of them.
+typedef struct {
+    int references;
+    byte opcode;
+    size_t length;
+    uint8_t data[1];
+} WebSocketShardMessage;
+
+// Linux server spread over several threads. Each shard is a complete
+// WebSocketServer with its own listener, buffer pool and connection table,
+// running its listen() loop on its own thread; the listeners share the port
+// through SO_REUSEPORT, so the kernel divides new connections among them
+// and no lock is taken on the way in or out. Connection callbacks run on
+// the thread of the shard the connection belongs to, and a socket may only
+// be used from there. broadcast() and stop() may be called from anywhere.
+class WebSocketShardedServer {
+public:
+    typedef void Callback(InboundWebSocket &socket, void *opaque);
+
+    // 'shards' threads (0 for one per online CPU), each taking up to
+    // 'maxConnections' clients.
+    WebSocketShardedServer(const char *urlPrefix = "/", word port = 80, word shards = 0, word maxConnections = 1024, word maxFrameSize = 1024);
+    ~WebSocketShardedServer();
+
+    // Register before start(); every shard calls them.
+    void registerConnectCallback(Callback *callback, void *opaque=NULL) { m_onConnect = callback; m_connectOpaque = opaque; }
+    void registerDisconnectCallback(Callback *callback, void *opaque=NULL) { m_onDisconnect = callback; m_disconnectOpaque = opaque; }
+
+    // Bind the listeners and start the threads. Returns false if a
+    // listener or thread couldn't be set up, leaving none running.
+    bool start();
+
+    // Stop the threads and wait for them. Connections stay open until the
+    // server is destroyed.
+    void stop();
+
+    // Queue a frame for every connection on every shard. The payload is
+    // copied once and sent by each shard from its own thread. Returns the
+    // count of shards that took it; one with a full mailbox doesn't.
+    word broadcast(byte opcode, const uint8_t *data, size_t length);
+    word broadcast(const char *str, size_t length) { return broadcast( WebSocketWritable::OPCODE_TEXT, (const uint8_t *)str, length ); }
+
+    word shardCount() { return m_shardCount; }
+
+    // A shard's server, e.g. for its stats(). Only safe to use from that
+    // shard's own thread, or once stopped.
+    WebSocketServer &shard(word index);
+
+    // Open connections on all shards, a moment ago.
+    unsigned long connectionCount();
+
+private:
+    WebSocketShard **m_shards;
+    word m_shardCount;
+    bool m_running;
+
+    Callback *m_onConnect;
+    Callback *m_onDisconnect;
+    void *m_connectOpaque;
+    void *m_disconnectOpaque;
+};
+
+#endif
+
+#endif
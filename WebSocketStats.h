@@ -0,0 +1,118 @@
+#include "WebSocketPlatform.h"
+
+#ifndef H_WEBSOCKETSTATS
+#define H_WEBSOCKETSTATS
+
+// Traffic counters, on by default except on AVR where the RAM is better
+// spent elsewhere. Define WEBSOCKET_STATS as 0 or 1 to override.
+#ifndef WEBSOCKET_STATS
+#if defined(__AVR__)
+#define WEBSOCKET_STATS 0
+#else
+#define WEBSOCKET_STATS 1
+#endif
+#endif
+
+// Timing callbacks costs two clock reads apiece (some 60ns on Linux, more
+// than the rest of an echo), so it's asked for separately.
+#ifndef WEBSOCKET_STATS_TIMING
+#define WEBSOCKET_STATS_TIMING 0
+#endif
+
+#if WEBSOCKET_STATS
+
+// Add 'n' to one of the m_stats counters. Compiled out along with the
+// counters, so 'n' mustn't have side effects.
+#define WEBSOCKET_COUNT(counter, n) ( m_stats.counter += (n) )
+
+// Bracket a callback to add its run time to m_stats.callbackMicros.
+#if WEBSOCKET_STATS_TIMING
+#define WEBSOCKET_TIME_CALLBACK() unsigned long callbackStarted = micros()
+#define WEBSOCKET_TIMED_CALLBACK() WEBSOCKET_COUNT( callbackMicros, micros() - callbackStarted )
+#endif
+
+#if defined(__AVR__)
+typedef unsigned long websocket_bytes_t;
+#define WEBSOCKET_BYTES_FORMAT "%lu"
+#else
+typedef unsigned long long websocket_bytes_t;
+#define WEBSOCKET_BYTES_FORMAT "%llu"
+#endif
+
+// One connection's counters, or the sum of several.
+class WebSocketStats {
+public:
+    WebSocketStats() :
+        framesIn(0), framesOut(0), bytesIn(0), bytesOut(0),
+        pingsIn(0), pingsOut(0), pongsIn(0), pongsOut(0),
+        oversizeFrames(0), protocolErrors(0), writeFailures(0), callbackMicros(0)
+    {}
+
+    unsigned long framesIn, framesOut;
+    websocket_bytes_t bytesIn, bytesOut; // Everything read or written, headers and handshake included.
+    unsigned long pingsIn, pingsOut;
+    unsigned long pongsIn, pongsOut;
+    unsigned long oversizeFrames; // Closed with 1009, too large to take.
+    unsigned long protocolErrors; // Closed with 1002 or 1007.
+    unsigned long writeFailures;
+    unsigned long callbackMicros; // Time spent in data callbacks, with WEBSOCKET_STATS_TIMING.
+
+    void add(const WebSocketStats &other)
+    {
+        framesIn += other.framesIn;
+        framesOut += other.framesOut;
+        bytesIn += other.bytesIn;
+        bytesOut += other.bytesOut;
+        pingsIn += other.pingsIn;
+        pingsOut += other.pingsOut;
+        pongsIn += other.pongsIn;
+        pongsOut += other.pongsOut;
+        oversizeFrames += other.oversizeFrames;
+        protocolErrors += other.protocolErrors;
+        writeFailures += other.writeFailures;
+        callbackMicros += other.callbackMicros;
+    }
+};
+
+// A WebSocketServer's counters.
+class WebSocketServerStats {
+public:
+    WebSocketServerStats() :
+        connections(0), accepted(0), rejected(0), handshakeFailures(0),
+        broadcasts(0), broadcastFailures(0), callbackMicros(0)
+    {}
+
+    word connections; // Open now.
+    unsigned long accepted;
+    unsigned long rejected; // Turned away, every slot taken.
+    unsigned long handshakeFailures;
+    unsigned long broadcasts, broadcastFailures;
+    unsigned long callbackMicros; // Time spent in connect and disconnect callbacks, likewise.
+
+    // Every connection's counters added up, past and present.
+    WebSocketStats traffic;
+};
+
+// The counters as JSON object members, for printf_P(): the format, and the
+// arguments it takes from a WebSocketStats.
+#define WEBSOCKET_STATS_JSON \
+    "\"framesIn\":%lu,\"framesOut\":%lu,\"bytesIn\":" WEBSOCKET_BYTES_FORMAT ",\"bytesOut\":" WEBSOCKET_BYTES_FORMAT "," \
+    "\"pingsIn\":%lu,\"pingsOut\":%lu,\"pongsIn\":%lu,\"pongsOut\":%lu," \
+    "\"oversizeFrames\":%lu,\"protocolErrors\":%lu,\"writeFailures\":%lu,\"callbackMicros\":%lu"
+#define WEBSOCKET_STATS_ARGS(s) \
+    (s).framesIn, (s).framesOut, (s).bytesIn, (s).bytesOut, \
+    (s).pingsIn, (s).pingsOut, (s).pongsIn, (s).pongsOut, \
+    (s).oversizeFrames, (s).protocolErrors, (s).writeFailures, (s).callbackMicros
+
+#else
+
+#define WEBSOCKET_COUNT(counter, n) ((void)0)
+
+#endif
+
+#ifndef WEBSOCKET_TIME_CALLBACK
+#define WEBSOCKET_TIME_CALLBACK() ((void)0)
+#define WEBSOCKET_TIMED_CALLBACK() ((void)0)
+#endif
+
+#endif
@@ -0,0 +1,65 @@
+#include "WebSocketTimerWheel.h"
+
+WebSocketTimerWheel::WebSocketTimerWheel() :
+    m_cursor(0),
+    m_cursorTime(millis())
+{
+    for( word x=0; x < WEBSOCKET_TIMER_SLOTS; x++ )
+        m_slots[x] = NULL;
+}
+
+void WebSocketTimerWheel::schedule(WebSocketTimer *timer, unsigned long deadline)
+{
+    cancel( timer );
+    timer->m_deadline = deadline;
+
+    // Always at least one slot past the cursor, which may be mid-expiry.
+    long ahead = (long)( deadline - m_cursorTime );
+    unsigned long ticks = ahead <= 0 ? 1 : ( ahead + WEBSOCKET_TIMER_TICK - 1 ) / WEBSOCKET_TIMER_TICK;
+    if( ticks > WEBSOCKET_TIMER_SLOTS - 1 )
+        ticks = WEBSOCKET_TIMER_SLOTS - 1; // Parked, re-armed when it comes round.
+
+    WebSocketTimer **slot = &m_slots[ ( m_cursor + ticks ) % WEBSOCKET_TIMER_SLOTS ];
+    timer->m_next = *slot;
+    if( *slot )
+        (*slot)->m_pprev = &timer->m_next;
+    timer->m_pprev = slot;
+    *slot = timer;
+}
+
+void WebSocketTimerWheel::cancel(WebSocketTimer *timer)
+{
+    if( !timer->m_pprev )
+        return;
+
+    *timer->m_pprev = timer->m_next;
+    if( timer->m_next )
+        timer->m_next->m_pprev = timer->m_pprev;
+    timer->m_next = NULL;
+    timer->m_pprev = NULL;
+}
+
+WebSocketTimer *WebSocketTimerWheel::expire(unsigned long now)
+{
+    // After a long stall one turn of the wheel visits every slot; no need
+    // to step through each missed tick. Resync the same way if the clock
+    // ever jumps back.
+    const long turn = (long)WEBSOCKET_TIMER_TICK * WEBSOCKET_TIMER_SLOTS;
+    long behind = (long)( now - m_cursorTime );
+    if( behind > turn || behind < -turn )
+        m_cursorTime = now - turn;
+
+    while( (long)( now - m_cursorTime ) >= 0 )
+    {
+        WebSocketTimer *timer = m_slots[m_cursor];
+        if( timer )
+        {
+            cancel( timer );
+            return timer;
+        }
+
+        m_cursor = ( m_cursor + 1 ) % WEBSOCKET_TIMER_SLOTS;
+        m_cursorTime += WEBSOCKET_TIMER_TICK;
+    }
+    return NULL;
+}
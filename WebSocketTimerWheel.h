@@ -0,0 +1,66 @@
+#include "WebSocketPlatform.h"
+
+#ifndef H_WEBSOCKETTIMERWHEEL
+#define H_WEBSOCKETTIMERWHEEL
+
+// Milliseconds covered by each slot of the wheel.
+#ifndef WEBSOCKET_TIMER_TICK
+#define WEBSOCKET_TIMER_TICK 250
+#endif
+
+// Slots in the wheel. Deadlines further out than this many ticks are parked
+// at the far end and re-armed when they come round.
+#ifndef WEBSOCKET_TIMER_SLOTS
+#if defined(__AVR__)
+#define WEBSOCKET_TIMER_SLOTS 8
+#else
+#define WEBSOCKET_TIMER_SLOTS 128
+#endif
+#endif
+
+// A deadline that can sit in a WebSocketTimerWheel, embedded in its owner.
+class WebSocketTimer {
+public:
+    WebSocketTimer() : m_next(NULL), m_pprev(NULL), m_deadline(0), m_context(NULL) {}
+
+    bool scheduled() { return m_pprev != NULL; }
+    unsigned long deadline() { return m_deadline; }
+
+    // Owner handle, to get from an expired timer back to what it belongs to.
+    void *context() { return m_context; }
+    void setContext(void *context) { m_context = context; }
+
+private:
+    friend class WebSocketTimerWheel;
+
+    WebSocketTimer *m_next;
+    WebSocketTimer **m_pprev; // Whatever points at us, for O(1) unlinking.
+    unsigned long m_deadline;
+    void *m_context;
+};
+
+// Hashed timer wheel: scheduling and cancelling are O(1), and each tick only
+// looks at the timers in the slots that have come due. Times are millis()
+// values compared by signed difference, so wraparound is harmless.
+class WebSocketTimerWheel {
+public:
+    WebSocketTimerWheel();
+
+    // (Re)schedule 'timer' for 'deadline'.
+    void schedule(WebSocketTimer *timer, unsigned long deadline);
+    void cancel(WebSocketTimer *timer);
+
+    // Unlink and return a timer whose slot has come due by 'now', or NULL
+    // once there are none. A timer may come back a little before its
+    // deadline (up to a tick, or when parked); check and reschedule it.
+    WebSocketTimer *expire(unsigned long now);
+
+private:
+    WebSocketTimer *m_slots[WEBSOCKET_TIMER_SLOTS];
+
+    // Slot being expired, and the time it stands for.
+    word m_cursor;
+    unsigned long m_cursorTime;
+};
+
+#endif
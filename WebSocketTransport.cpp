@@ -0,0 +1,30 @@
+#include "WebSocketTransport.h"
+
+size_t WebSocketTransport::writev(const WebSocketIovec *iov, byte count)
+{
+    size_t total = 0;
+    for( byte x=0; x < count; x++ )
+        total += iov[x].length;
+
+    if( total <= WEBSOCKET_COALESCE_SIZE )
+    {
+        uint8_t buffer[WEBSOCKET_COALESCE_SIZE];
+        size_t offset = 0;
+        for( byte x=0; x < count; x++ )
+        {
+            memcpy( buffer + offset, iov[x].data, iov[x].length );
+            offset += iov[x].length;
+        }
+        return write( buffer, total );
+    }
+
+    size_t written = 0;
+    for( byte x=0; x < count; x++ )
+    {
+        size_t sent = write( iov[x].data, iov[x].length );
+        written += sent;
+        if( sent != iov[x].length )
+            break;
+    }
+    return written;
+}
@@ -0,0 +1,100 @@
+#include "WebSocketPlatform.h"
+
+#ifndef H_WEBSOCKETTRANSPORT
+#define H_WEBSOCKETTRANSPORT
+
+// One piece of a scatter/gather write.
+typedef struct {
+    const uint8_t *data;
+    size_t length;
+} WebSocketIovec;
+
+// Most pieces a single vectored write will take.
+#ifndef WEBSOCKET_MAX_IOV
+#define WEBSOCKET_MAX_IOV 8
+#endif
+
+// Small vectored writes are gathered into a stack buffer this big so they
+// leave as one write (one packet on a W5100).
+#ifndef WEBSOCKET_COALESCE_SIZE
+#if defined(__AVR__)
+#define WEBSOCKET_COALESCE_SIZE 64
+#else
+#define WEBSOCKET_COALESCE_SIZE 512
+#endif
+#endif
+
+// A single byte-stream connection underneath a WebSocket. Backends exist for
+// the Ethernet library (WebSocketEthernet.h) and for POSIX sockets on Linux
+// (WebSocketEpoll.h).
+class WebSocketTransport {
+public:
+    WebSocketTransport() : m_context(NULL) {}
+    virtual ~WebSocketTransport() {}
+
+    // Open an outbound connection (used by WebSocket::connect).
+    virtual bool connect(const char *host, word port) = 0;
+
+    virtual bool connected() = 0;
+
+    // Count of bytes that can be read without blocking.
+    virtual int available() = 0;
+
+    // Read up to 'length' bytes. Returns the count read, 0 if nothing is
+    // pending, or -1 if the connection is gone.
+    virtual int read(uint8_t *buffer, size_t length) = 0;
+
+    // Returns the count of bytes written.
+    virtual size_t write(const uint8_t *buffer, size_t length) = 0;
+
+    // Write 'count' pieces back to back. Backends with a native gather
+    // write override this; the default coalesces small writes. Returns the
+    // total count of bytes written.
+    virtual size_t writev(const WebSocketIovec *iov, byte count);
+
+    virtual void flush() {}
+    virtual void stop() = 0;
+
+    // Stop (or resume) reporting input to the server transport's poll(),
+    // for a connection that has nowhere to read it yet. Backends without
+    // readiness reports needn't bother.
+    virtual void watchInput(bool) {}
+
+    // Single byte read, -1 if nothing is pending.
+    int read() { uint8_t bite; return read( &bite, 1 ) == 1 ? bite : -1; }
+    size_t write(uint8_t bite) { return write( &bite, 1 ); }
+    size_t write(const char *str) { return write( (const uint8_t *)str, strlen(str) ); }
+
+    // Owner handle, set by WebSocketServer so readiness reports map back to a socket.
+    void *context() { return m_context; }
+    void setContext(void *context) { m_context = context; }
+
+private:
+    void *m_context;
+};
+
+// Accepts inbound connections for WebSocketServer.
+class WebSocketServerTransport {
+public:
+    virtual ~WebSocketServerTransport() {}
+
+    // Start listening for connections.
+    virtual void begin() = 0;
+
+    // Returns a newly accepted connection, or NULL if there is none.
+    virtual WebSocketTransport *accept() = 0;
+
+    // Hand back a connection returned by accept() once nothing refers to it.
+    virtual void release(WebSocketTransport *transport) = 0;
+
+    // Fill 'ready' with up to 'max' connections that have pending input or
+    // have hung up. Returns the count, or -1 if the backend can't tell, in
+    // which case the server checks every connection.
+    virtual int poll(WebSocketTransport **, int) { return -1; }
+
+    // Cut short a poll() that may be blocking, from another thread. Backends
+    // whose poll() never blocks needn't bother.
+    virtual void wake() {}
+};
+
+#endif
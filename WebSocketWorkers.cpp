@@ -0,0 +1,409 @@
+#include "WebSocketWorkers.h"
+
+#if WEBSOCKET_WORKERS
+
+#include "WebSocketServer.h"
+
+#include <unistd.h>
+
+//#define DEBUG 1
+
+WebSocketOutbox::WebSocketOutbox(WebSocketServerTransport *transport) :
+    m_references(1),
+    m_transport(transport),
+    m_head(NULL),
+    m_tail(NULL),
+    m_pending(false)
+{
+    pthread_mutex_init( &m_lock, NULL );
+}
+
+WebSocketOutbox::~WebSocketOutbox()
+{
+    pthread_mutex_destroy( &m_lock );
+}
+
+void WebSocketOutbox::retain()
+{
+    __atomic_add_fetch( &m_references, 1, __ATOMIC_RELAXED );
+}
+
+void WebSocketOutbox::release()
+{
+    if( __atomic_sub_fetch( &m_references, 1, __ATOMIC_ACQ_REL ) == 0 )
+        delete this;
+}
+
+bool WebSocketOutbox::post(WebSocketStrand *strand, byte opcode, const uint8_t *data, size_t length, bool close)
+{
+    Message *message = (Message *)malloc( offsetof(Message, data) + length );
+    if( !message )
+        return false;
+
+    message->next = NULL;
+    message->strand = strand;
+    message->close = close;
+    message->opcode = opcode;
+    message->length = length;
+    memcpy( message->data, data, length );
+
+    pthread_mutex_lock( &m_lock );
+    if( !m_transport )
+    {
+        pthread_mutex_unlock( &m_lock );
+        free( message );
+        return false;
+    }
+
+    strand->retain();
+    if( m_tail )
+        m_tail->next = message;
+    else
+        m_head = message;
+    m_tail = message;
+    __atomic_store_n( &m_pending, true, __ATOMIC_RELEASE );
+
+    // Under the lock, so the server can't go while we wake it.
+    m_transport->wake();
+    pthread_mutex_unlock( &m_lock );
+    return true;
+}
+
+bool WebSocketOutbox::deliver()
+{
+    // Checked without the lock, listen() comes here every time.
+    if( !__atomic_load_n( &m_pending, __ATOMIC_ACQUIRE ) )
+        return false;
+
+    pthread_mutex_lock( &m_lock );
+    Message *message = m_head;
+    m_head = m_tail = NULL;
+    m_pending = false;
+    pthread_mutex_unlock( &m_lock );
+
+    bool closed = false;
+    while( message )
+    {
+        Message *next = message->next;
+        InboundWebSocket *s = message->strand->socket();
+        if( s && s->status() == WebSocket::CONNECTED )
+        {
+            if( message->close )
+                s->close();
+            else
+                s->sendFrame( message->opcode, message->data, message->length );
+            closed |= !s->connected();
+        }
+
+        message->strand->release();
+        free( message );
+        message = next;
+    }
+    return closed;
+}
+
+void WebSocketOutbox::detach()
+{
+    pthread_mutex_lock( &m_lock );
+    Message *message = m_head;
+    m_head = m_tail = NULL;
+    m_transport = NULL;
+    pthread_mutex_unlock( &m_lock );
+
+    while( message )
+    {
+        Message *next = message->next;
+        message->strand->release();
+        free( message );
+        message = next;
+    }
+}
+
+bool WebSocketReply::sendFrame(byte opcode, const uint8_t *data, size_t length)
+{
+    if( __atomic_load_n( &m_strand->m_detached, __ATOMIC_ACQUIRE ) )
+        return false;
+    return m_strand->m_outbox->post( m_strand, opcode, data, length, false );
+}
+
+void WebSocketReply::close()
+{
+    if( !__atomic_load_n( &m_strand->m_detached, __ATOMIC_ACQUIRE ) )
+        m_strand->m_outbox->post( m_strand, 0, NULL, 0, true );
+}
+
+WebSocketStrand::WebSocketStrand(InboundWebSocket *socket, WebSocketOutbox *outbox, WebSocketWorkers *workers, WorkCallback *callback, void *opaque) :
+    m_references(1),
+    m_socket(socket),
+    m_outbox(outbox),
+    m_workers(workers),
+    m_callback(callback),
+    m_opaque(opaque),
+    m_detached(false),
+    m_head(NULL),
+    m_tail(NULL),
+    m_scheduled(false),
+    m_next(NULL)
+{
+    pthread_mutex_init( &m_lock, NULL );
+    m_outbox->retain();
+}
+
+WebSocketStrand::~WebSocketStrand()
+{
+    while( m_head )
+    {
+        Job *next = m_head->next;
+        free( m_head );
+        m_head = next;
+    }
+    m_outbox->release();
+    pthread_mutex_destroy( &m_lock );
+}
+
+void WebSocketStrand::retain()
+{
+    __atomic_add_fetch( &m_references, 1, __ATOMIC_RELAXED );
+}
+
+void WebSocketStrand::release()
+{
+    if( __atomic_sub_fetch( &m_references, 1, __ATOMIC_ACQ_REL ) == 0 )
+        delete this;
+}
+
+bool WebSocketStrand::post(byte opcode, const char *data, word length)
+{
+    // Copied and terminated, the receive buffer is reused as soon as we return.
+    Job *job = (Job *)malloc( offsetof(Job, data) + length + 1 );
+    if( !job )
+        return false;
+
+    job->next = NULL;
+    job->opcode = opcode;
+    job->length = length;
+    memcpy( job->data, data, length );
+    job->data[length] = '\0';
+
+    pthread_mutex_lock( &m_lock );
+    if( m_tail )
+        m_tail->next = job;
+    else
+        m_head = job;
+    m_tail = job;
+
+    // Only one worker at a time runs a strand, which keeps the order.
+    bool idle = !m_scheduled;
+    m_scheduled = true;
+    pthread_mutex_unlock( &m_lock );
+
+    if( idle )
+        m_workers->schedule( this, -1 );
+    return true;
+}
+
+void WebSocketStrand::detach()
+{
+    m_socket = NULL;
+    __atomic_store_n( &m_detached, true, __ATOMIC_RELEASE );
+}
+
+bool WebSocketStrand::run()
+{
+    for( byte x=0; x < WEBSOCKET_STRAND_BATCH; x++ )
+    {
+        pthread_mutex_lock( &m_lock );
+        Job *job = m_head;
+        if( !job )
+        {
+            m_scheduled = false;
+            pthread_mutex_unlock( &m_lock );
+            return false;
+        }
+        m_head = job->next;
+        if( !m_head )
+            m_tail = NULL;
+        pthread_mutex_unlock( &m_lock );
+
+        if( !__atomic_load_n( &m_detached, __ATOMIC_ACQUIRE ) )
+        {
+            WebSocketReply reply( this, job->opcode );
+            m_callback( reply, job->data, job->length, m_opaque );
+        }
+        free( job );
+    }
+
+    // Batch done; go to the back of the queue if there's more.
+    pthread_mutex_lock( &m_lock );
+    bool more = m_head != NULL;
+    if( !more )
+        m_scheduled = false;
+    pthread_mutex_unlock( &m_lock );
+    return more;
+}
+
+WebSocketWorkers::WebSocketWorkers(word threads) :
+    m_next(0),
+    m_running(false),
+    m_stopping(false),
+    m_queued(0)
+{
+    if( !threads )
+    {
+        long cpus = sysconf( _SC_NPROCESSORS_ONLN );
+        threads = cpus > 0 ? cpus : 1;
+    }
+
+    m_threadCount = threads;
+    m_workers = new Worker[ m_threadCount ];
+    for( word x=0; x < m_threadCount; x++ )
+    {
+        m_workers[x].pool = this;
+        m_workers[x].index = x;
+        m_workers[x].head = m_workers[x].tail = NULL;
+        pthread_mutex_init( &m_workers[x].lock, NULL );
+    }
+
+    pthread_mutex_init( &m_idleLock, NULL );
+    pthread_cond_init( &m_idle, NULL );
+}
+
+WebSocketWorkers::~WebSocketWorkers()
+{
+    stop();
+
+    // Strands nobody got round to.
+    for( word x=0; x < m_threadCount; x++ )
+    {
+        while( m_workers[x].head )
+        {
+            WebSocketStrand *strand = m_workers[x].head;
+            m_workers[x].head = strand->m_next;
+            strand->release();
+        }
+        pthread_mutex_destroy( &m_workers[x].lock );
+    }
+    delete[] m_workers;
+
+    pthread_cond_destroy( &m_idle );
+    pthread_mutex_destroy( &m_idleLock );
+}
+
+bool WebSocketWorkers::start()
+{
+    if( m_running )
+        return true;
+
+    m_stopping = false;
+    for( word x=0; x < m_threadCount; x++ )
+    {
+        if( pthread_create( &m_workers[x].thread, NULL, &run, &m_workers[x] ) != 0 )
+        {
+#ifdef DEBUG
+            Serial.println(F("Couldn't start a worker."));
+#endif
+            pthread_mutex_lock( &m_idleLock );
+            __atomic_store_n( &m_stopping, true, __ATOMIC_RELEASE );
+            pthread_cond_broadcast( &m_idle );
+            pthread_mutex_unlock( &m_idleLock );
+            for( word y=0; y < x; y++ )
+                pthread_join( m_workers[y].thread, NULL );
+            return false;
+        }
+    }
+
+    m_running = true;
+    return true;
+}
+
+void WebSocketWorkers::stop()
+{
+    if( !m_running )
+        return;
+
+    pthread_mutex_lock( &m_idleLock );
+    __atomic_store_n( &m_stopping, true, __ATOMIC_RELEASE );
+    pthread_cond_broadcast( &m_idle );
+    pthread_mutex_unlock( &m_idleLock );
+
+    for( word x=0; x < m_threadCount; x++ )
+        pthread_join( m_workers[x].thread, NULL );
+    m_running = false;
+}
+
+void WebSocketWorkers::schedule(WebSocketStrand *strand, int index)
+{
+    if( index < 0 )
+        index = __atomic_fetch_add( &m_next, 1, __ATOMIC_RELAXED ) % m_threadCount;
+
+    Worker &worker = m_workers[index];
+    strand->retain();
+    strand->m_next = NULL;
+
+    // Counted first, so a worker that takes it never sees the count go
+    // negative, and signalled under the lock, so one about to sleep can't
+    // miss it.
+    __atomic_add_fetch( &m_queued, 1, __ATOMIC_RELEASE );
+    pthread_mutex_lock( &worker.lock );
+    if( worker.tail )
+        worker.tail->m_next = strand;
+    else
+        worker.head = strand;
+    worker.tail = strand;
+    pthread_mutex_unlock( &worker.lock );
+
+    pthread_mutex_lock( &m_idleLock );
+    pthread_cond_signal( &m_idle );
+    pthread_mutex_unlock( &m_idleLock );
+}
+
+WebSocketStrand *WebSocketWorkers::take(word index)
+{
+    // Our own queue first, then steal from the others.
+    for( word x=0; x < m_threadCount; x++ )
+    {
+        Worker &worker = m_workers[( index + x ) % m_threadCount];
+        pthread_mutex_lock( &worker.lock );
+        WebSocketStrand *strand = worker.head;
+        if( strand )
+        {
+            worker.head = strand->m_next;
+            if( !worker.head )
+                worker.tail = NULL;
+        }
+        pthread_mutex_unlock( &worker.lock );
+
+        if( strand )
+        {
+            __atomic_sub_fetch( &m_queued, 1, __ATOMIC_RELAXED );
+            return strand;
+        }
+    }
+    return NULL;
+}
+
+void *WebSocketWorkers::run(void *context)
+{
+    Worker *worker = (Worker *)context;
+    WebSocketWorkers *pool = worker->pool;
+
+    while( !__atomic_load_n( &pool->m_stopping, __ATOMIC_ACQUIRE ) )
+    {
+        WebSocketStrand *strand = pool->take( worker->index );
+        if( strand )
+        {
+            if( strand->run() )
+                pool->schedule( strand, worker->index );
+            strand->release(); // The queue's reference.
+            continue;
+        }
+
+        pthread_mutex_lock( &pool->m_idleLock );
+        while( !pool->m_stopping && !__atomic_load_n( &pool->m_queued, __ATOMIC_ACQUIRE ) )
+            pthread_cond_wait( &pool->m_idle, &pool->m_idleLock );
+        pthread_mutex_unlock( &pool->m_idleLock );
+    }
+    return NULL;
+}
+
+#endif
@@ -0,0 +1,197 @@
+#include "WebSocketPlatform.h"
+#include "WebSocketWritable.h"
+
+#ifndef H_WEBSOCKETWORKERS
+#define H_WEBSOCKETWORKERS
+
+// Worker threads for slow data callbacks, built wherever there are POSIX
+// threads. Define WEBSOCKET_WORKERS as 0 or 1 to override.
+#ifndef WEBSOCKET_WORKERS
+#if defined(WEBSOCKET_HOST)
+#define WEBSOCKET_WORKERS 1
+#else
+#define WEBSOCKET_WORKERS 0
+#endif
+#endif
+
+#if WEBSOCKET_WORKERS
+
+#include <pthread.h>
+
+// Messages a worker handles for one connection before giving the others a turn.
+#ifndef WEBSOCKET_STRAND_BATCH
+#define WEBSOCKET_STRAND_BATCH 8
+#endif
+
+class InboundWebSocket;
+class WebSocketServerTransport;
+class WebSocketWorkers;
+class WebSocketStrand;
+
+// Frames sent from worker threads, waiting for the server's own thread to
+// write them out. Shared by a server and its connections' strands, so it
+// outlives whichever goes first.
+class WebSocketOutbox {
+public:
+    WebSocketOutbox(WebSocketServerTransport *transport);
+
+    void retain();
+    void release();
+
+    // Queue a frame, or a close if 'close' is set, for the strand's
+    // connection and wake the server. Returns false if the server is gone
+    // or there's no memory.
+    bool post(WebSocketStrand *strand, byte opcode, const uint8_t *data, size_t length, bool close);
+
+    // Server thread: write out what has been posted. Returns true if a
+    // connection was closed on the way.
+    bool deliver();
+
+    // Server thread: the server is going, drop what's posted from now on.
+    void detach();
+
+private:
+    typedef struct Message {
+        struct Message *next;
+        WebSocketStrand *strand;
+        bool close;
+        byte opcode;
+        size_t length;
+        uint8_t data[1];
+    } Message;
+
+    ~WebSocketOutbox();
+
+    int m_references;
+    pthread_mutex_t m_lock;
+    WebSocketServerTransport *m_transport; // NULL once detached.
+    Message *m_head, *m_tail;
+    bool m_pending; // Something posted since the last deliver().
+};
+
+// Answers the message a work callback was given. Frames are queued for the
+// connection's own server thread, and reach the client in the order sent,
+// after replies to earlier messages. Once the connection has closed they
+// are dropped.
+class WebSocketReply {
+public:
+    // Opcode of the message being handled, OPCODE_TEXT or OPCODE_BINARY.
+    byte opcode() { return m_opcode; }
+
+    bool send(const char *str, size_t length) { return sendFrame( WebSocketWritable::OPCODE_TEXT, (const uint8_t *)str, length ); }
+    bool sendBinary(const uint8_t *data, size_t length) { return sendFrame( WebSocketWritable::OPCODE_BINARY, data, length ); }
+    bool sendFrame(byte opcode, const uint8_t *data, size_t length);
+
+    // Close the connection, after what has been sent.
+    void close();
+
+private:
+    friend class WebSocketStrand;
+
+    WebSocketReply(WebSocketStrand *strand, byte opcode) : m_strand(strand), m_opcode(opcode) {}
+
+    WebSocketStrand *m_strand;
+    byte m_opcode;
+};
+
+// One connection's messages, run on the workers one at a time and in the
+// order they arrived.
+class WebSocketStrand {
+public:
+    typedef void WorkCallback(WebSocketReply &reply, char *data, word length, void *opaque);
+
+    WebSocketStrand(InboundWebSocket *socket, WebSocketOutbox *outbox, WebSocketWorkers *workers, WorkCallback *callback, void *opaque);
+
+    void retain();
+    void release();
+
+    // Server thread: copy a message and queue it for the workers.
+    bool post(byte opcode, const char *data, word length);
+
+    // Server thread: the connection is going. Messages not yet started are
+    // skipped, replies dropped.
+    void detach();
+
+    // Server thread: the connection, or NULL once detached.
+    InboundWebSocket *socket() { return m_socket; }
+
+private:
+    friend class WebSocketWorkers;
+    friend class WebSocketReply;
+
+    typedef struct Job {
+        struct Job *next;
+        byte opcode;
+        word length;
+        char data[1];
+    } Job;
+
+    ~WebSocketStrand();
+
+    // Worker thread: handle up to WEBSOCKET_STRAND_BATCH messages. Returns
+    // true if more are waiting.
+    bool run();
+
+    int m_references;
+    InboundWebSocket *m_socket;
+    WebSocketOutbox *m_outbox;
+    WebSocketWorkers *m_workers;
+    WorkCallback *m_callback;
+    void *m_opaque;
+    bool m_detached;
+
+    pthread_mutex_t m_lock;
+    Job *m_head, *m_tail;
+    bool m_scheduled; // On a worker's queue, or being run.
+
+    WebSocketStrand *m_next; // Worker queue link.
+};
+
+// Thread pool for work callbacks. Each worker has its own queue of strands
+// with messages waiting, and takes from the others' when it runs dry, so a
+// worker stuck in a slow callback doesn't hold up other connections.
+class WebSocketWorkers {
+public:
+    // 'threads' workers, 0 for one per online CPU.
+    WebSocketWorkers(word threads = 0);
+    ~WebSocketWorkers();
+
+    // Start and stop the threads. Work queued meanwhile waits for start().
+    bool start();
+    void stop();
+
+    word threadCount() { return m_threadCount; }
+
+private:
+    friend class WebSocketStrand;
+
+    typedef struct {
+        WebSocketWorkers *pool;
+        word index;
+        pthread_t thread;
+        pthread_mutex_t lock;
+        WebSocketStrand *head, *tail;
+    } Worker;
+
+    Worker *m_workers;
+    word m_threadCount;
+    unsigned m_next; // Queue the next new strand goes to.
+    bool m_running;
+    bool m_stopping;
+
+    // Strands queued, and where idle workers wait for more.
+    int m_queued;
+    pthread_mutex_t m_idleLock;
+    pthread_cond_t m_idle;
+
+    // Queue a strand, taking a reference, on worker 'index' or, if that's
+    // negative, on each worker in turn.
+    void schedule(WebSocketStrand *strand, int index);
+    WebSocketStrand *take(word index);
+
+    static void *run(void *context);
+};
+
+#endif
+
+#endif
@@ -1,23 +1,195 @@
 #include "WebSocketWritable.h"
 #include "WebSocket.h"
 
-word WebSocketWritable::printf(const char *format, ...)
+#include <stdio.h>
+
+#if WEBSOCKET_PRINTF_STREAM
+// printf() output on its way out as fragments, a slab at a time. The last
+// slab is held back until the end, so it can go as the final fragment.
+typedef struct {
+        WebSocketWritable *to;
+        uint8_t *buffer;
+        word capacity;
+        word length;
+        bool started, failed;
+        frame_length_t sent;
+} FormattedMessage;
+
+static void sendFormatted(FormattedMessage *message, bool final)
+{
+        if( message->failed )
+            return;
+
+        byte opcode = message->started ? WebSocketWritable::OPCODE_CONTINUATION : WebSocketWritable::OPCODE_TEXT;
+        message->started = true;
+        if( message->to->sendFragment( opcode, message->buffer, message->length, final ) )
+            message->sent += message->length;
+        else
+            message->failed = true;
+        message->length = 0;
+}
+
+static void appendFormatted(FormattedMessage *message, const char *data, size_t length)
+{
+        while( length )
+        {
+            if( message->length == message->capacity )
+                sendFormatted( message, false );
+
+            size_t piece = message->capacity - message->length;
+            if( piece > length )
+                piece = length;
+            memcpy( message->buffer + message->length, data, piece );
+            message->length += piece;
+            data += piece;
+            length -= piece;
+        }
+}
+
+#if defined(__AVR__)
+static int putFormatted(char c, FILE *stream)
+{
+        appendFormatted( (FormattedMessage *)fdev_get_udata( stream ), &c, 1 );
+        return 0;
+}
+#else
+static ssize_t writeFormatted(void *cookie, const char *data, size_t length)
+{
+        appendFormatted( (FormattedMessage *)cookie, data, length );
+        return length;
+}
+#endif
+#endif
+
+frame_length_t WebSocketWritable::printf(const char *format, ...)
 {
-        // Re(ab)use the 'frame' buffer to conserve RAM:
         va_list ap;
         va_start(ap, format);
-        frame.length = vsnprintf(frame.data, frameCapacity, format, ap);
+        frame_length_t sent = vprintf(format, ap, false);
         va_end(ap);
-        return send(frame.data, frame.length);
+        return sent;
 }
 
-word WebSocketWritable::printf_P(const __FlashStringHelper *format, ...)
+frame_length_t WebSocketWritable::printf_P(const __FlashStringHelper *format, ...)
 {
-        // Re(ab)use the 'frame' buffer to conserve RAM:
         va_list ap;
         va_start(ap, format);
-        frame.length = vsnprintf_P(frame.data, frameCapacity, (const char *)format, ap);
+        frame_length_t sent = vprintf((const char *)format, ap, true);
         va_end(ap);
-        return send(frame.data, frame.length);
+        return sent;
+}
+
+frame_length_t WebSocketWritable::vprintf(const char *format, va_list ap, bool progmem)
+{
+        // Borrow a slab to format into, rather than a buffer per socket:
+        WebSocketBufferPool *pool = bufferPool();
+        char *buffer = (char *)pool->acquire();
+        if( !buffer )
+            return 0;
+
+#if WEBSOCKET_PRINTF_STREAM
+        va_list again;
+        va_copy(again, ap);
+#endif
+
+        word capacity = WEBSOCKET_SLAB_FRAME(pool->slabSize()) + 1; // The frame size, and a terminator.
+        int length = progmem ? vsnprintf_P(buffer, capacity, format, ap) : vsnprintf(buffer, capacity, format, ap);
+
+        frame_length_t sent = 0;
+        if( length >= capacity )
+        {
+#if WEBSOCKET_PRINTF_STREAM
+            // Too long for one frame: format it again, sending each slab's
+            // worth as it fills.
+            FormattedMessage message = { this, (uint8_t *)buffer, capacity, 0, false, false, 0 };
+#if defined(__AVR__)
+            FILE stream;
+            fdev_setup_stream( &stream, putFormatted, NULL, _FDEV_SETUP_WRITE );
+            fdev_set_udata( &stream, &message );
+            if( progmem )
+                vfprintf_P( &stream, format, again );
+            else
+                vfprintf( &stream, format, again );
+#else
+            cookie_io_functions_t io = { NULL, writeFormatted, NULL, NULL };
+            FILE *stream = fopencookie( &message, "w", io );
+            if( stream )
+            {
+                // Unbuffered, so stdio doesn't allocate a buffer of its own.
+                setvbuf( stream, NULL, _IONBF, 0 );
+                vfprintf( stream, format, again );
+                fclose( stream );
+            }
+#endif
+            if( message.started )
+            {
+                sendFormatted( &message, true );
+                sent = message.failed ? 0 : message.sent;
+            }
+            else if( message.length )
+                sent = send(buffer, message.length); // Just fitted after all.
+#else
+            sent = send(buffer, capacity - 1); // Truncated.
+#endif
+        }
+        else if( length > 0 )
+            sent = send(buffer, length);
+
+#if WEBSOCKET_PRINTF_STREAM
+        va_end(again);
+#endif
+        pool->release( (uint8_t *)buffer );
+        return sent;
+}
+
+bool WebSocketWritable::beginPrint(char **buffer, char **end)
+{
+        WebSocketBufferPool *pool = bufferPool();
+        *buffer = (char *)pool->acquire();
+        if( !*buffer )
+            return false;
+
+        // As for printf(), leaving room for a terminator.
+        *end = *buffer + WEBSOCKET_SLAB_FRAME(pool->slabSize());
+        return true;
 }
 
+frame_length_t WebSocketWritable::endPrint(char *buffer, char *written)
+{
+        frame_length_t sent = 0;
+        if( written && written > buffer )
+            sent = send(buffer, written - buffer);
+#ifdef DEBUG
+        else if( !written )
+            Serial.println(F("print() text too long for a frame."));
+#endif
+
+        bufferPool()->release( (uint8_t *)buffer );
+        return sent;
+}
+
+byte WebSocketWritable::encodeHeader(uint8_t *header, byte opcode, frame_length_t length)
+{
+    header[0] = opcode;
+    if( length < 126 )
+    {
+        header[1] = length; // Length of data in a byte
+        return 2;
+    }
+
+    if( length < 0x10000 )
+    {
+        header[1] = 126; // 16-bit length follows, network byte order
+        header[2] = length >> 8;
+        header[3] = length;
+        return 4;
+    }
+
+    header[1] = 127; // 64-bit length follows, network byte order
+    for( byte i = 9; i >= 2; i-- )
+    {
+        header[i] = length;
+        length >>= 8;
+    }
+    return 10;
+}
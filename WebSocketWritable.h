@@ -1,15 +1,138 @@
-#include <Arduino.h>
+#include "WebSocketPlatform.h"
+#include "WebSocketTransport.h"
+#include "WebSocketBufferPool.h"
+#include "WebSocketFormat.h"
 #include <stdarg.h>
 
 #ifndef H_WEBSOCKETWRITABLE
 #define H_WEBSOCKETWRITABLE
 
+// Payload lengths. The protocol allows 63 bits; AVR settles for 32 to keep
+// the arithmetic cheap, and refuses anything longer.
+#if defined(__AVR__)
+typedef uint32_t frame_length_t;
+#else
+typedef uint64_t frame_length_t;
+#endif
+
+// Program memory has to be copied out a piece at a time, this many bytes on
+// the stack, on AVR (and ESP8266, whose flash wants aligned reads). Elsewhere
+// it's ordinary memory and payloads are sent from where they lie.
+#ifndef WEBSOCKET_FLASH_CHUNK
+#if defined(__AVR__) || defined(ESP8266)
+#define WEBSOCKET_FLASH_CHUNK 64
+#endif
+#endif
+
+// printf() text too long for a slab goes out as a fragmented message, a
+// slab at a time, where the C library will hand over its output as it's
+// produced: avr-libc through a stream's put function, glibc through
+// fopencookie(). Elsewhere it's cut short at the frame size.
+#ifndef WEBSOCKET_PRINTF_STREAM
+#if defined(__AVR__) || defined(__GLIBC__)
+#define WEBSOCKET_PRINTF_STREAM 1
+#else
+#define WEBSOCKET_PRINTF_STREAM 0
+#endif
+#endif
+
 // Implement a way to "printf" to the socket. Also provided is a PSTR-able method for additional (and delicious) RAM savings.
 class WebSocketWritable {
 public:
-    virtual byte send(char *str, word length);
-    word printf(const char *format, ...);
-    word printf_P(const __FlashStringHelper *format, ...);
+    typedef enum {OPCODE_CONTINUATION=0x0, OPCODE_TEXT=0x1, OPCODE_BINARY=0x2, OPCODE_CLOSE=0x8, OPCODE_PING=0x9, OPCODE_PONG=0xA} Opcode;
+
+    // Sockets and servers are derived from (InboundWebSocket,
+    // WebSocketServerT), so whatever pointer they're deleted through, the
+    // whole object goes.
+    virtual ~WebSocketWritable() {}
+
+    // Embeds the concatenation of 'count' pieces (at most WEBSOCKET_MAX_IOV - 1)
+    // in one frame and sends it with a single write where the transport allows.
+    // Returns the count of payload bytes sent.
+    virtual frame_length_t sendFrame(byte opcode, const WebSocketIovec *iov, byte count) = 0;
+
+    frame_length_t sendFrame(byte opcode, const uint8_t *data, frame_length_t length) {
+        WebSocketIovec iov = { data, (size_t)length };
+        return sendFrame( opcode, &iov, 1 );
+    }
+
+    // Text frame.
+    frame_length_t send(const char *str, frame_length_t length) { return sendFrame( OPCODE_TEXT, (const uint8_t *)str, length ); }
+
+    // Frame gathered from several buffers, e.g. a record header and its body,
+    // without copying them together first.
+    frame_length_t send(const WebSocketIovec *iov, byte count, byte opcode = OPCODE_TEXT) { return sendFrame( opcode, iov, count ); }
+
+    // Binary frame, no encoding or copying needed.
+    frame_length_t sendBinary(const uint8_t *data, frame_length_t length) { return sendFrame( OPCODE_BINARY, data, length ); }
+
+    // Frame with its payload in program memory, a PSTR() or PROGMEM array.
+    // It's read out WEBSOCKET_FLASH_CHUNK bytes at a time as it's written,
+    // so it needn't fit in RAM or in the frame size.
+#ifdef WEBSOCKET_FLASH_CHUNK
+    virtual frame_length_t sendFrame_P(byte opcode, const uint8_t *data, frame_length_t length) = 0;
+#else
+    frame_length_t sendFrame_P(byte opcode, const uint8_t *data, frame_length_t length) { return sendFrame( opcode, data, length ); }
+#endif
+    frame_length_t send_P(const __FlashStringHelper *str, frame_length_t length) { return sendFrame_P( OPCODE_TEXT, (const uint8_t *)str, length ); }
+    frame_length_t sendBinary_P(const uint8_t *data, frame_length_t length) { return sendFrame_P( OPCODE_BINARY, data, length ); }
+
+    // Formatted text message. The text is built in a slab borrowed from
+    // bufferPool(), and sent as one frame if it fits; if not, it's sent a
+    // slab at a time as fragments of one message (see
+    // WEBSOCKET_PRINTF_STREAM), so reports of any length take no more
+    // memory. Nothing is sent if no slab is free. Returns the count of
+    // bytes sent, 0 if the message didn't get through.
+    frame_length_t printf(const char *format, ...);
+    frame_length_t printf_P(const __FlashStringHelper *format, ...);
+
+    // Formatted text message with the format parsed at compile time (see
+    // WebSocketFormat.h), written straight into the slab by the emitters it
+    // calls for:
+    //
+    //   ws.print( WEBSOCKET_FORMAT("temp=%d hum=%d"), t, h );
+    //   ws.print<"temp=%d hum=%d">( t, h ); // C++20
+    //
+    // Text too long for one frame isn't sent. Returns the count of bytes
+    // sent, 0 if the message didn't get through.
+    template<char... C, typename... Args>
+    frame_length_t print(WebSocketFormat<C...>, const Args &... args)
+    {
+        typedef WebSocketFormatStep<WebSocketFormat<C...>, 0> Steps;
+        static_assert( Steps::ARGUMENTS == sizeof...(Args), "print(): the format and the arguments don't match" );
+
+        char *buffer, *end;
+        if( !beginPrint( &buffer, &end ) )
+            return 0;
+        return endPrint( buffer, Steps::emit( buffer, end, args... ) );
+    }
+
+#ifdef WEBSOCKET_FORMAT_LITERALS
+    template<WebSocketFixedString Format, typename... Args>
+    frame_length_t print(const Args &... args) { return print( typename WebSocketFormatOf<Format>::type(), args... ); }
+#endif
+
+    // Send one frame of a fragmented message: the first with OPCODE_TEXT or
+    // OPCODE_BINARY, the rest with OPCODE_CONTINUATION, 'final' set on the
+    // last. Returns false if it didn't go out, and the connection is closed
+    // if it was partway through the message.
+    virtual bool sendFragment(byte opcode, const uint8_t *data, size_t length, bool final) = 0;
+
+    virtual WebSocketBufferPool *bufferPool() = 0;
+
+protected:
+    // Write an unmasked frame header for 'length' payload bytes into 'header'
+    // (WEBSOCKET_MAX_HEADER bytes). 'opcode' includes the FIN bit. Returns
+    // the header's length.
+    static byte encodeHeader(uint8_t *header, byte opcode, frame_length_t length);
+
+private:
+    frame_length_t vprintf(const char *format, va_list ap, bool progmem);
+
+    // print(): borrow a slab to format into, then send what was written
+    // up to 'written' (NULL if it didn't fit) and give the slab back.
+    bool beginPrint(char **buffer, char **end);
+    frame_length_t endPrint(char *buffer, char *written);
 };
 
 #endif
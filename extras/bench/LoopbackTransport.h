@@ -0,0 +1,163 @@
+#ifndef H_LOOPBACKTRANSPORT
+#define H_LOOPBACKTRANSPORT
+
+#include <time.h>
+
+#include "WebSocketTransport.h"
+
+static inline unsigned long long nanos()
+{
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// In-memory stand-in for a network connection. Reads replay 'count' copies of
+// a pre-encoded byte stream, writes are counted and discarded. Each call can be
+// charged a fixed cost to model an SPI transaction or a syscall.
+class LoopbackTransport : public WebSocketTransport {
+public:
+    LoopbackTransport() :
+        m_data(NULL), m_length(0), m_offset(0), m_remaining(0),
+        m_segment(1460), m_callCost(0), m_reads(0), m_written(0), m_open(true) {}
+
+    // Replay 'length' bytes at 'data', 'count' times over.
+    void feed(const uint8_t *data, size_t length, unsigned long count)
+    {
+        m_data = data;
+        m_length = length;
+        m_offset = 0;
+        m_remaining = (unsigned long long)length * count;
+    }
+
+    // Largest chunk handed out by one read, like a TCP segment.
+    void setSegment(size_t segment) { m_segment = segment; }
+
+    // Busy-wait this many nanoseconds on every read and write.
+    void setCallCost(unsigned long ns) { m_callCost = ns; }
+
+    unsigned long reads() { return m_reads; }
+    unsigned long long written() { return m_written; }
+
+    bool connect(const char *, word) { m_open = true; return true; }
+    bool connected() { return m_open; }
+    int available() { return m_remaining > 0x7fff ? 0x7fff : (int)m_remaining; }
+
+    int read(uint8_t *buffer, size_t length)
+    {
+        m_reads++;
+        charge();
+        if( !m_remaining )
+            return 0;
+
+        if( length > m_segment )
+            length = m_segment;
+        if( length > m_remaining )
+            length = m_remaining;
+
+        for( size_t done = 0; done < length; )
+        {
+            size_t chunk = m_length - m_offset;
+            if( chunk > length - done )
+                chunk = length - done;
+            memcpy( buffer + done, m_data + m_offset, chunk );
+            done += chunk;
+            m_offset = ( m_offset + chunk ) % m_length;
+        }
+        m_remaining -= length;
+        return length;
+    }
+
+    size_t write(const uint8_t *, size_t length)
+    {
+        charge();
+        m_written += length;
+        return length;
+    }
+
+    void stop() { m_open = false; }
+
+    // Back to a fresh, open connection.
+    void reset()
+    {
+        feed( NULL, 0, 0 );
+        m_reads = 0;
+        m_written = 0;
+        m_open = true;
+    }
+
+private:
+    void charge()
+    {
+        if( !m_callCost )
+            return;
+        unsigned long long start = nanos();
+        while( nanos() - start < m_callCost )
+            ;
+    }
+
+    const uint8_t *m_data;
+    size_t m_length, m_offset;
+    unsigned long long m_remaining;
+    size_t m_segment;
+    unsigned long m_callCost;
+    unsigned long m_reads;
+    unsigned long long m_written;
+    bool m_open;
+};
+
+// Listener handing out LoopbackTransports from a fixed table, each primed
+// with 'count' copies of a byte stream (a client's upgrade request, say).
+class LoopbackServerTransport : public WebSocketServerTransport {
+public:
+    LoopbackServerTransport(LoopbackTransport *clients, size_t size) :
+        m_clients(clients), m_inUse(new bool[size]), m_size(size), m_data(NULL), m_length(0), m_pending(0)
+    {
+        memset( m_inUse, 0, size );
+    }
+    ~LoopbackServerTransport() { delete[] m_inUse; }
+
+    // Let 'connections' more clients in, each sending 'length' bytes at 'data'.
+    void arrive(const uint8_t *data, size_t length, unsigned long connections)
+    {
+        m_data = data;
+        m_length = length;
+        m_pending = connections;
+    }
+
+    void begin() {}
+
+    WebSocketTransport *accept()
+    {
+        if( !m_pending )
+            return NULL;
+
+        for( size_t x=0; x < m_size; x++ )
+        {
+            if( m_inUse[x] )
+                continue;
+
+            m_inUse[x] = true;
+            m_pending--;
+            m_clients[x].reset();
+            m_clients[x].feed( m_data, m_length, 1 );
+            return &m_clients[x];
+        }
+        return NULL;
+    }
+
+    void release(WebSocketTransport *transport)
+    {
+        m_inUse[(LoopbackTransport *)transport - m_clients] = false;
+    }
+
+private:
+    LoopbackTransport *m_clients;
+    bool *m_inUse;
+    size_t m_size;
+    const uint8_t *m_data;
+    size_t m_length;
+    unsigned long m_pending;
+};
+
+#endif
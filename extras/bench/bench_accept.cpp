@@ -0,0 +1,53 @@
+// Handshake hashing benchmark: time per Sec-WebSocket-Accept value, through
+// the general SHA-1 stream and through the fixed-length websocket_accept().
+//
+//   make bench_accept && ./bench_accept
+
+#include "WebSocketAccept.h"
+#include "LoopbackTransport.h"
+#include "sha1.h"
+#include "Base64.h"
+
+#define ROUNDS 200000
+
+static void streamed(char *accept, const char *key)
+{
+    Sha1.init();
+    Sha1.print( key );
+    Sha1.print( "258EAFA5-E914-47DA-95CA-C5AB0DC85B11" );
+    base64_encode( accept, (char*)Sha1.result(), 20 );
+}
+
+int main()
+{
+    char key[WEBSOCKET_KEY_LENGTH + 1] = "dGhlIHNhbXBsZSBub25jZQ==";
+    char accept[WEBSOCKET_ACCEPT_LENGTH + 1];
+    char expected[WEBSOCKET_ACCEPT_LENGTH + 1];
+
+    streamed( expected, key );
+    websocket_accept( accept, key );
+    if( strcmp( accept, expected ) != 0 )
+    {
+        printf( "mismatch: %s != %s\n", accept, expected );
+        return 1;
+    }
+
+    printf( "%12s %12s\n", "path", "ns/key" );
+
+    unsigned long long start = nanos();
+    for( unsigned long x=0; x < ROUNDS; x++ )
+    {
+        key[x % 22] = 'A' + x % 26; // Defeat any hoisting.
+        streamed( accept, key );
+    }
+    printf( "%12s %12.1f\n", "Sha1Class", (double)( nanos() - start ) / ROUNDS );
+
+    start = nanos();
+    for( unsigned long x=0; x < ROUNDS; x++ )
+    {
+        key[x % 22] = 'A' + x % 26;
+        websocket_accept( accept, key );
+    }
+    printf( "%12s %12.1f\n", "fixed", (double)( nanos() - start ) / ROUNDS );
+    return 0;
+}
@@ -0,0 +1,125 @@
+// Base64 benchmark: encode and decode throughput of Base64.cpp against the
+// byte-at-a-time codec it replaced, for handshake keys up to payload sizes.
+//
+//   make bench_base64 && ./bench_base64
+
+#include "Base64.h"
+#include "LoopbackTransport.h"
+
+// The previous implementation, kept here as the baseline.
+namespace previous {
+
+static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+static unsigned char lookup(char c)
+{
+    for( int i = 0; i < 64; i++ )
+        if( alphabet[i] == c )
+            return i;
+    return -1;
+}
+
+static int encode(char *output, char *input, int inputLen)
+{
+    int i = 0, encLen = 0;
+    unsigned char a3[3], a4[4];
+    while( inputLen-- )
+    {
+        a3[i++] = *(input++);
+        if( i == 3 )
+        {
+            a4[0] = (a3[0] & 0xfc) >> 2;
+            a4[1] = ((a3[0] & 0x03) << 4) + ((a3[1] & 0xf0) >> 4);
+            a4[2] = ((a3[1] & 0x0f) << 2) + ((a3[2] & 0xc0) >> 6);
+            a4[3] = (a3[2] & 0x3f);
+            for( i = 0; i < 4; i++ )
+                output[encLen++] = alphabet[a4[i]];
+            i = 0;
+        }
+    }
+    // (Sizes below are multiples of 3, so no tail.)
+    output[encLen] = '\0';
+    return encLen;
+}
+
+static int decode(char *output, char *input, int inputLen)
+{
+    int i = 0, decLen = 0;
+    unsigned char a3[3], a4[4];
+    while( inputLen-- )
+    {
+        if( *input == '=' )
+            break;
+        a4[i++] = *(input++);
+        if( i == 4 )
+        {
+            for( i = 0; i < 4; i++ )
+                a4[i] = lookup( a4[i] );
+            a3[0] = (a4[0] << 2) + ((a4[1] & 0x30) >> 4);
+            a3[1] = ((a4[1] & 0xf) << 4) + ((a4[2] & 0x3c) >> 2);
+            a3[2] = ((a4[2] & 0x3) << 6) + a4[3];
+            for( i = 0; i < 3; i++ )
+                output[decLen++] = a3[i];
+            i = 0;
+        }
+    }
+    output[decLen] = '\0';
+    return decLen;
+}
+
+}
+
+static int strictDecode(char *output, char *input, int inputLen)
+{
+    return base64_decode_strict( output, input, inputLen );
+}
+
+typedef int (*Codec)(char *, char *, int);
+
+static double run(Codec codec, char *output, char *input, int length, size_t bytes)
+{
+    unsigned long rounds = 1 + ( 64UL << 20 ) / bytes;
+    unsigned long long start = nanos();
+    for( unsigned long x=0; x < rounds; x++ )
+    {
+        codec( output, input, length );
+        __asm__ __volatile__( "" : : "r"(output) : "memory" );
+    }
+    return (double)bytes * rounds * 1000.0 / ( nanos() - start );
+}
+
+int main()
+{
+    static const int sizes[] = { 18, 120, 1023, 16383, 65535 };
+
+    printf( "%8s %12s %12s %12s %12s %12s\n", "bytes", "enc old", "enc MB/s", "dec old", "dec MB/s", "strict MB/s" );
+    for( size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++ )
+    {
+        int length = sizes[s];
+        char *raw = (char *)malloc( length + 1 );
+        char *text = (char *)malloc( base64_enc_len( length ) + 1 );
+        char *scratch = (char *)malloc( base64_enc_len( length ) + 1 );
+        for( int i = 0; i < length; i++ )
+            raw[i] = rand();
+        int textLength = base64_enc_len( length );
+
+        double encOld = run( previous::encode, scratch, raw, length, length );
+        double enc = run( base64_encode, scratch, raw, length, length );
+        base64_encode( text, raw, length );
+        double decOld = run( previous::decode, scratch, text, textLength, length );
+        double dec = run( base64_decode, scratch, text, textLength, length );
+        double strict = run( strictDecode, scratch, text, textLength, length );
+
+        if( base64_decode_strict( scratch, text, textLength ) != length || memcmp( scratch, raw, length ) )
+        {
+            printf( "round trip failed at %d bytes\n", length );
+            return 1;
+        }
+
+        printf( "%8d %12.1f %12.1f %12.1f %12.1f %12.1f\n", length, encOld, enc, decOld, dec, strict );
+        free( raw );
+        free( text );
+        free( scratch );
+    }
+    return 0;
+}
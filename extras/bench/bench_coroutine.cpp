@@ -0,0 +1,118 @@
+// Coroutine benchmark: CPU time per message handed to a coroutine waiting in
+// co_await receive(), against the same messages through a data callback,
+// and the cost of starting and finishing a coroutine with a pooled frame.
+//
+//   make bench_coroutine && ./bench_coroutine
+
+#include "WebSocket.h"
+#include "LoopbackTransport.h"
+
+#if WEBSOCKET_COROUTINES
+
+#define FRAME_CAPACITY 1024
+#define MESSAGES 1000000UL
+
+// Exposes the state setter so frames are parsed without a handshake.
+class BenchSocket : public WebSocket {
+public:
+    BenchSocket(WebSocketTransport *transport) : WebSocket(transport, FRAME_CAPACITY) { setStatus( CONNECTED ); }
+};
+
+static unsigned long received;
+static unsigned long long bytes;
+
+static void onData(WebSocket &, char *, word length, void *)
+{
+    received++;
+    bytes += length;
+}
+
+static WebSocketTask consume(WebSocket &socket)
+{
+    while( WebSocketMessage message = co_await socket.receive() )
+    {
+        received++;
+        bytes += message.length;
+    }
+}
+
+static WebSocketTask nothing(unsigned long *count)
+{
+    (*count)++;
+    co_return;
+}
+
+// A masked text frame, as a browser would send it.
+static size_t encodeFrame(uint8_t *out, size_t payloadLength)
+{
+    static const uint8_t mask[4] = { 0x37, 0xfa, 0x21, 0x3d };
+    size_t n = 0;
+    out[n++] = 0x81;
+    out[n++] = 0x80 | payloadLength;
+    memcpy( out + n, mask, 4 );
+    n += 4;
+    for( size_t i = 0; i < payloadLength; i++ )
+        out[n++] = ( 'a' + i % 26 ) ^ mask[i % 4];
+    return n;
+}
+
+static double run(bool coroutine)
+{
+    uint8_t encoded[64];
+    size_t length = encodeFrame( encoded, 16 );
+
+    LoopbackTransport transport;
+    transport.feed( encoded, length, MESSAGES );
+    BenchSocket ws( &transport );
+    if( coroutine )
+        consume( ws );
+    else
+        ws.registerDataCallback( &onData );
+
+    received = 0;
+    unsigned long long start = nanos();
+    while( received < MESSAGES )
+        ws.listen();
+    unsigned long long elapsed = nanos() - start;
+
+    ws.close(); // Lets the coroutine finish.
+    return (double)elapsed / MESSAGES;
+}
+
+int main()
+{
+    // Warm up, then take the best of a few runs.
+    double callback = 1e9, coroutine = 1e9;
+    for( int pass = 0; pass < 5; pass++ )
+    {
+        double ns = run( false );
+        if( ns < callback )
+            callback = ns;
+        ns = run( true );
+        if( ns < coroutine )
+            coroutine = ns;
+    }
+
+    unsigned long started = 0;
+    unsigned long long start = nanos();
+    for( unsigned long x = 0; x < MESSAGES; x++ )
+        nothing( &started );
+    double spawn = (double)( nanos() - start ) / MESSAGES;
+
+    printf( "%-28s %8.1f ns/msg\n", "data callback", callback );
+    printf( "%-28s %8.1f ns/msg\n", "co_await receive()", coroutine );
+    printf( "%-28s %8.1f ns\n", "coroutine start and finish", spawn );
+    return started == MESSAGES ? 0 : 1;
+}
+
+#else
+
+#include <stdio.h>
+
+int main()
+{
+    printf( "Coroutines need C++20.\n" );
+    return 0;
+}
+
+#endif
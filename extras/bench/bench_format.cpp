@@ -0,0 +1,91 @@
+// Formatting benchmark: CPU time per telemetry message sent with printf(),
+// which goes through vsnprintf(), against print() with the same format
+// parsed at compile time, and the formatting alone, into a buffer.
+//
+//   make bench_format && ./bench_format
+
+#include "WebSocket.h"
+#include "LoopbackTransport.h"
+
+#define FRAME_CAPACITY 256
+#define MESSAGES 2000000UL
+
+// Exposes the state setter so frames go out without a handshake.
+class BenchSocket : public WebSocket {
+public:
+    BenchSocket(WebSocketTransport *transport) : WebSocket(transport, FRAME_CAPACITY) { setStatus( CONNECTED ); }
+};
+
+// Readings that change from message to message, as a sensor's would.
+static int temperature(unsigned long x) { return 180 + (int)( x % 97 ) - 48; }
+static unsigned humidity(unsigned long x) { return 30 + x % 61; }
+static double voltage(unsigned long x) { return 3.3 - ( x % 1000 ) * 0.0001; }
+
+typedef enum { PRINTF, PRINT_MACRO, PRINT_LITERAL, SNPRINTF, EMIT } Method;
+
+static double run(Method method)
+{
+    LoopbackTransport transport;
+    BenchSocket ws( &transport );
+    char buffer[128];
+    unsigned long long bytes = 0;
+
+    unsigned long long start = nanos();
+    for( unsigned long x = 0; x < MESSAGES; x++ )
+    {
+        int t = temperature( x );
+        unsigned h = humidity( x );
+        double v = voltage( x );
+        switch( method )
+        {
+        case PRINTF:
+            bytes += ws.printf( "temp=%d hum=%u v=%.3f", t, h, v );
+            break;
+        case PRINT_MACRO:
+            bytes += ws.print( WEBSOCKET_FORMAT("temp=%d hum=%u v=%.3f"), t, h, v );
+            break;
+        case PRINT_LITERAL:
+#ifdef WEBSOCKET_FORMAT_LITERALS
+            bytes += ws.print<"temp=%d hum=%u v=%.3f">( t, h, v );
+#endif
+            break;
+        case SNPRINTF:
+            bytes += snprintf( buffer, sizeof(buffer), "temp=%d hum=%u v=%.3f", t, h, v );
+            break;
+        case EMIT:
+            bytes += WebSocketFormatStep<decltype(WEBSOCKET_FORMAT("temp=%d hum=%u v=%.3f")), 0>::emit( buffer, buffer + sizeof(buffer), t, h, v ) - buffer;
+            break;
+        }
+    }
+    unsigned long long elapsed = nanos() - start;
+
+    if( !bytes )
+        return 0;
+    return (double)elapsed / MESSAGES;
+}
+
+int main()
+{
+    static const struct { Method method; const char *name; } methods[] = {
+        { PRINTF, "printf()" },
+        { PRINT_MACRO, "print(WEBSOCKET_FORMAT())" },
+        { PRINT_LITERAL, "print<\"...\">()" },
+        { SNPRINTF, "snprintf() only" },
+        { EMIT, "compiled format only" },
+    };
+
+    // Warm up, then take the best of a few runs.
+    for( size_t m = 0; m < sizeof(methods) / sizeof(methods[0]); m++ )
+    {
+        double best = 1e9;
+        for( int pass = 0; pass < 5; pass++ )
+        {
+            double ns = run( methods[m].method );
+            if( ns < best )
+                best = ns;
+        }
+        if( best )
+            printf( "%-28s %8.1f ns/msg\n", methods[m].name, best );
+    }
+    return 0;
+}
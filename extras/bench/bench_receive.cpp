@@ -0,0 +1,76 @@
+// Receive path benchmark: CPU time per inbound message for a range of frame
+// sizes, fed through a LoopbackTransport.
+//
+//   make bench_receive && ./bench_receive [call cost in ns]
+
+#include "WebSocket.h"
+#include "LoopbackTransport.h"
+
+#define FRAME_CAPACITY 1024
+
+// Exposes the state setter so frames are parsed without a handshake.
+class BenchSocket : public WebSocket {
+public:
+    BenchSocket(WebSocketTransport *transport) : WebSocket(transport, FRAME_CAPACITY) { setStatus( CONNECTED ); }
+};
+
+static unsigned long received;
+
+static void onData(WebSocket &, char *, word, void *)
+{
+    received++;
+}
+
+// A masked text frame, as a browser would send it.
+static size_t encodeFrame(uint8_t *out, size_t payloadLength)
+{
+    static const uint8_t mask[4] = { 0x37, 0xfa, 0x21, 0x3d };
+    size_t n = 0;
+    out[n++] = 0x81;
+    if( payloadLength > 125 )
+    {
+        out[n++] = 0x80 | 126;
+        out[n++] = payloadLength >> 8;
+        out[n++] = payloadLength & 0xff;
+    }
+    else
+        out[n++] = 0x80 | payloadLength;
+    memcpy( out + n, mask, 4 );
+    n += 4;
+    for( size_t i = 0; i < payloadLength; i++ )
+        out[n++] = ( 'a' + i % 26 ) ^ mask[i % 4];
+    return n;
+}
+
+int main(int argc, char **argv)
+{
+    unsigned long callCost = argc > 1 ? strtoul( argv[1], NULL, 10 ) : 0;
+    static const size_t sizes[] = { 16, 125, 512, 1000 };
+
+    printf( "%8s %12s %12s %12s\n", "payload", "ns/msg", "MB/s", "reads/msg" );
+    for( size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++ )
+    {
+        uint8_t encoded[FRAME_CAPACITY + WEBSOCKET_MAX_HEADER];
+        size_t length = encodeFrame( encoded, sizes[s] );
+        unsigned long count = callCost ? 2000 : 200000;
+
+        LoopbackTransport transport;
+        transport.setCallCost( callCost );
+        transport.feed( encoded, length, count );
+
+        BenchSocket ws( &transport );
+        ws.registerDataCallback( &onData );
+
+        received = 0;
+        unsigned long long start = nanos();
+        while( received < count )
+            ws.listen();
+        unsigned long long elapsed = nanos() - start;
+
+        printf( "%8zu %12.1f %12.1f %12.2f\n", sizes[s],
+                (double)elapsed / count,
+                (double)sizes[s] * count * 1000.0 / elapsed,
+                (double)transport.reads() / count );
+    }
+    return 0;
+}
@@ -0,0 +1,238 @@
+// Benchmark suite: echo throughput and latency percentiles for a range of
+// frame sizes, server handshakes per second, and broadcast fan-out cost by
+// client count, all over LoopbackTransports. Prints a table and writes the
+// same figures as JSON, so runs before and after a change can be compared.
+//
+//   make bench_suite && ./bench_suite [results.json]
+
+#include "WebSocketServer.h"
+#include "LoopbackTransport.h"
+
+#define FRAME_CAPACITY 4096
+#define LATENCY_SAMPLES 100000
+#define MAX_CLIENTS 1000
+
+static const char request[] =
+    "GET / HTTP/1.1\r\n"
+    "Host: localhost\r\n"
+    "Upgrade: websocket\r\n"
+    "Connection: Upgrade\r\n"
+    "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+    "Sec-WebSocket-Version: 13\r\n"
+    "\r\n";
+
+// Exposes the state setter so frames are parsed without a handshake.
+class BenchSocket : public WebSocket {
+public:
+    BenchSocket(WebSocketTransport *transport) : WebSocket(transport, FRAME_CAPACITY) { setStatus( CONNECTED ); }
+};
+
+static unsigned long received;
+
+static void onEcho(WebSocket &socket, char *data, word length, void *)
+{
+    received++;
+    socket.send( data, length );
+}
+
+// A masked text frame, as a browser would send it.
+static size_t encodeFrame(uint8_t *out, size_t payloadLength)
+{
+    static const uint8_t mask[4] = { 0x37, 0xfa, 0x21, 0x3d };
+    size_t n = 0;
+    out[n++] = 0x81;
+    if( payloadLength > 125 )
+    {
+        out[n++] = 0x80 | 126;
+        out[n++] = payloadLength >> 8;
+        out[n++] = payloadLength & 0xff;
+    }
+    else
+        out[n++] = 0x80 | payloadLength;
+    memcpy( out + n, mask, 4 );
+    n += 4;
+    for( size_t i = 0; i < payloadLength; i++ )
+        out[n++] = ( 'a' + i % 26 ) ^ mask[i % 4];
+    return n;
+}
+
+static int compareSamples(const void *a, const void *b)
+{
+    unsigned long long x = *(const unsigned long long *)a, y = *(const unsigned long long *)b;
+    return x < y ? -1 : x > y;
+}
+
+static unsigned long long percentile(const unsigned long long *sorted, size_t count, double p)
+{
+    size_t index = (size_t)( p * count );
+    return sorted[index < count ? index : count - 1];
+}
+
+static const size_t sizes[] = { 16, 125, 1024, 4000 };
+#define SIZE_COUNT ( sizeof(sizes) / sizeof(sizes[0]) )
+
+static void echoThroughput(FILE *json)
+{
+    printf( "%8s %12s %12s\n", "payload", "msgs/s", "MB/s" );
+    fprintf( json, "  \"throughput\": [\n" );
+    for( size_t s = 0; s < SIZE_COUNT; s++ )
+    {
+        static uint8_t encoded[FRAME_CAPACITY + WEBSOCKET_MAX_HEADER];
+        size_t length = encodeFrame( encoded, sizes[s] );
+        unsigned long count = 200000;
+
+        LoopbackTransport transport;
+        transport.feed( encoded, length, count );
+
+        BenchSocket ws( &transport );
+        ws.registerDataCallback( &onEcho );
+
+        received = 0;
+        unsigned long long start = nanos();
+        while( received < count )
+            ws.listen();
+        unsigned long long elapsed = nanos() - start;
+
+        double rate = count * 1e9 / elapsed;
+        double mbps = (double)sizes[s] * count * 1000.0 / elapsed;
+        printf( "%8zu %12.0f %12.1f\n", sizes[s], rate, mbps );
+        fprintf( json, "    { \"payload\": %zu, \"msgs_per_sec\": %.0f, \"mb_per_sec\": %.1f }%s\n",
+                 sizes[s], rate, mbps, s + 1 < SIZE_COUNT ? "," : "" );
+    }
+    fprintf( json, "  ],\n" );
+}
+
+// Time from a frame becoming readable to its echo being written.
+static void echoLatency(FILE *json)
+{
+    static unsigned long long samples[LATENCY_SAMPLES];
+
+    printf( "\n%8s %12s %12s %12s\n", "payload", "p50 ns", "p99 ns", "p999 ns" );
+    fprintf( json, "  \"latency\": [\n" );
+    for( size_t s = 0; s < SIZE_COUNT; s++ )
+    {
+        static uint8_t encoded[FRAME_CAPACITY + WEBSOCKET_MAX_HEADER];
+        size_t length = encodeFrame( encoded, sizes[s] );
+
+        LoopbackTransport transport;
+        BenchSocket ws( &transport );
+        ws.registerDataCallback( &onEcho );
+
+        for( unsigned long x=0; x < LATENCY_SAMPLES; x++ )
+        {
+            unsigned long long written = transport.written();
+            transport.feed( encoded, length, 1 );
+            unsigned long long start = nanos();
+            while( transport.written() == written )
+                ws.listen();
+            samples[x] = nanos() - start;
+        }
+        qsort( samples, LATENCY_SAMPLES, sizeof(samples[0]), compareSamples );
+
+        unsigned long long p50 = percentile( samples, LATENCY_SAMPLES, 0.50 );
+        unsigned long long p99 = percentile( samples, LATENCY_SAMPLES, 0.99 );
+        unsigned long long p999 = percentile( samples, LATENCY_SAMPLES, 0.999 );
+        printf( "%8zu %12llu %12llu %12llu\n", sizes[s], p50, p99, p999 );
+        fprintf( json, "    { \"payload\": %zu, \"p50_ns\": %llu, \"p99_ns\": %llu, \"p999_ns\": %llu }%s\n",
+                 sizes[s], p50, p99, p999, s + 1 < SIZE_COUNT ? "," : "" );
+    }
+    fprintf( json, "  ],\n" );
+}
+
+static LoopbackTransport clients[MAX_CLIENTS];
+static unsigned long connects;
+
+static void onConnect(InboundWebSocket &, void *)
+{
+    connects++;
+}
+
+// Full server handshakes: accept, parse the request, hash the key, reply.
+static void handshakes(FILE *json)
+{
+    LoopbackServerTransport listener( clients, 16 );
+    WebSocketServer server( listener, "/", 16, 128 );
+    server.registerConnectCallback( &onConnect );
+    server.begin();
+
+    unsigned long count = 100000;
+    listener.arrive( (const uint8_t *)request, sizeof(request) - 1, count );
+
+    connects = 0;
+    unsigned long long start = nanos();
+    while( connects < count )
+    {
+        server.listen();
+
+        // Hang up once answered, so the next listen() frees the slot.
+        for( word x=0; x < 16; x++ )
+            if( clients[x].written() )
+                clients[x].stop();
+    }
+    unsigned long long elapsed = nanos() - start;
+
+    double rate = count * 1e9 / elapsed;
+    printf( "\n%12s %12s\n", "handshakes/s", "ns each" );
+    printf( "%12.0f %12.1f\n", rate, (double)elapsed / count );
+    fprintf( json, "  \"handshake\": { \"per_sec\": %.0f, \"ns_each\": %.1f },\n", rate, (double)elapsed / count );
+}
+
+// One 64 byte message to every client.
+static void broadcast(FILE *json)
+{
+    static const word counts[] = { 1, 10, 100, MAX_CLIENTS };
+    const size_t countCount = sizeof(counts) / sizeof(counts[0]);
+    char message[64];
+    memset( message, 'x', sizeof(message) );
+
+    printf( "\n%8s %14s %12s\n", "clients", "ns/broadcast", "ns/client" );
+    fprintf( json, "  \"broadcast\": [\n" );
+    for( size_t c = 0; c < countCount; c++ )
+    {
+        LoopbackServerTransport listener( clients, counts[c] );
+        WebSocketServer server( listener, "/", counts[c], 128 );
+        server.begin();
+
+        listener.arrive( (const uint8_t *)request, sizeof(request) - 1, counts[c] );
+        while( server.connectionCount() < counts[c] )
+            server.listen();
+        server.listen(); // Finish the last handshakes.
+
+        unsigned long rounds = 2000000 / counts[c];
+        unsigned long long start = nanos();
+        for( unsigned long x=0; x < rounds; x++ )
+            server.send( message, sizeof(message) );
+        unsigned long long elapsed = nanos() - start;
+
+        double each = (double)elapsed / rounds;
+        printf( "%8u %14.1f %12.1f\n", counts[c], each, each / counts[c] );
+        fprintf( json, "    { \"clients\": %u, \"ns_per_broadcast\": %.1f, \"ns_per_client\": %.1f }%s\n",
+                 counts[c], each, each / counts[c], c + 1 < countCount ? "," : "" );
+
+        // Hang up quietly rather than through close(), which lingers.
+        for( word x=0; x < counts[c]; x++ )
+            clients[x].stop();
+        server.listen();
+    }
+    fprintf( json, "  ]\n" );
+}
+
+int main(int argc, char **argv)
+{
+    const char *path = argc > 1 ? argv[1] : "bench_suite.json";
+    FILE *json = fopen( path, "w" );
+    if( !json )
+    {
+        perror( path );
+        return 1;
+    }
+
+    fprintf( json, "{\n  \"compiler\": \"%s\",\n  \"frame_capacity\": %d,\n", __VERSION__, FRAME_CAPACITY );
+    echoThroughput( json );
+    echoLatency( json );
+    handshakes( json );
+    broadcast( json );
+    fprintf( json, "}\n" );
+    fclose( json );
+    return 0;
+}
@@ -0,0 +1,215 @@
+#ifndef H_HOSTTEST
+#define H_HOSTTEST
+
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "WebSocket.h"
+#include "WebSocketEpoll.h"
+
+static int failures;
+
+// Report a failed expectation and carry on, so one run shows them all.
+#define CHECK(condition) do { \
+        if( !(condition) ) { \
+            printf( "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #condition ); \
+            failures++; \
+        } \
+    } while( 0 )
+
+// Summary line and exit status for main().
+static inline int finish(const char *name)
+{
+    printf( "%s: %s\n", name, failures ? "FAILED" : "ok" );
+    return failures ? 1 : 0;
+}
+
+// A client's upgrade request for "/".
+static const char UPGRADE_REQUEST[] =
+    "GET / HTTP/1.1\r\n"
+    "Host: localhost\r\n"
+    "Upgrade: websocket\r\n"
+    "Connection: Upgrade\r\n"
+    "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+    "Sec-WebSocket-Version: 13\r\n"
+    "\r\n";
+
+// Encode a masked client frame; returns its length.
+static inline size_t encodeClientFrame(uint8_t *out, byte flags, const uint8_t *payload, size_t length)
+{
+    static const uint8_t mask[4] = { 0x37, 0xfa, 0x21, 0x3d };
+    size_t n = 0;
+    out[n++] = flags;
+    if( length > 0xffff )
+    {
+        out[n++] = 0x80 | 127;
+        for( int shift = 56; shift >= 0; shift -= 8 )
+            out[n++] = (uint8_t)( (uint64_t)length >> shift );
+    }
+    else if( length > 125 )
+    {
+        out[n++] = 0x80 | 126;
+        out[n++] = length >> 8;
+        out[n++] = length & 0xff;
+    }
+    else
+        out[n++] = 0x80 | length;
+    memcpy( out + n, mask, 4 );
+    n += 4;
+    for( size_t x=0; x < length; x++ )
+        out[n++] = payload[x] ^ mask[x % 4];
+    return n;
+}
+
+// A listener on the first free port from one picked by process id, so
+// runs side by side don't collide.
+static inline EpollServerTransport *listenAnywhere(word &port, int pollTimeout = 0)
+{
+    for( port = 20000 + getpid() % 20000; ; port++ )
+    {
+        EpollServerTransport *listener = new EpollServerTransport( port );
+        listener->setPollTimeout( pollTimeout );
+        listener->begin();
+        if( listener->listening() )
+            return listener;
+        delete listener;
+    }
+}
+
+// Non-blocking TCP client on the loopback interface.
+static inline int connectLoopback(word port)
+{
+    int fd = socket( AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0 );
+    struct sockaddr_in addr;
+    memset( &addr, 0, sizeof(addr) );
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl( INADDR_LOOPBACK );
+    addr.sin_port = htons( port );
+    if( connect( fd, (struct sockaddr *)&addr, sizeof(addr) ) < 0 && errno != EINPROGRESS )
+    {
+        close( fd );
+        return -1;
+    }
+    return fd;
+}
+
+static inline bool sendAll(int fd, const void *data, size_t length)
+{
+    return send( fd, data, length, MSG_NOSIGNAL ) == (ssize_t)length;
+}
+
+// Whatever has arrived, up to 'length' - 1 bytes, as a string.
+static inline ssize_t receiveText(int fd, char *buffer, size_t length)
+{
+    ssize_t got = recv( fd, buffer, length - 1, 0 );
+    buffer[got > 0 ? got : 0] = '\0';
+    return got;
+}
+
+// In-memory connection: reads hand out what feed() was given, at most a
+// segment at a time, and writes are kept for the test to look at.
+class ScriptedTransport : public WebSocketTransport {
+public:
+    ScriptedTransport() :
+        m_in(NULL), m_inLength(0), m_inOffset(0), m_segment(1460),
+        m_out((uint8_t *)malloc( OUTPUT )), m_outLength(0), m_open(true) {}
+    ~ScriptedTransport() { free( m_out ); }
+
+    // The bytes to read from now on, replacing any not yet read.
+    void feed(const uint8_t *data, size_t length) { m_in = data; m_inLength = length; m_inOffset = 0; }
+
+    // Largest piece one read hands out, like a TCP segment.
+    void setSegment(size_t segment) { m_segment = segment; }
+
+    bool drained() { return m_inOffset == m_inLength; }
+
+    const uint8_t *output() { return m_out; }
+    size_t outputLength() { return m_outLength; }
+    void clearOutput() { m_outLength = 0; }
+
+    bool connect(const char *, word) { m_open = true; return true; }
+    bool connected() { return m_open; }
+    int available() { return m_inLength - m_inOffset > 0x7fff ? 0x7fff : (int)( m_inLength - m_inOffset ); }
+
+    int read(uint8_t *buffer, size_t length)
+    {
+        if( !m_open )
+            return -1;
+        if( length > m_segment )
+            length = m_segment;
+        if( length > m_inLength - m_inOffset )
+            length = m_inLength - m_inOffset;
+        memcpy( buffer, m_in + m_inOffset, length );
+        m_inOffset += length;
+        return length;
+    }
+
+    size_t write(const uint8_t *buffer, size_t length)
+    {
+        if( !m_open || m_outLength + length > OUTPUT )
+            return 0;
+        memcpy( m_out + m_outLength, buffer, length );
+        m_outLength += length;
+        return length;
+    }
+
+    void stop() { m_open = false; }
+
+private:
+    enum { OUTPUT = 1 << 20 };
+
+    const uint8_t *m_in;
+    size_t m_inLength, m_inOffset;
+    size_t m_segment;
+    uint8_t *m_out;
+    size_t m_outLength;
+    bool m_open;
+};
+
+// A socket past its handshake, as a server's would be.
+class ConnectedSocket : public WebSocket {
+public:
+    ConnectedSocket(WebSocketTransport *transport, word maxFrameSize) : WebSocket(transport, maxFrameSize) { setStatus( CONNECTED ); }
+};
+
+// Read back an unmasked frame the socket wrote at 'data'. Returns the
+// bytes it takes, or 0 if there isn't a whole one.
+static inline size_t decodeServerFrame(const uint8_t *data, size_t length, byte &flags, const uint8_t *&payload, uint64_t &payloadLength)
+{
+    if( length < 2 )
+        return 0;
+    flags = data[0];
+    size_t header = 2;
+    payloadLength = data[1] & 0x7f;
+    if( payloadLength == 126 )
+        header += 2;
+    else if( payloadLength == 127 )
+        header += 8;
+    if( length < header )
+        return 0;
+    if( payloadLength >= 126 )
+    {
+        payloadLength = 0;
+        for( size_t x=2; x < header; x++ )
+            payloadLength = ( payloadLength << 8 ) | data[x];
+    }
+    if( length - header < payloadLength )
+        return 0;
+    payload = data + header;
+    return header + payloadLength;
+}
+
+// Close code of the close frame at 'data', 0 if there's none.
+static inline word closeCode(const uint8_t *data, size_t length)
+{
+    byte flags;
+    const uint8_t *payload = NULL;
+    uint64_t payloadLength = 0;
+    if( !decodeServerFrame( data, length, flags, payload, payloadLength ) || ( flags & 0xf ) != 0x8 || payloadLength < 2 )
+        return 0;
+    return ( payload[0] << 8 ) | payload[1];
+}
+
+#endif
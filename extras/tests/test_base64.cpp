@@ -0,0 +1,123 @@
+// Base64: the block-at-a-time paths give what a plain byte-at-a-time coder
+// gives at every length, and the strict decoder takes canonical base64 only.
+//
+//   make test_base64 && ./test_base64
+
+#include "Base64.h"
+#include "HostTest.h"
+
+static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+// Reference encoder, three bytes at a time.
+static int encode(char *output, const uint8_t *input, int length)
+{
+    int n = 0;
+    for( int x=0; x < length; x += 3 )
+    {
+        uint32_t group = (uint32_t)input[x] << 16;
+        if( x + 1 < length )
+            group |= (uint32_t)input[x + 1] << 8;
+        if( x + 2 < length )
+            group |= input[x + 2];
+        output[n++] = alphabet[( group >> 18 ) & 0x3f];
+        output[n++] = alphabet[( group >> 12 ) & 0x3f];
+        output[n++] = x + 1 < length ? alphabet[( group >> 6 ) & 0x3f] : '=';
+        output[n++] = x + 2 < length ? alphabet[group & 0x3f] : '=';
+    }
+    output[n] = '\0';
+    return n;
+}
+
+static void roundTrip()
+{
+    static uint8_t data[1200];
+    static char reference[1700], encoded[1700], decoded[1300];
+    unsigned long seed = 88172645UL;
+    for( size_t x=0; x < sizeof(data); x++ )
+    {
+        seed = seed * 1103515245UL + 12345UL;
+        data[x] = seed >> 16;
+    }
+
+    for( int length = 0; length <= (int)sizeof(data); length += length < 200 ? 1 : 97 )
+    {
+        // From every alignment, so the blocks start at odd addresses too.
+        const uint8_t *input = data + length % 7;
+        if( input + length > data + sizeof(data) )
+            input = data;
+
+        int expected = encode( reference, input, length );
+        CHECK( base64_enc_len( length ) == expected );
+        CHECK( base64_encode( encoded, (char *)input, length ) == expected );
+        CHECK( strcmp( encoded, reference ) == 0 );
+        CHECK( base64_dec_len( encoded, expected ) == length );
+
+        memset( decoded, 0x55, sizeof(decoded) );
+        CHECK( base64_decode( decoded, encoded, expected ) == length );
+        CHECK( memcmp( decoded, input, length ) == 0 && decoded[length] == '\0' );
+
+        memset( decoded, 0x55, sizeof(decoded) );
+        CHECK( base64_decode_strict( decoded, encoded, expected ) == length );
+        CHECK( memcmp( decoded, input, length ) == 0 && decoded[length] == '\0' );
+    }
+}
+
+static int strict(const char *input)
+{
+    char output[256];
+    return base64_decode_strict( output, input, strlen(input) );
+}
+
+static void rejects()
+{
+    // Short groups and padding.
+    CHECK( strict( "" ) == 0 );
+    CHECK( strict( "QQ==" ) == 1 );
+    CHECK( strict( "QUI=" ) == 2 );
+    CHECK( strict( "QUJD" ) == 3 );
+    CHECK( strict( "QQ" ) == -1 );
+    CHECK( strict( "QUJ" ) == -1 );
+    CHECK( strict( "QUJDR" ) == -1 );
+    CHECK( strict( "Q===" ) == -1 );
+    CHECK( strict( "====" ) == -1 );
+    CHECK( strict( "Q=Q=" ) == -1 );
+    CHECK( strict( "QQ==QUJD" ) == -1 );
+
+    // Leftover bits under the padding must be zero.
+    CHECK( strict( "QR==" ) == -1 );
+    CHECK( strict( "QUJ=" ) == -1 );
+
+    // The URL-safe alphabet, whitespace and anything past ASCII.
+    CHECK( strict( "QU-_" ) == -1 );
+    CHECK( strict( "QUJD\r\n" ) == -1 );
+    CHECK( strict( "QU D" ) == -1 );
+    CHECK( strict( "QU\xc3\x84" ) == -1 );
+
+    // A bad character anywhere in a long input, in or out of a block.
+    char input[161];
+    uint8_t data[120];
+    memset( data, 0xa5, sizeof(data) );
+    int length = base64_encode( input, (char *)data, sizeof(data) );
+    CHECK( length == 160 );
+    CHECK( strict( input ) == (int)sizeof(data) );
+
+    static const char bad[] = { '*', ' ', '=', '-', '\0', (char)0x80, (char)0xff };
+    for( int x=0; x < length; x++ )
+    {
+        for( size_t y=0; y < sizeof(bad); y++ )
+        {
+            char saved = input[x];
+            input[x] = bad[y];
+            char output[128];
+            CHECK( base64_decode_strict( output, input, length ) == -1 );
+            input[x] = saved;
+        }
+    }
+}
+
+int main()
+{
+    roundTrip();
+    rejects();
+    return finish( "test_base64" );
+}
@@ -0,0 +1,73 @@
+// Client and server in one process over loopback: the client's handshake,
+// its callbacks, and an echoed message.
+//
+//   make test_client && ./test_client
+
+#include "WebSocketServer.h"
+#include "HostTest.h"
+
+static int connects, disconnects, messages;
+static char last[64];
+
+static void onClientConnect(WebSocket &, void *) { connects++; }
+static void onClientDisconnect(WebSocket &, void *) { disconnects++; }
+
+static void onClientData(WebSocket &, char *data, word length, void *)
+{
+    messages++;
+    snprintf( last, sizeof(last), "%.*s", (int)length, data );
+}
+
+static void onEcho(WebSocket &socket, char *data, word length, void *)
+{
+    socket.sendFrame( socket.opcode(), (const uint8_t *)data, length );
+}
+
+static void onServerConnect(InboundWebSocket &socket, void *)
+{
+    socket.registerDataCallback( &onEcho );
+}
+
+// Both ends take turns until 'done' or a second has passed.
+static bool run(WebSocketServer &server, WebSocket &client, bool (*done)(WebSocket &))
+{
+    for( unsigned long start = millis(); millis() - start < 1000; )
+    {
+        server.listen();
+        client.listen();
+        if( done( client ) )
+            return true;
+    }
+    return false;
+}
+
+static bool upgraded(WebSocket &client) { return client.status() != WebSocket::HANDSHAKE; }
+static bool answered(WebSocket &) { return messages > 0; }
+
+int main()
+{
+    word port;
+    EpollServerTransport *listener = listenAnywhere( port );
+
+    WebSocketServer server( *listener, "/", 4, 256 );
+    server.registerConnectCallback( &onServerConnect );
+
+    WebSocket client( 256 );
+    client.registerConnectCallback( &onClientConnect );
+    client.registerDisconnectCallback( &onClientDisconnect );
+    client.registerDataCallback( &onClientData );
+
+    char url[32];
+    snprintf( url, sizeof(url), "ws://127.0.0.1:%u/", port );
+    CHECK( client.connect( url ) );
+    CHECK( run( server, client, &upgraded ) );
+    CHECK( client.status() == WebSocket::CONNECTED );
+    CHECK( connects == 1 );
+    CHECK( disconnects == 0 );
+
+    CHECK( client.send( "hello", 5 ) );
+    CHECK( run( server, client, &answered ) );
+    CHECK( strcmp( last, "hello" ) == 0 );
+
+    return finish( "test_client" );
+}
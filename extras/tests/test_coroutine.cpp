@@ -0,0 +1,58 @@
+// Coroutines: a message reaches a coroutine waiting in co_await receive(),
+// and one whose frame can't be allocated simply doesn't run.
+//
+//   make test_coroutine && ./test_coroutine
+
+#include "WebSocket.h"
+#include "LoopbackTransport.h"
+#include "HostTest.h"
+
+// Exposes the state setter so frames are parsed without a handshake.
+class TestSocket : public WebSocket {
+public:
+    TestSocket(WebSocketTransport *transport) : WebSocket(transport, 128) { setStatus( CONNECTED ); }
+};
+
+static int started, received;
+static char last[16];
+
+static WebSocketTask consume(WebSocket &socket)
+{
+    started++;
+    while( WebSocketMessage message = co_await socket.receive() )
+    {
+        received++;
+        snprintf( last, sizeof(last), "%s", message.data );
+    }
+}
+
+// A frame far larger than malloc() will give.
+static WebSocketTask huge(WebSocket &socket)
+{
+    volatile char scratch[(size_t)1 << 46];
+    started++;
+    scratch[0] = 1;
+    co_await socket.receive();
+    scratch[1] = scratch[0];
+}
+
+int main()
+{
+    uint8_t frame[32];
+    size_t length = encodeClientFrame( frame, 0x81, (const uint8_t *)"hello", 5 );
+
+    LoopbackTransport transport;
+    TestSocket socket( &transport );
+    consume( socket );
+    CHECK( started == 1 );
+
+    transport.feed( frame, length, 2 );
+    socket.listen();
+    CHECK( received == 2 );
+    CHECK( strcmp( last, "hello" ) == 0 );
+
+    huge( socket );
+    CHECK( started == 1 );
+
+    return finish( "test_coroutine" );
+}
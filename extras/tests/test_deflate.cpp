@@ -0,0 +1,92 @@
+// permessage-deflate: messages round-trip through compress() and
+// decompress(), and inflated output is handed on in pieces no bigger than
+// the capacity, the last one marked final even when it fills it exactly.
+//
+//   make test_deflate && ./test_deflate
+
+#include "WebSocketDeflate.h"
+#include "HostTest.h"
+
+#if WEBSOCKET_DEFLATE
+
+#define CAPACITY 100
+
+typedef struct {
+    uint8_t data[4096];
+    size_t length;
+    word pieces;
+    word lastLength;
+    bool final;
+    bool overflow;
+} Collected;
+
+static bool collect(void *context, uint8_t *data, word length, bool final)
+{
+    Collected *out = (Collected *)context;
+    if( out->final || out->length + length > sizeof(out->data) )
+    {
+        out->overflow = true;
+        return false;
+    }
+    memcpy( out->data + out->length, data, length );
+    out->length += length;
+    out->pieces++;
+    out->lastLength = length;
+    out->final = final;
+    return true;
+}
+
+// Compress 'length' bytes of text and inflate them again, checking what
+// the sink saw. Returns the count of pieces.
+static word roundTrip(size_t length)
+{
+    static const WebSocketDeflateOptions options;
+    WebSocketDeflate::Params params = { 15, 15, false, false };
+    WebSocketDeflate deflate( options, params, CAPACITY );
+
+    uint8_t message[1024];
+    for( size_t x=0; x < length; x++ )
+        message[x] = 'a' + ( x * 7 ) % 26;
+
+    Collected compressed, inflated;
+    memset( &compressed, 0, sizeof(compressed) );
+    memset( &inflated, 0, sizeof(inflated) );
+
+    WebSocketIovec piece = { message, length };
+    CHECK( deflate.compress( &piece, 1, &collect, &compressed ) == WebSocketDeflate::OK );
+    CHECK( deflate.decompress( compressed.data, compressed.length, true, &collect, &inflated ) == WebSocketDeflate::OK );
+
+    CHECK( !inflated.overflow );
+    CHECK( inflated.final );
+    CHECK( inflated.length == length );
+    CHECK( memcmp( inflated.data, message, length ) == 0 );
+    CHECK( inflated.lastLength <= CAPACITY );
+    return inflated.pieces;
+}
+
+int main()
+{
+    CHECK( roundTrip( 0 ) == 1 );
+    CHECK( roundTrip( 10 ) == 1 );
+    CHECK( roundTrip( CAPACITY - 1 ) == 1 );
+
+    // Exactly the capacity is one final piece, not a full one and an empty one.
+    CHECK( roundTrip( CAPACITY ) == 1 );
+
+    CHECK( roundTrip( CAPACITY + 1 ) == 2 );
+    CHECK( roundTrip( 2 * CAPACITY ) == 2 );
+    CHECK( roundTrip( 2 * CAPACITY + 1 ) == 3 );
+    CHECK( roundTrip( 1000 ) == 10 );
+
+    return finish( "test_deflate" );
+}
+
+#else
+
+int main()
+{
+    printf( "test_deflate: skipped, no zlib\n" );
+    return 0;
+}
+
+#endif
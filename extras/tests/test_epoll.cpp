@@ -0,0 +1,51 @@
+// EpollServerTransport: begin() on a port that's taken leaves no
+// descriptors behind and can be retried, and a second begin() once
+// listening changes nothing.
+//
+//   make test_epoll && ./test_epoll
+
+#include <dirent.h>
+
+#include "HostTest.h"
+
+static int openDescriptors()
+{
+    int count = 0;
+    DIR *dir = opendir( "/proc/self/fd" );
+    while( readdir( dir ) )
+        count++;
+    closedir( dir );
+    return count;
+}
+
+int main()
+{
+    word port;
+    EpollServerTransport *taken = listenAnywhere( port );
+
+    EpollServerTransport listener( port );
+    int before = openDescriptors();
+    for( byte x=0; x < 3; x++ )
+    {
+        listener.begin();
+        CHECK( !listener.listening() );
+    }
+    CHECK( openDescriptors() == before );
+
+    // The port comes free: the same transport gets it.
+    delete taken;
+    before = openDescriptors();
+    listener.begin();
+    CHECK( listener.listening() );
+    int listening = openDescriptors();
+    CHECK( listening > before );
+
+    listener.begin();
+    CHECK( listener.listening() );
+    CHECK( openDescriptors() == listening );
+
+    WebSocketTransport *ready[4];
+    CHECK( listener.poll( ready, 4 ) == 0 );
+
+    return finish( "test_epoll" );
+}
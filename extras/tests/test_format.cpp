@@ -0,0 +1,77 @@
+// %f formatting: websocket_format_float() against the C library's
+// snprintf(), which rounds the exact binary value, ties to even.
+//
+//   make test_format && ./test_format
+
+#include <math.h>
+
+#include "WebSocketFormat.h"
+#include "HostTest.h"
+
+static void same(double value, byte precision)
+{
+    char ours[400], theirs[400];
+    char *end = websocket_format_float( ours, ours + sizeof(ours) - 1, value, 0, 0, precision );
+    CHECK( end );
+    if( !end )
+        return;
+    *end = '\0';
+
+    snprintf( theirs, sizeof(theirs), "%.*f", precision, value );
+    if( strcmp( ours, theirs ) && failures < 10 )
+    {
+        printf( "%.17g to %u places: %s, printf() says %s\n", value, precision, ours, theirs );
+        failures++;
+    }
+}
+
+// xorshift64, so runs are repeatable without <random>.
+static uint64_t next(uint64_t &state)
+{
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    return state;
+}
+
+int main()
+{
+    // Ties, values just either side of them, and the extremes.
+    same( 0.5, 0 );
+    same( 1.5, 0 );
+    same( 2.5, 0 );
+    same( 0.125, 2 );
+    same( 0.375, 2 );
+    same( 0.995, 2 );
+    same( -0.995, 2 );
+    same( 0.9999999995, 9 );
+    same( 123456.5, 0 );
+    same( 1e-300, 9 );
+    same( 0.0, 3 );
+    same( -0.0, 1 );
+
+    uint64_t state = 88172645463325252ULL;
+    for( unsigned long x=0; x < 300000; x++ )
+    {
+        double value;
+        switch( x % 3 )
+        {
+            case 0: // Decimal fractions that aren't exact in binary.
+                value = (double)( next( state ) % 100000 ) / 1000 + (double)( next( state ) % 3 ) * 0.0005;
+                break;
+            case 1: // Any bit pattern in range.
+            {
+                uint64_t bits = next( state );
+                memcpy( &value, &bits, sizeof(value) );
+                if( isnan( value ) || fabs( value ) > 1e18 )
+                    continue;
+                break;
+            }
+            default: // Binary fractions, most of them ties somewhere.
+                value = ldexp( (double)( next( state ) >> 11 ), -(int)( next( state ) % 80 ) );
+        }
+        same( value, next( state ) % 10 );
+    }
+
+    return finish( "test_format" );
+}
@@ -0,0 +1,172 @@
+// Fragmented messages: continuations are put back together in the frame
+// buffer, or streamed piece by piece to a chunk callback, with control
+// frames answered in between, and fragments out of order are refused.
+//
+//   make test_fragments && ./test_fragments
+
+#include "HostTest.h"
+
+#define CAPACITY 128
+
+static int messages;
+static bool stillOpen;
+static WebSocket::Opcode lastOpcode;
+static char last[CAPACITY + 1];
+
+static uint8_t streamed[4096];
+static size_t streamedLength;
+static int chunks, lastChunks;
+static bool misplacedLast;
+
+static void onData(WebSocket &socket, char *data, word length, void *)
+{
+    messages++;
+    lastOpcode = socket.opcode();
+    memcpy( last, data, length );
+    last[length] = '\0';
+}
+
+static void onChunk(WebSocket &socket, char *chunk, word length, bool isLast, void *)
+{
+    chunks++;
+    lastOpcode = socket.opcode();
+    if( lastChunks || streamedLength + length > sizeof(streamed) )
+        misplacedLast = true;
+    memcpy( streamed + streamedLength, chunk, length );
+    streamedLength += length;
+    if( isLast )
+        lastChunks++;
+}
+
+static void reset()
+{
+    messages = chunks = lastChunks = 0;
+    streamedLength = 0;
+    misplacedLast = false;
+    last[0] = '\0';
+}
+
+// Feed 'stream' to a fresh socket 'segment' bytes per read, until it's used
+// up or the socket closes. 'stillOpen' tells which.
+static void run(const uint8_t *stream, size_t length, size_t segment, ScriptedTransport &transport, bool chunked)
+{
+    reset();
+    transport.setSegment( segment );
+    transport.feed( stream, length );
+
+    ConnectedSocket socket( &transport, CAPACITY );
+    if( chunked )
+        socket.registerDataChunkCallback( &onChunk );
+    else
+        socket.registerDataCallback( &onData );
+    for( unsigned long x=0; x < 100000 && !transport.drained() && socket.status() == WebSocket::CONNECTED; x++ )
+        socket.listen();
+    socket.listen();
+    stillOpen = socket.status() == WebSocket::CONNECTED;
+}
+
+static void reassembly()
+{
+    uint8_t stream[256];
+    size_t length = 0;
+    length += encodeClientFrame( stream + length, 0x01, (const uint8_t *)"Hel", 3 );
+    length += encodeClientFrame( stream + length, 0x00, (const uint8_t *)"lo ", 3 );
+    length += encodeClientFrame( stream + length, 0x89, (const uint8_t *)"ping", 4 );
+    length += encodeClientFrame( stream + length, 0x00, NULL, 0 );
+    length += encodeClientFrame( stream + length, 0x80, (const uint8_t *)"world", 5 );
+    length += encodeClientFrame( stream + length, 0x02, (const uint8_t *)"\x01\x02", 2 );
+    length += encodeClientFrame( stream + length, 0x80, (const uint8_t *)"\x03", 1 );
+
+    for( size_t segment = 1; segment <= length; segment++ )
+    {
+        ScriptedTransport transport;
+        run( stream, length, segment, transport, false );
+        CHECK( stillOpen );
+        CHECK( messages == 2 );
+        CHECK( lastOpcode == WebSocket::OPCODE_BINARY );
+        CHECK( memcmp( last, "\x01\x02\x03", 4 ) == 0 );
+
+        // The ping was answered while the text message was half read.
+        byte flags = 0;
+        const uint8_t *payload = NULL;
+        uint64_t payloadLength = 0;
+        CHECK( decodeServerFrame( transport.output(), transport.outputLength(), flags, payload, payloadLength ) == transport.outputLength() );
+        CHECK( flags == 0x8A && payloadLength == 4 && memcmp( payload, "ping", 4 ) == 0 );
+    }
+
+    // Each fragment fits, but together they don't.
+    uint8_t payload[CAPACITY / 2];
+    memset( payload, 'x', sizeof(payload) );
+    length = 0;
+    for( int x=0; x < 3; x++ )
+        length += encodeClientFrame( stream + length, x ? 0x00 : 0x01, payload, sizeof(payload) );
+    ScriptedTransport transport;
+    run( stream, length, 16, transport, false );
+    CHECK( messages == 0 );
+    CHECK( !stillOpen );
+    CHECK( closeCode( transport.output(), transport.outputLength() ) == 1009 );
+}
+
+static void streaming()
+{
+    // A message several times the buffer, in fragments of their own larger
+    // than it, with a ping among them.
+    static uint8_t message[1000];
+    for( size_t x=0; x < sizeof(message); x++ )
+        message[x] = 'a' + ( x * 7 ) % 26;
+
+    static uint8_t stream[1200];
+    size_t length = 0;
+    length += encodeClientFrame( stream + length, 0x01, message, 400 );
+    length += encodeClientFrame( stream + length, 0x89, (const uint8_t *)"ping", 4 );
+    length += encodeClientFrame( stream + length, 0x00, message + 400, 300 );
+    length += encodeClientFrame( stream + length, 0x80, message + 700, 300 );
+
+    static const size_t segments[] = { 1, 3, 7, 64, 127, 1460 };
+    for( size_t x=0; x < sizeof(segments) / sizeof(segments[0]); x++ )
+    {
+        ScriptedTransport transport;
+        run( stream, length, segments[x], transport, true );
+        CHECK( stillOpen );
+        CHECK( lastOpcode == WebSocket::OPCODE_TEXT );
+        CHECK( lastChunks == 1 && !misplacedLast );
+        CHECK( streamedLength == sizeof(message) && memcmp( streamed, message, sizeof(message) ) == 0 );
+        CHECK( chunks > 3 );
+        CHECK( closeCode( transport.output(), transport.outputLength() ) == 0 );
+    }
+}
+
+static void outOfOrder()
+{
+    uint8_t stream[64];
+
+    // A new message before the last one finished.
+    size_t length = encodeClientFrame( stream, 0x01, (const uint8_t *)"one", 3 );
+    length += encodeClientFrame( stream + length, 0x81, (const uint8_t *)"two", 3 );
+    for( int chunked = 0; chunked < 2; chunked++ )
+    {
+        ScriptedTransport transport;
+        run( stream, length, 5, transport, chunked );
+        CHECK( messages == 0 && lastChunks == 0 );
+        CHECK( closeCode( transport.output(), transport.outputLength() ) == 1002 );
+    }
+
+    // A continuation after the message was over.
+    length = encodeClientFrame( stream, 0x81, (const uint8_t *)"one", 3 );
+    length += encodeClientFrame( stream + length, 0x80, (const uint8_t *)"two", 3 );
+    for( int chunked = 0; chunked < 2; chunked++ )
+    {
+        ScriptedTransport transport;
+        run( stream, length, 5, transport, chunked );
+        CHECK( messages + lastChunks == 1 );
+        CHECK( closeCode( transport.output(), transport.outputLength() ) == 1002 );
+    }
+}
+
+int main()
+{
+    reassembly();
+    streaming();
+    outOfOrder();
+    return finish( "test_fragments" );
+}
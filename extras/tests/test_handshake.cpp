@@ -0,0 +1,97 @@
+// Opening handshake: the parser's start line checks, and a server that
+// answers requests outside its URL prefix with 404.
+//
+//   make test_handshake && ./test_handshake
+
+#include "WebSocketServer.h"
+#include "HostTest.h"
+
+static byte parse(WebSocketHandshake::Kind kind, const char *pathPrefix, const char *text, WebSocketHandshake::Result expected)
+{
+    WebSocketHandshake handshake;
+    handshake.reset( kind, pathPrefix );
+    word used;
+    CHECK( handshake.parse( (const uint8_t *)text, strlen(text), used ) == expected );
+    return handshake.found();
+}
+
+// Does a request for 'path' fall under 'prefix'?
+static bool under(const char *prefix, const char *path)
+{
+    char request[128];
+    snprintf( request, sizeof(request), "GET %s HTTP/1.1\r\nHost: x\r\n\r\n", path );
+    byte found = parse( WebSocketHandshake::REQUEST, prefix, request, WebSocketHandshake::COMPLETE );
+    CHECK( found & WebSocketHandshake::HAS_START_LINE );
+    return found & WebSocketHandshake::HAS_PATH;
+}
+
+static void statusLines()
+{
+    const WebSocketHandshake::Kind response = WebSocketHandshake::RESPONSE;
+    CHECK( parse( response, NULL, "HTTP/1.1 101 Switching Protocols\r\n\r\n", WebSocketHandshake::COMPLETE ) & WebSocketHandshake::HAS_START_LINE );
+    CHECK( parse( response, NULL, "HTTP/1.1 101\r\n\r\n", WebSocketHandshake::COMPLETE ) & WebSocketHandshake::HAS_START_LINE );
+    CHECK( parse( response, NULL, "HTTP/1.1 101 \n\n", WebSocketHandshake::COMPLETE ) & WebSocketHandshake::HAS_START_LINE );
+    parse( response, NULL, "HTTP/1.1 1010 Nope\r\n\r\n", WebSocketHandshake::FAILED );
+    parse( response, NULL, "HTTP/1.1 10\r\n\r\n", WebSocketHandshake::FAILED );
+    parse( response, NULL, "HTTP/1.1 200 OK\r\n\r\n", WebSocketHandshake::FAILED );
+    parse( WebSocketHandshake::REQUEST, NULL, "POST / HTTP/1.1\r\n\r\n", WebSocketHandshake::FAILED );
+}
+
+static void paths()
+{
+    CHECK( under( NULL, "/anything" ) );
+    CHECK( under( "", "/anything" ) );
+    CHECK( under( "/", "/" ) );
+    CHECK( under( "/", "/chat" ) );
+    CHECK( under( "/chat", "/chat" ) );
+    CHECK( under( "/chat", "/chat/room?x=1" ) );
+    CHECK( !under( "/chat", "/cha" ) );
+    CHECK( !under( "/chat", "/other" ) );
+    CHECK( !under( "/chat", "/Chat" ) );
+}
+
+// Send a request for 'path' and return the status code of the reply.
+static int requestStatus(WebSocketServer &server, word port, const char *path)
+{
+    char request[512];
+    snprintf( request, sizeof(request), "GET %s HTTP/1.1%s", path, strchr( UPGRADE_REQUEST, '\n' ) - 1 );
+
+    int fd = connectLoopback( port );
+    for( byte x=0; x < 20; x++ )
+        server.listen();
+    CHECK( sendAll( fd, request, strlen(request) ) );
+
+    char reply[256] = "";
+    for( unsigned long start = millis(); millis() - start < 1000 && !*reply; )
+    {
+        server.listen();
+        receiveText( fd, reply, sizeof(reply) );
+    }
+    close( fd );
+    for( byte x=0; x < 20; x++ )
+        server.listen();
+    return strncmp( reply, "HTTP/1.1 ", 9 ) == 0 ? atoi( reply + 9 ) : -1;
+}
+
+static void server()
+{
+    word port;
+    EpollServerTransport *listener = listenAnywhere( port );
+    {
+        WebSocketServer server( *listener, "/ws", 4, 128 );
+        CHECK( requestStatus( server, port, "/ws" ) == 101 );
+        CHECK( requestStatus( server, port, "/ws/feed" ) == 101 );
+        CHECK( requestStatus( server, port, "/" ) == 404 );
+        CHECK( requestStatus( server, port, "/other" ) == 404 );
+        CHECK( server.connectionCount() == 0 );
+    }
+    delete listener;
+}
+
+int main()
+{
+    statusLines();
+    paths();
+    server();
+    return finish( "test_handshake" );
+}
@@ -0,0 +1,164 @@
+// 64-bit payload lengths: frames past 64 KB stream to a chunk callback,
+// lengths past 4 GB aren't cut short, ones with the top bit set are refused,
+// and beginFrame() writes the 127 length form for what it sends.
+//
+//   make test_large && ./test_large
+
+#include "HostTest.h"
+
+#define CAPACITY 256
+
+static uint8_t payload[200000];
+static uint8_t streamed[sizeof(payload)];
+static size_t streamedLength;
+static int lastChunks, messages;
+static bool misplacedLast, stillOpen;
+
+static void onData(WebSocket &, char *, word, void *) { messages++; }
+
+static void onChunk(WebSocket &, char *chunk, word length, bool isLast, void *)
+{
+    if( lastChunks || streamedLength + length > sizeof(streamed) )
+    {
+        misplacedLast = true;
+        return;
+    }
+    memcpy( streamed + streamedLength, chunk, length );
+    streamedLength += length;
+    if( isLast )
+        lastChunks++;
+}
+
+// Feed 'stream' to a fresh socket 'segment' bytes per read, until it's used
+// up or the socket closes. 'stillOpen' tells which.
+static void run(const uint8_t *stream, size_t length, size_t segment, ScriptedTransport &transport, bool chunked)
+{
+    streamedLength = 0;
+    lastChunks = messages = 0;
+    misplacedLast = false;
+    transport.setSegment( segment );
+    transport.feed( stream, length );
+
+    ConnectedSocket socket( &transport, CAPACITY );
+    if( chunked )
+        socket.registerDataChunkCallback( &onChunk );
+    else
+        socket.registerDataCallback( &onData );
+    for( unsigned long x=0; x < 1000000 && !transport.drained() && socket.status() == WebSocket::CONNECTED; x++ )
+        socket.listen();
+    socket.listen();
+    stillOpen = socket.status() == WebSocket::CONNECTED;
+}
+
+// Header of a masked binary frame announcing 'length' bytes in the 127 form.
+static size_t longHeader(uint8_t *out, uint64_t length)
+{
+    size_t n = 0;
+    out[n++] = 0x82;
+    out[n++] = 0x80 | 127;
+    for( int shift = 56; shift >= 0; shift -= 8 )
+        out[n++] = (uint8_t)( length >> shift );
+    memset( out + n, 0, 4 ); // A mask of zeroes leaves the payload as it is.
+    return n + 4;
+}
+
+static void receiving()
+{
+    static uint8_t stream[sizeof(payload) + 16];
+    for( size_t x=0; x < sizeof(payload); x++ )
+        payload[x] = (uint8_t)( x * 131 + ( x >> 8 ) );
+
+    // Past 64 KB, streamed in reads of all sorts of sizes.
+    size_t length = encodeClientFrame( stream, 0x82, payload, sizeof(payload) );
+    CHECK( stream[1] == ( 0x80 | 127 ) );
+    static const size_t segments[] = { 1, 100, 1460, 4093, 65536 };
+    for( size_t x=0; x < sizeof(segments) / sizeof(segments[0]); x++ )
+    {
+        ScriptedTransport transport;
+        run( stream, length, segments[x], transport, true );
+        CHECK( stillOpen );
+        CHECK( lastChunks == 1 && !misplacedLast );
+        CHECK( streamedLength == sizeof(payload) && memcmp( streamed, payload, sizeof(payload) ) == 0 );
+    }
+
+    // Without a chunk callback it can't fit the buffer.
+    {
+        ScriptedTransport transport;
+        run( stream, length, 1460, transport, false );
+        CHECK( !stillOpen && messages == 0 );
+        CHECK( closeCode( transport.output(), transport.outputLength() ) == 1009 );
+    }
+
+    // Just past 4 GB: a 32-bit length would end the frame after 16 bytes.
+    length = longHeader( stream, 0x100000010ULL );
+    memcpy( stream + length, payload, 100 );
+    {
+        ScriptedTransport transport;
+        run( stream, length + 100, 7, transport, true );
+        CHECK( stillOpen );
+        CHECK( lastChunks == 0 && !misplacedLast );
+        CHECK( streamedLength == 100 );
+    }
+
+    // The most significant bit must be 0.
+    length = longHeader( stream, 0x8000000000000010ULL );
+    memcpy( stream + length, payload, 16 );
+    for( int chunked = 0; chunked < 2; chunked++ )
+    {
+        ScriptedTransport transport;
+        run( stream, length + 16, 3, transport, chunked );
+        CHECK( !stillOpen );
+        CHECK( streamedLength == 0 && messages == 0 );
+        CHECK( closeCode( transport.output(), transport.outputLength() ) == 1002 );
+    }
+}
+
+static void sending()
+{
+    // Sent in pieces after beginFrame(), read back whole.
+    {
+        ScriptedTransport transport;
+        ConnectedSocket socket( &transport, CAPACITY );
+        CHECK( socket.beginFrame( WebSocket::OPCODE_BINARY, sizeof(payload) ) );
+        for( size_t sent = 0; sent < sizeof(payload); sent += 999 )
+        {
+            size_t piece = sizeof(payload) - sent < 999 ? sizeof(payload) - sent : 999;
+            CHECK( socket.writeFrameData( payload + sent, piece ) == piece );
+        }
+
+        const uint8_t *out = transport.output();
+        CHECK( out[0] == 0x82 && out[1] == 127 );
+        byte flags = 0;
+        const uint8_t *data = NULL;
+        uint64_t dataLength = 0;
+        CHECK( decodeServerFrame( out, transport.outputLength(), flags, data, dataLength ) == transport.outputLength() );
+        CHECK( dataLength == sizeof(payload) && memcmp( data, payload, sizeof(payload) ) == 0 );
+    }
+
+    // The header of one too large to send here, all 8 length bytes of it.
+    {
+        ScriptedTransport transport;
+        ConnectedSocket socket( &transport, CAPACITY );
+        CHECK( socket.beginFrame( WebSocket::OPCODE_BINARY, 0x123456789AULL ) );
+        static const uint8_t expected[] = { 0x82, 127, 0x00, 0x00, 0x00, 0x12, 0x34, 0x56, 0x78, 0x9A };
+        CHECK( transport.outputLength() == sizeof(expected) );
+        CHECK( memcmp( transport.output(), expected, sizeof(expected) ) == 0 );
+    }
+
+    // Lengths that fit 16 bits use the shorter form.
+    {
+        ScriptedTransport transport;
+        ConnectedSocket socket( &transport, CAPACITY );
+        CHECK( socket.beginFrame( WebSocket::OPCODE_BINARY, 0xffff ) );
+        static const uint8_t expected[] = { 0x82, 126, 0xff, 0xff };
+        CHECK( transport.outputLength() == sizeof(expected) );
+        CHECK( memcmp( transport.output(), expected, sizeof(expected) ) == 0 );
+    }
+}
+
+int main()
+{
+    receiving();
+    sending();
+    return finish( "test_large" );
+}
@@ -0,0 +1,138 @@
+// Frame parser: the same byte stream gives the same messages however it is
+// split across reads, pings are answered in between, and malformed frames
+// close the connection with the right code.
+//
+//   make test_parser && ./test_parser
+
+#include "HostTest.h"
+
+#define CAPACITY 512
+
+static int messages;
+static size_t received;
+static bool stillOpen;
+static char last[CAPACITY + 1];
+
+static void onData(WebSocket &, char *data, word length, void *)
+{
+    messages++;
+    received += length;
+    memcpy( last, data, length );
+    last[length] = '\0';
+}
+
+// Feed 'stream' to a fresh socket 'segment' bytes per read and return how
+// many messages came out before it was used up or the socket closed.
+// 'stillOpen' tells which, as the socket closes the transport on its way out.
+static int run(const uint8_t *stream, size_t length, size_t segment, ScriptedTransport &transport)
+{
+    messages = 0;
+    received = 0;
+    transport.setSegment( segment );
+    transport.feed( stream, length );
+
+    ConnectedSocket socket( &transport, CAPACITY );
+    socket.registerDataCallback( &onData );
+    for( unsigned long x=0; x < 100000 && !transport.drained() && socket.status() == WebSocket::CONNECTED; x++ )
+        socket.listen();
+    socket.listen();
+    stillOpen = socket.status() == WebSocket::CONNECTED;
+    return messages;
+}
+
+static void splitReads()
+{
+    uint8_t stream[2048];
+    size_t length = 0;
+    uint8_t payload[300];
+    for( size_t x=0; x < sizeof(payload); x++ )
+        payload[x] = 'a' + x % 26;
+
+    // Short, 16-bit length and empty frames, back to back.
+    length += encodeClientFrame( stream + length, 0x81, (const uint8_t *)"first", 5 );
+    length += encodeClientFrame( stream + length, 0x81, payload, sizeof(payload) );
+    length += encodeClientFrame( stream + length, 0x81, NULL, 0 );
+    length += encodeClientFrame( stream + length, 0x81, (const uint8_t *)"last", 4 );
+
+    for( size_t segment = 1; segment <= length; segment = segment < 16 ? segment + 1 : segment * 2 )
+    {
+        ScriptedTransport transport;
+        CHECK( run( stream, length, segment, transport ) == 4 );
+        CHECK( stillOpen );
+        CHECK( received == 5 + sizeof(payload) + 4 );
+        CHECK( strcmp( last, "last" ) == 0 );
+        CHECK( transport.outputLength() == 0 );
+    }
+}
+
+static void pings()
+{
+    uint8_t stream[256];
+    size_t length = 0;
+    length += encodeClientFrame( stream + length, 0x81, (const uint8_t *)"one", 3 );
+    length += encodeClientFrame( stream + length, 0x89, (const uint8_t *)"are you there", 13 );
+    length += encodeClientFrame( stream + length, 0x81, (const uint8_t *)"two", 3 );
+
+    for( size_t segment = 1; segment < 8; segment++ )
+    {
+        ScriptedTransport transport;
+        CHECK( run( stream, length, segment, transport ) == 2 );
+
+        // The pong carries the ping's data.
+        byte flags = 0;
+        const uint8_t *payload = NULL;
+        uint64_t payloadLength = 0;
+        CHECK( decodeServerFrame( transport.output(), transport.outputLength(), flags, payload, payloadLength ) == transport.outputLength() );
+        CHECK( flags == 0x8A );
+        CHECK( payloadLength == 13 && memcmp( payload, "are you there", 13 ) == 0 );
+    }
+}
+
+// The close code a socket sends when fed 'stream', 0 if it doesn't close.
+static word refusal(const uint8_t *stream, size_t length)
+{
+    ScriptedTransport transport;
+    run( stream, length, 7, transport );
+    return stillOpen ? 0 : closeCode( transport.output(), transport.outputLength() );
+}
+
+static void malformed()
+{
+    uint8_t frame[CAPACITY + 64];
+    uint8_t payload[CAPACITY + 1];
+    memset( payload, 'x', sizeof(payload) );
+
+    // Unknown opcode.
+    size_t length = encodeClientFrame( frame, 0x83, payload, 1 );
+    CHECK( refusal( frame, length ) == 1002 );
+
+    // Reserved bits with no extension agreed.
+    length = encodeClientFrame( frame, 0xC1, payload, 1 );
+    CHECK( refusal( frame, length ) == 1002 );
+
+    // Fragmented and oversized control frames.
+    length = encodeClientFrame( frame, 0x09, payload, 1 );
+    CHECK( refusal( frame, length ) == 1002 );
+    length = encodeClientFrame( frame, 0x89, payload, 126 );
+    CHECK( refusal( frame, length ) == 1002 );
+
+    // A continuation with no message to continue.
+    length = encodeClientFrame( frame, 0x80, payload, 1 );
+    CHECK( refusal( frame, length ) == 1002 );
+
+    // More than the buffer holds.
+    length = encodeClientFrame( frame, 0x81, payload, CAPACITY + 1 );
+    CHECK( refusal( frame, length ) == 1009 );
+
+    // And a frame that's fine, for contrast.
+    length = encodeClientFrame( frame, 0x81, payload, 10 );
+    CHECK( refusal( frame, length ) == 0 );
+}
+
+int main()
+{
+    splitReads();
+    pings();
+    malformed();
+    return finish( "test_parser" );
+}
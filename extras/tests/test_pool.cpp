@@ -0,0 +1,92 @@
+// Shared buffer pool: connections that find it empty wait in the network
+// stack, without listen() spinning on their input, and carry on once a slab
+// comes free.
+//
+//   make test_pool && ./test_pool
+
+#include "WebSocketServer.h"
+#include "HostTest.h"
+
+#define POLL_MS 10
+
+// Run the server for 'ms', returning the count of listen() calls.
+static unsigned long pump(WebSocketServer &server, unsigned long ms)
+{
+    unsigned long calls = 0;
+    for( unsigned long start = millis(); millis() - start < ms; calls++ )
+        server.listen();
+    return calls;
+}
+
+static bool upgraded(int fd)
+{
+    char reply[512];
+    return receiveText( fd, reply, sizeof(reply) ) > 0 && strncmp( reply, "HTTP/1.1 101 ", 13 ) == 0;
+}
+
+int main()
+{
+    word port;
+    EpollServerTransport *listener = listenAnywhere( port, POLL_MS );
+
+    WebSocketBufferPool pool( WEBSOCKET_SLAB_SIZE(128), 2 );
+    WebSocketServer server( *listener, pool, "/", 8 );
+
+    // Two clients each hold a slab with part of a message.
+    uint8_t payload[100], frame[128];
+    memset( payload, 'x', sizeof(payload) );
+    size_t frameLength = encodeClientFrame( frame, 0x81, payload, sizeof(payload) );
+
+    int holders[2];
+    for( int x=0; x < 2; x++ )
+    {
+        holders[x] = connectLoopback( port );
+        pump( server, 50 );
+        CHECK( sendAll( holders[x], UPGRADE_REQUEST, strlen(UPGRADE_REQUEST) ) );
+        pump( server, 50 );
+        CHECK( upgraded( holders[x] ) );
+        CHECK( sendAll( holders[x], frame, 20 ) );
+    }
+    pump( server, 50 );
+    CHECK( pool.available() == 0 );
+
+    // Now handshakes, whole and half sent, find the pool empty.
+    int waiting[3];
+    for( int x=0; x < 3; x++ )
+        waiting[x] = connectLoopback( port );
+    pump( server, 50 );
+    CHECK( sendAll( waiting[0], UPGRADE_REQUEST, strlen(UPGRADE_REQUEST) ) );
+    CHECK( sendAll( waiting[1], UPGRADE_REQUEST, strlen(UPGRADE_REQUEST) ) );
+    CHECK( sendAll( waiting[2], UPGRADE_REQUEST, 40 ) );
+
+    // Each listen() should block in poll() for its timeout, not return at
+    // once to report input that can't be read.
+    unsigned long calls = pump( server, 20 * POLL_MS );
+    CHECK( calls < 40 );
+    CHECK( server.connectionCount() == 5 );
+    CHECK( !upgraded( waiting[0] ) );
+
+    // The first holder finishes its message, handing its slab back.
+    CHECK( sendAll( holders[0], frame + 20, frameLength - 20 ) );
+    pump( server, 50 );
+    CHECK( upgraded( waiting[0] ) );
+    CHECK( upgraded( waiting[1] ) );
+
+    CHECK( sendAll( waiting[2], UPGRADE_REQUEST + 40, strlen(UPGRADE_REQUEST) - 40 ) );
+    pump( server, 50 );
+    CHECK( upgraded( waiting[2] ) );
+
+    // The other holder is still waiting on its message.
+    CHECK( pool.available() == 1 );
+    CHECK( server.connectionCount() == 5 );
+
+    for( int x=0; x < 2; x++ )
+        close( holders[x] );
+    for( int x=0; x < 3; x++ )
+        close( waiting[x] );
+    pump( server, 50 );
+    CHECK( server.connectionCount() == 0 );
+    CHECK( pool.available() == 2 );
+
+    return finish( "test_pool" );
+}
@@ -0,0 +1,138 @@
+// Timer wheel: timers come out within a tick of their deadlines, however
+// far off and however the clock advances, cancelled ones never do, and the
+// millis() wraparound makes no difference.
+//
+//   make test_timers && ./test_timers
+
+#include "WebSocketTimerWheel.h"
+#include "HostTest.h"
+
+#define TIMERS 200
+#define STEP 10
+
+static WebSocketTimer timers[TIMERS];
+static int fired[TIMERS];
+static unsigned long firedAt[TIMERS];
+static bool live[TIMERS];
+static bool parked[TIMERS];
+
+static unsigned long seed = 2463534242UL;
+
+static unsigned long random32()
+{
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+    return seed & 0xffffffffUL;
+}
+
+static void arm(WebSocketTimerWheel &wheel, int x, unsigned long deadline, unsigned long now)
+{
+    wheel.schedule( &timers[x], deadline );
+    CHECK( timers[x].scheduled() );
+    parked[x] = (long)( deadline - now ) > (long)WEBSOCKET_TIMER_TICK * ( WEBSOCKET_TIMER_SLOTS - 2 );
+    live[x] = true;
+}
+
+// Take everything due by 'now', the way the server does: a timer that comes
+// back early goes back in for the rest of its wait.
+static void drain(WebSocketTimerWheel &wheel, unsigned long now)
+{
+    WebSocketTimer *timer;
+    for( int guard = 0; ( timer = wheel.expire( now ) ); guard++ )
+    {
+        int x = timer - timers;
+        CHECK( !timer->scheduled() );
+        CHECK( guard < 10 * TIMERS );
+        if( guard >= 10 * TIMERS )
+            return;
+
+        long early = (long)( timer->deadline() - now );
+        if( early > 0 )
+        {
+            // Up to a tick before, unless it was parked beyond the wheel.
+            CHECK( early <= WEBSOCKET_TIMER_TICK || parked[x] );
+            arm( wheel, x, timer->deadline(), now );
+            continue;
+        }
+
+        CHECK( live[x] );
+        fired[x]++;
+        firedAt[x] = now;
+        live[x] = false;
+    }
+}
+
+// Random deadlines, some beyond a turn of the wheel, with some timers
+// cancelled and some moved, run from 'start' in steps of STEP ms.
+static void run(unsigned long start)
+{
+    WebSocketTimerWheel wheel;
+    memset( fired, 0, sizeof(fired) );
+    memset( live, 0, sizeof(live) );
+
+    // First contact with a clock far from the one it was made with resyncs it.
+    drain( wheel, start );
+
+    const unsigned long turn = (unsigned long)WEBSOCKET_TIMER_TICK * WEBSOCKET_TIMER_SLOTS;
+    unsigned long deadlines[TIMERS];
+    for( int x=0; x < TIMERS; x++ )
+    {
+        deadlines[x] = start + random32() % ( 3 * turn );
+        arm( wheel, x, deadlines[x], start );
+    }
+    for( int x=0; x < TIMERS; x += 7 )
+    {
+        wheel.cancel( &timers[x] );
+        CHECK( !timers[x].scheduled() );
+        live[x] = false;
+    }
+    for( int x=3; x < TIMERS; x += 11 )
+    {
+        deadlines[x] = start + random32() % turn;
+        arm( wheel, x, deadlines[x], start );
+    }
+
+    unsigned long now = start;
+    for( unsigned long elapsed = 0; elapsed <= 4 * turn; elapsed += STEP )
+    {
+        now = start + elapsed;
+        drain( wheel, now );
+    }
+
+    for( int x=0; x < TIMERS; x++ )
+    {
+        if( x % 7 == 0 && x % 11 != 3 )
+        {
+            CHECK( fired[x] == 0 );
+            continue;
+        }
+        CHECK( fired[x] == 1 );
+        CHECK( (long)( firedAt[x] - deadlines[x] ) < WEBSOCKET_TIMER_TICK + STEP );
+    }
+}
+
+// After a stall of several turns everything due comes out at once.
+static void stall()
+{
+    WebSocketTimerWheel wheel;
+    unsigned long start = millis();
+    memset( fired, 0, sizeof(fired) );
+    for( int x=0; x < TIMERS; x++ )
+        arm( wheel, x, start + x * 37, start );
+
+    unsigned long later = start + 10UL * WEBSOCKET_TIMER_TICK * WEBSOCKET_TIMER_SLOTS;
+    drain( wheel, later );
+    for( int x=0; x < TIMERS; x++ )
+        CHECK( fired[x] == 1 );
+    CHECK( wheel.expire( later ) == NULL );
+}
+
+int main()
+{
+    run( millis() );
+    run( 0xffffffffUL - 1000 );      // Where a 32-bit millis() wraps...
+    run( (unsigned long)-1 - 1000 ); // ...and where this one does.
+    stall();
+    return finish( "test_timers" );
+}
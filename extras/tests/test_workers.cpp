@@ -0,0 +1,163 @@
+// Worker strands: each connection's messages are handled one at a time and
+// in order, the replies come back in that order, and a connection with a
+// slow handler doesn't hold up the others.
+//
+//   make test_workers && ./test_workers
+
+#include <unistd.h>
+
+#include "WebSocketServer.h"
+#include "HostTest.h"
+
+#define CLIENTS 6
+#define MESSAGES 30
+#define SLOW_MESSAGES 5
+
+typedef struct {
+    int busy;       // Callbacks running for this connection right now.
+    int next;       // Sequence number the next message should carry.
+    bool slow;
+} Connection;
+
+static Connection connections[CLIENTS];
+static int accepted;
+static int overlaps, misordered;
+
+static pthread_mutex_t threadsLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t threads[16];
+static int threadCount;
+
+static void noteThread()
+{
+    pthread_mutex_lock( &threadsLock );
+    pthread_t self = pthread_self();
+    int x = 0;
+    while( x < threadCount && !pthread_equal( threads[x], self ) )
+        x++;
+    if( x == threadCount && threadCount < 16 )
+        threads[threadCount++] = self;
+    pthread_mutex_unlock( &threadsLock );
+}
+
+// "<client> <sequence>", echoed once checked.
+static void work(WebSocketReply &reply, char *data, word length, void *opaque)
+{
+    Connection *connection = (Connection *)opaque;
+    if( __sync_fetch_and_add( &connection->busy, 1 ) )
+        __sync_fetch_and_add( &overlaps, 1 );
+    noteThread();
+
+    int client = -1, sequence = -1;
+    sscanf( data, "%d %d", &client, &sequence );
+    if( sequence != connection->next++ )
+        __sync_fetch_and_add( &misordered, 1 );
+
+    // The first message says who's on the other end.
+    if( sequence == 0 )
+        connection->slow = client == 0;
+    usleep( connection->slow ? 100000 : sequence % 3 * 200 );
+
+    __sync_fetch_and_sub( &connection->busy, 1 );
+    reply.send( data, length );
+}
+
+static WebSocketWorkers *pool;
+
+static void onConnect(InboundWebSocket &socket, void *)
+{
+    if( accepted < CLIENTS )
+        socket.registerWorkCallback( *pool, &work, &connections[accepted++] );
+}
+
+typedef struct {
+    int index;
+    int replies;
+    unsigned long finishedAt;
+} Client;
+
+static void onReply(WebSocket &, char *data, word, void *opaque)
+{
+    Client *client = (Client *)opaque;
+    int index = -1, sequence = -1;
+    sscanf( data, "%d %d", &index, &sequence );
+    if( index != client->index || sequence != client->replies )
+        misordered++;
+    if( ++client->replies == ( client->index ? MESSAGES : SLOW_MESSAGES ) )
+        client->finishedAt = millis();
+}
+
+int main()
+{
+    WebSocketWorkers workers( 4 );
+    pool = &workers;
+    CHECK( workers.start() );
+
+    word port;
+    EpollServerTransport *listener = listenAnywhere( port, 1 );
+    WebSocketServer *server = new WebSocketServer( *listener, "/", CLIENTS, 256 );
+    server->registerConnectCallback( &onConnect );
+
+    char url[32];
+    snprintf( url, sizeof(url), "ws://127.0.0.1:%u/", port );
+
+    // One at a time, so the server's connections line up with the clients.
+    WebSocket *clients[CLIENTS];
+    Client state[CLIENTS];
+    for( int x=0; x < CLIENTS; x++ )
+    {
+        state[x].index = x;
+        state[x].replies = 0;
+        state[x].finishedAt = 0;
+        clients[x] = new WebSocket( 256 );
+        clients[x]->registerDataCallback( &onReply, &state[x] );
+        CHECK( clients[x]->connect( url ) );
+        for( unsigned long start = millis(); millis() - start < 1000 && clients[x]->status() == WebSocket::HANDSHAKE; )
+        {
+            server->listen();
+            clients[x]->listen();
+        }
+        CHECK( clients[x]->status() == WebSocket::CONNECTED );
+    }
+    CHECK( accepted == CLIENTS );
+
+    for( int x=0; x < CLIENTS; x++ )
+    {
+        int count = x ? MESSAGES : SLOW_MESSAGES;
+        for( int y=0; y < count; y++ )
+        {
+            char message[16];
+            int length = snprintf( message, sizeof(message), "%d %d", x, y );
+            CHECK( clients[x]->send( message, length ) );
+        }
+    }
+
+    bool done = false;
+    for( unsigned long start = millis(); !done && millis() - start < 10000; )
+    {
+        server->listen();
+        done = true;
+        for( int x=0; x < CLIENTS; x++ )
+        {
+            clients[x]->listen();
+            done = done && state[x].finishedAt;
+        }
+    }
+    CHECK( done );
+    CHECK( overlaps == 0 );
+    CHECK( misordered == 0 );
+    CHECK( threadCount > 1 );
+
+    // The others were all answered while the slow one was still going.
+    for( int x=1; x < CLIENTS; x++ )
+        CHECK( state[x].finishedAt && (long)( state[x].finishedAt - state[0].finishedAt ) < 0 );
+
+    for( int x=0; x < CLIENTS; x++ )
+        delete clients[x];
+    for( unsigned long start = millis(); millis() - start < 100; )
+        server->listen();
+    CHECK( server->connectionCount() == 0 );
+    delete server;
+    workers.stop();
+
+    return finish( "test_workers" );
+}
@@ -1,6 +1,5 @@
 #include <string.h>
-#include <avr/io.h>
-#include <avr/pgmspace.h>
+#include "WebSocketPlatform.h"
 #include "sha1.h"
 
 #define SHA1_K0 0x5a827999
@@ -72,7 +71,7 @@ void Sha1Class::addUncounted(uint8_t data) {
   }
 }
 
-#if defined(ARDUINO) && ARDUINO >= 100
+#if !defined(ARDUINO) || ARDUINO >= 100
 size_t
 #else
 void
@@ -80,7 +79,7 @@ void
 Sha1Class::write(uint8_t data) {
   ++byteCount;
   addUncounted(data);
-#if defined(ARDUINO) && ARDUINO >= 100
+#if !defined(ARDUINO) || ARDUINO >= 100
   return 1;
 #endif
 }
@@ -2,7 +2,7 @@
 #define Sha1_h
 
 #include <inttypes.h>
-#include "Print.h"
+#include "WebSocketPlatform.h"
 
 #define HASH_LENGTH 20
 #define BLOCK_LENGTH 64
@@ -23,7 +23,7 @@ class Sha1Class : public Print
     void initHmac(const uint8_t* secret, int secretLength);
     uint8_t* result(void);
     uint8_t* resultHmac(void);
-#if defined(ARDUINO) && ARDUINO >= 100
+#if !defined(ARDUINO) || ARDUINO >= 100
     virtual size_t write(uint8_t);
 #else
     virtual void write(uint8_t);